@@ -94,14 +94,16 @@ void export_track_info(const std::string& file_name,
         {
             file_name_stat += ".nii.gz";
             std::cout << "export TDI to " << file_name_stat << std::endl;
-            tract_model.save_tdi(file_name_stat.c_str(),false,cmd == "tdi_end",handle->trans_to_mni);
+            if(!tract_model.save_tdi(file_name_stat.c_str(),false,cmd == "tdi_end",handle->trans_to_mni))
+                std::cout << "failed to export " << file_name_stat << std::endl;
             continue;
         }
         if(cmd == "tdi2" || cmd == "tdi2_end")
         {
             file_name_stat += ".nii.gz";
             std::cout << "export subvoxel TDI to " << file_name_stat << std::endl;
-            tract_model.save_tdi(file_name_stat.c_str(),true,cmd == "tdi2_end",handle->trans_to_mni);
+            if(!tract_model.save_tdi(file_name_stat.c_str(),true,cmd == "tdi2_end",handle->trans_to_mni))
+                std::cout << "failed to export " << file_name_stat << std::endl;
             continue;
         }
         if(cmd == "tdi_color" || cmd == "tdi2_color")
@@ -160,7 +162,7 @@ int ana(void)
 {
     std::shared_ptr<fib_data> handle = cmd_load_fib(po.get("source"));
     if(!handle.get())
-        return 0;
+        return 1;
     if(po.has("info"))
     {
         auto result = evaluate_fib(handle);
@@ -176,7 +178,7 @@ int ana(void)
         {
             std::cout << "export information from " << po.get("atlas") << std::endl;
             if(!atl_load_atlas(po.get("atlas")))
-                return 0;
+                return 1;
             for(unsigned int i = 0;i < atlas_list.size();++i)
             {
                 for(unsigned int j = 0;j < atlas_list[i].get_list().size();++j)
@@ -188,7 +190,7 @@ int ana(void)
                     if(!load_region(handle,*region.get(),region_name))
                     {
                         std::cout << "Fail to load the ROI file:" << region_name << std::endl;
-                        return 0;
+                        return 1;
                     }
                     region_list.push_back(atlas_list[i].get_list()[j]);
                     regions.push_back(region);
@@ -208,7 +210,7 @@ int ana(void)
                 if(!load_region(handle,*region.get(),roi_list[i]))
                 {
                     std::cout << "Fail to load the ROI file." << std::endl;
-                    return 0;
+                    return 1;
                 }
                 region_list.push_back(roi_list[i]);
                 regions.push_back(region);
@@ -229,7 +231,7 @@ int ana(void)
     if(!po.has("tract"))
     {
         std::cout << "No tract file or ROI file assigned." << std::endl;
-        return 0;
+        return 1;
     }
 
     TractModel tract_model(handle);
@@ -239,12 +241,13 @@ int ana(void)
         if(!QFileInfo(file_name.c_str()).exists())
         {
             std::cout << file_name << " does not exist. terminating..." << std::endl;
-            return 0;
+            return 1;
         }
-        if (!tract_model.load_from_file(file_name.c_str()))
+        // --tract_count loads an evenly spaced subset of large tract files
+        if (!tract_model.load_from_file(file_name.c_str(),false,std::max<int>(0,po.get("tract_count",int(0)))))
         {
             std::cout << "Cannot open file " << file_name << std::endl;
-            return 0;
+            return 1;
         }
         std::cout << file_name << " loaded" << std::endl;
 
@@ -256,7 +259,7 @@ int ana(void)
     if(tract_model.get_visible_track_count() == 0)
     {
         std::cout << "No tracks remained after ROI selection." << std::endl;
-        return 0;
+        return 1;
     }
     return trk_post(handle,tract_model,po.get("output"));
 }
@@ -144,12 +144,15 @@ int atl(void)
         if(name_list.empty())
         {
             std::cout << "No FIB file found in the directory." << std::endl;
-            return 0;
+            return 1;
         }
         dir += "/template";
         const char* msg = odf_average(dir.c_str(),name_list);
         if(msg)
+        {
             std::cout << msg << std::endl;
+            return 1;
+        }
         return 0;
     }
     if(cmd=="db")
@@ -163,7 +166,7 @@ int atl(void)
         if(name_list.empty())
         {
             std::cout << "No FIB file found in the directory." << std::endl;
-            return 0;
+            return 1;
         }
         // Determine the template
         std::string tm;
@@ -174,7 +177,7 @@ int atl(void)
             if(!fib.load_from_file(name_list[0].c_str()))
             {
                 std::cout << "Invalid FIB file format:" << name_list[0] << std::endl;
-                return 0;
+                return 1;
             }
             if(fib.vs[0] < 1.5f)
                 tm = fib_template_file_name_1mm.c_str();
@@ -188,30 +191,25 @@ int atl(void)
         if(!data->create_database(tm.c_str()))
         {
             std::cout << "Error in initializing the database:" << data->error_msg << std::endl;
-            return 0;
+            return 1;
         }
         // Extracting metrics
         std::string index_name = po.get("index_name","sdf");
         std::cout << "Extracting index:" << index_name << std::endl;
         data->handle->db.index_name = index_name;
+        std::vector<std::string> subject_names(name_list.size());
         for (unsigned int index = 0;index < name_list.size();++index)
-        {
-            std::cout << "Reading " << name_list[index] << std::endl;
-            if(!data->handle->db.add_subject_file(name_list[index],
-                QFileInfo(name_list[index].c_str()).baseName().toStdString()))
-            {
-                std::cout << "Error loading subject fib files:" << data->handle->error_msg << std::endl;
-                return 0;
-            }
-        }
+            subject_names[index] = QFileInfo(name_list[index].c_str()).baseName().toStdString();
         // Output
         std::string output = dir;
         output += "/";
         output += "connectometry.db.fib.gz";
-        if(!data->handle->db.save_subject_data(output.c_str()))
+        if(!data->handle->db.create_db_from_files(output.c_str(),name_list,subject_names,
+                    po.get("thread_count",int(std::thread::hardware_concurrency())),
+                    po.get("out_of_core",0)))
         {
-            std::cout << "Error saving the db file:" << data->handle->error_msg << std::endl;
-            return 0;
+            std::cout << "Error creating the db file:" << data->handle->error_msg << std::endl;
+            return 1;
         }
         std::cout << "Connectometry db created:" << output << std::endl;
         return 0;
@@ -222,10 +220,10 @@ int atl(void)
         if(!handle.get())
         {
             std::cout << handle->error_msg << std::endl;
-            return 0;
+            return 1;
         }
         if(!atl_load_atlas(po.get("atlas")))
-            return 0;
+            return 1;
 
         atl_save_mapping(po.get("source"),handle->dim,
                          handle->get_mni_mapping(),handle->trans_to_mni,handle->vs,
@@ -238,17 +236,17 @@ int atl(void)
         if(!handle.get())
         {
             std::cout << handle->error_msg << std::endl;
-            return 0;
+            return 1;
         }
         if(!handle->is_qsdr)
         {
             std::cout << "Only QSDR reconstructed FIB file is supported." << std::endl;
-            return 0;
+            return 1;
         }
         if(handle->native_position.empty())
         {
             std::cout << "No mapping information found. Please reconstruct QSDR with mapping checked in advanced option." << std::endl;
-            return 0;
+            return 1;
         }
         TractModel tract_model(handle);
         std::string file_name = po.get("tract");
@@ -257,7 +255,7 @@ int atl(void)
             if (!tract_model.load_from_file(file_name.c_str()))
             {
                 std::cout << "Cannot open file " << file_name << std::endl;
-                return 0;
+                return 1;
             }
             std::cout << file_name << " loaded" << std::endl;
         }
@@ -267,5 +265,5 @@ int atl(void)
         return 0;
     }
     std::cout << "Unknown command:" << cmd << std::endl;
-    return 0;
+    return 1;
 }
@@ -0,0 +1,145 @@
+#include <QApplication>
+#include <QFileInfo>
+#include <QDir>
+#include <iostream>
+#include <fstream>
+#include <chrono>
+#include <future>
+#include <map>
+#include "fib_data.hpp"
+#include "program_option.hpp"
+
+int run_source(std::shared_ptr<QApplication> gui);
+// fib files kept in memory across batch jobs, used by cmd_load_fib
+std::map<std::string,std::shared_future<std::shared_ptr<fib_data> > > resident_fib_list;
+
+static bool is_fib_file(const std::string& file_name)
+{
+    QString name(file_name.c_str());
+    return name.endsWith(".fib.gz") || name.endsWith(".fib");
+}
+
+/**
+ run jobs listed in --source (or stdin), one command line per line, e.g.
+ --action=trk --source=subject1.fib.gz --fiber_count=10000 --output=subject1.trk.gz
+ --action=ana --source=subject1.fib.gz --tract=subject1.trk.gz --export=stat
+ A fib file stays loaded, with its MNI mapping, until its last job ends. The next
+ --prefetch fib files are loaded on background threads while the current job runs.
+ Jobs themselves run one at a time: every action reads the global po and
+ run_source changes the working directory.
+ */
+int batch(void)
+{
+    std::ifstream file;
+    std::istream* in = &std::cin;
+    QDir job_dir(QDir::current());
+    if(po.has("source"))
+    {
+        job_dir = QFileInfo(po.get("source").c_str()).absoluteDir();
+        file.open(po.get("source").c_str());
+        if(!file)
+        {
+            std::cout << "Cannot open job file " << po.get("source") << std::endl;
+            return 1;
+        }
+        in = &file;
+    }
+    else
+        std::cout << "reading jobs from stdin" << std::endl;
+    unsigned int prefetch = std::max<int>(0,po.get("prefetch",int(2)));
+    program_option batch_option = po;
+
+    std::vector<program_option> jobs;
+    std::vector<std::string> job_fib;
+    for(std::string line;std::getline(*in,line);)
+    {
+        line.erase(0,line.find_first_not_of(" \t\r"));
+        line.erase(line.find_last_not_of(" \t\r")+1);
+        if(line.empty() || line[0] == '#')
+            continue;
+        program_option job;
+        if(!job.parse(line))
+        {
+            std::cout << job.error_msg << " at job " << jobs.size()+1 << std::endl;
+            return 1;
+        }
+        std::string action = job.get("action");
+        if(action == "batch" || action == "cnt" || action == "vis")
+        {
+            std::cout << "--action=" << action << " is not supported in batch mode" << std::endl;
+            return 1;
+        }
+        // sources are relative to the job file, or to the working directory for stdin
+        if(job.has("source"))
+            job.set("source",job_dir.absoluteFilePath(job.get("source").c_str()).toStdString());
+        std::string source = job.get("source");
+        // connectometry tracking adds indices to the fib, so it gets its own copy
+        job_fib.push_back(is_fib_file(source) && source.find('*') == std::string::npos &&
+                          !job.has("connectometry_source") ? source : std::string());
+        jobs.push_back(job);
+    }
+    std::cout << jobs.size() << " jobs" << std::endl;
+
+    // fib files in the order of their first use and the last job using them
+    std::vector<std::string> fib_order;
+    std::map<std::string,unsigned int> last_use;
+    for(unsigned int i = 0;i < jobs.size();++i)
+        if(!job_fib[i].empty())
+        {
+            if(!last_use.count(job_fib[i]))
+                fib_order.push_back(job_fib[i]);
+            last_use[job_fib[i]] = i;
+        }
+
+    auto begin_time = std::chrono::high_resolution_clock::now();
+    unsigned int next_fib = 0,failed = 0;
+    for(unsigned int i = 0;i < jobs.size();++i)
+    {
+        // load the fib files of this job and the next few on the pool
+        for(;next_fib < fib_order.size() &&
+             (resident_fib_list.size() <= prefetch || fib_order[next_fib] == job_fib[i]);++next_fib)
+        {
+            std::string file_name = fib_order[next_fib];
+            resident_fib_list[file_name] = std::async(std::launch::async,[file_name]()
+            {
+                std::shared_ptr<fib_data> handle(new fib_data);
+                if(!handle->load_from_file(file_name.c_str()))
+                    handle.reset(); // cmd_load_fib reloads it and reports the error
+                return handle;
+            }).share();
+        }
+
+        auto job_time = std::chrono::high_resolution_clock::now();
+        std::cout << "=======================================" << std::endl;
+        std::cout << "job " << i+1 << "/" << jobs.size() << ": --action=" << jobs[i].get("action")
+                  << " --source=" << jobs[i].get("source") << std::endl;
+        po = jobs[i];
+        int result = 1;
+        try
+        {
+            result = run_source(std::shared_ptr<QApplication>());
+        }
+        catch(const std::exception& e)
+        {
+            std::cout << e.what() << std::endl;
+        }
+        if(result != 0)
+            ++failed;
+        std::cout << "job " << i+1 << " finished in "
+                  << std::chrono::duration_cast<std::chrono::milliseconds>(
+                         std::chrono::high_resolution_clock::now()-job_time).count()/1000.0
+                  << " seconds" << std::endl;
+
+        // release fib files that no later job uses
+        if(!job_fib[i].empty() && last_use[job_fib[i]] == i)
+            resident_fib_list.erase(job_fib[i]);
+    }
+    resident_fib_list.clear();
+    po = batch_option;
+    std::cout << "=======================================" << std::endl;
+    std::cout << jobs.size() << " jobs finished in "
+              << std::chrono::duration_cast<std::chrono::milliseconds>(
+                     std::chrono::high_resolution_clock::now()-begin_time).count()/1000.0
+              << " seconds, " << failed << " with errors" << std::endl;
+    return failed ? 1 : 0;
+}
@@ -49,7 +49,7 @@ int cnn(void)
     if(!nn_data.load_from_file<gz_istream>(train_file_name.c_str()))
     {
         std::cout << "Cannot load training data at " << train_file_name << std::endl;
-        return 0;
+        return 1;
     }
     std::cout << "A total of "<< nn_data.size() << " training data are loaded." << std::endl;
     if(po.has("test"))
@@ -58,7 +58,7 @@ int cnn(void)
         if(!nn_test.load_from_file<gz_istream>(test_file_name.c_str()))
         {
             std::cout << "Cannot load testing data at " << test_file_name << std::endl;
-            return 0;
+            return 1;
         }
     }
     std::cout << "A total of "<< nn_test.size() << " testing data are loaded." << std::endl;
@@ -70,7 +70,7 @@ int cnn(void)
         if(!in)
         {
             std::cout << "Cannot open " << network << std::endl;
-            return 0;
+            return 1;
         }
         std::string line;
         while(std::getline(in,line))
@@ -115,7 +115,7 @@ int cnn(void)
     float test_error = 0.0,train_error = 0.0;
     tipl::ml::network nn;
     if(!train_cnn(network_list[0],nn,nn_data,nn_test,test_error,train_error))
-        return 0;
+        return 1;
     std::cout << "Training finished" << std::endl;
     std::cout << test_error << "," << train_error << "," << network_list[0] << std::endl;
 
@@ -151,10 +151,42 @@ int cnt(void)
 
 
 
+    // run a subset of permutations in this process (--shard_id, --shard_count)
+    // or merge the shards from all processes (--merge_shards=shard0.mat,shard1.mat,...)
+    if(po.has("shard_count"))
+    {
+        vbc->vbc->shard_count = po.get("shard_count",1);
+        vbc->vbc->shard_id = po.get("shard_id",0);
+        if(vbc->vbc->shard_count == 0 || vbc->vbc->shard_id >= vbc->vbc->shard_count)
+        {
+            std::cout << "invalid shard_id or shard_count" << std::endl;
+            return 0;
+        }
+        std::cout << "shard=" << vbc->vbc->shard_id << "/" << vbc->vbc->shard_count << std::endl;
+    }
+    if(po.has("merge_shards"))
+    {
+        QStringList shard_list = QString(po.get("merge_shards").c_str()).split(",");
+        for(int i = 0;i < shard_list.size();++i)
+            vbc->vbc->shard_files.push_back(shard_list[i].toStdString());
+        std::cout << "merging " << shard_list.size() << " shards" << std::endl;
+    }
+
     vbc->on_run_clicked();
     std::cout << vbc->vbc->report << std::endl;
     std::cout << "running connectometry" << std::endl;
     vbc->vbc->wait();
+    if(vbc->vbc->shard_count > 1)
+    {
+        std::string shard_file = po.has("shard_output") ? po.get("shard_output") :
+                vbc->vbc->output_file_name+".shard"+std::to_string(vbc->vbc->shard_id)+".mat";
+        std::cout << "output shard to " << shard_file << std::endl;
+        if(!vbc->vbc->save_shard(shard_file.c_str()))
+            std::cout << vbc->vbc->error_msg << std::endl;
+        vbc->close();
+        vbc.reset(0);
+        return 0;
+    }
     std::cout << "output results" << std::endl;
     vbc->calculate_FDR();
     std::cout << "close GUI" << std::endl;
@@ -1,52 +1,302 @@
 #include <QString>
 #include <QStringList>
 #include <QFileInfo>
+#include <future>
+#include <thread>
 #include "program_option.hpp"
 #include "libs/dsi/image_model.hpp"
+#include "fib_data.hpp"
 
 QStringList search_files(QString dir,QString filter);
 
+struct src_qc_result{
+    bool loaded = false;
+    tipl::vector<3,int> dim;
+    tipl::vector<3> vs;
+    int dwi_count = 0;
+    float max_b = 0.0f;
+    float neighboring_dwi_corr = 0.0f;
+    size_t bad_slice_count = 0;
+};
+
+static bool check_src_in_memory(const std::string& file_name,unsigned int thread_count,src_qc_result& result)
+{
+    ImageModel handle;
+    if (!handle.load_from_file(file_name.c_str()))
+        return false;
+    handle.voxel.thread_count = thread_count;
+    result.dim = tipl::vector<3,int>(handle.voxel.dim.begin());
+    result.vs = handle.voxel.vs;
+    result.dwi_count = handle.src_bvalues.size();
+    result.max_b = *std::max_element(handle.src_bvalues.begin(),handle.src_bvalues.end());
+    result.neighboring_dwi_corr = handle.quality_control_neighboring_dwi_corr();
+    result.bad_slice_count = handle.get_bad_slices().size();
+    return true;
+}
+
+static bool get_image_index(const mat_record& record,const tipl::geometry<3>& dim,unsigned int& index)
+{
+    if(record.name.length() <= 5 || record.name.compare(0,5,"image") != 0 ||
+       record.name.find_first_not_of("0123456789",5) != std::string::npos ||
+       (record.type/10)%10 != 4 || size_t(record.rows)*size_t(record.cols) != dim.size())
+        return false;
+    index = std::stoi(record.name.substr(5));
+    return true;
+}
+
+// read slices [z_from,z_to) of every DWI, skipping the rest of the file
+static bool read_src_slab(const std::string& file_name,const tipl::geometry<3>& dim,int z_from,int z_to,
+                          std::vector<std::vector<unsigned short> >& dwi)
+{
+    gz_istream in;
+    if(!in.open(file_name.c_str()))
+        return false;
+    size_t plane_bytes = dim.plane_size()*sizeof(unsigned short);
+    mat_record record;
+    while(record.read_header(in))
+    {
+        size_t begin = in.cur();
+        unsigned int index = 0;
+        if(get_image_index(record,dim,index) && index < dwi.size())
+        {
+            dwi[index].resize(size_t(z_to-z_from)*dim.plane_size());
+            in.seek(long(begin+z_from*plane_bytes));
+            if(!in.read(&dwi[index][0],dwi[index].size()*sizeof(unsigned short)))
+                return false;
+        }
+        in.seek(long(begin+record.data_size()));
+    }
+    for(unsigned int index = 0;index < dwi.size();++index)
+        if(dwi[index].empty())
+            return false;
+    return true;
+}
+
+// bounded-memory check: one pass for the b-table and mask, then one pass per slab,
+// holding only a slab of each DWI
+static bool check_src_by_slab(const std::string& file_name,size_t memory_limit,unsigned int thread_count,src_qc_result& result)
+{
+    ImageModel handle;
+    std::vector<std::shared_ptr<mat_record> > header;
+    {
+        gz_istream in;
+        if(!in.open(file_name.c_str()))
+            return false;
+        bool has_header = false;
+        for(std::shared_ptr<mat_record> record(new mat_record);record->read_header(in);record.reset(new mat_record))
+        {
+            unsigned int index = 0;
+            if(record->name.compare(0,5,"image") == 0)
+            {
+                if(!has_header)
+                {
+                    for(auto& each : header)
+                        each->add_to(handle.mat_reader);
+                    if(!handle.read_src_header())
+                        return false;
+                    has_header = true;
+                    // the stored mask does not need the DWI sum
+                    unsigned int row,col;
+                    const unsigned char* mask_ptr = 0;
+                    if(handle.mat_reader.read("mask",row,col,mask_ptr))
+                        break;
+                    handle.dwi_sum.resize(handle.voxel.dim);
+                }
+                if(get_image_index(*record,handle.voxel.dim,index))
+                {
+                    if(!record->read_data(in))
+                        return false;
+                    const unsigned short* I = (const unsigned short*)record->data.data();
+                    tipl::par_for2(handle.dwi_sum.size(),[&](unsigned int pos,unsigned int)
+                    {
+                        handle.dwi_sum[pos] += I[pos];
+                    },thread_count);
+                    continue;
+                }
+            }
+            if(!record->read_data(in))
+                return false;
+            header.push_back(record);
+            if(has_header)
+                record->add_to(handle.mat_reader);
+        }
+        if(!has_header)
+            return false;
+    }
+    const tipl::geometry<3>& dim = handle.voxel.dim;
+    {
+        unsigned int row,col;
+        const unsigned char* mask_ptr = 0;
+        if(handle.mat_reader.read("mask",row,col,mask_ptr))
+        {
+            handle.voxel.mask.resize(dim);
+            if(row*col == dim.size())
+                std::copy(mask_ptr,mask_ptr+row*col,handle.voxel.mask.begin());
+        }
+        else
+        {
+            handle.normalize_dwi_sum();
+            handle.voxel.calculate_mask(handle.dwi_sum);
+        }
+        handle.dwi_sum = tipl::image<float,3>();
+    }
+    result.dim = tipl::vector<3,int>(dim.begin());
+    result.vs = handle.voxel.vs;
+    result.dwi_count = handle.src_bvalues.size();
+    result.max_b = *std::max_element(handle.src_bvalues.begin(),handle.src_bvalues.end());
+
+    std::vector<std::pair<int,int> > corr_pairs;
+    handle.get_neighboring_dwi_pairs(corr_pairs);
+    std::vector<int> order;
+    handle.get_sorted_dwi_index(order);
+    tipl::image<float,2> cor_values(tipl::geometry<2>(order.size(),dim.depth()));
+    // count, sum x, sum y, sum xx, sum yy, and sum xy of each DWI pair within the mask
+    std::vector<std::vector<double> > pair_sum(corr_pairs.size(),std::vector<double>(6));
+
+    size_t plane_bytes = handle.src_bvalues.size()*dim.plane_size()*sizeof(unsigned short);
+    int slab_size = std::max<int>(1,int(memory_limit/plane_bytes)-2);
+    for(int z_from = 0;z_from < dim.depth();z_from += slab_size)
+    {
+        int z_to = std::min<int>(dim.depth(),z_from+slab_size);
+        // one more slice on each side for the slice-to-slice correlation
+        int slab_from = std::max<int>(0,z_from-1),slab_to = std::min<int>(dim.depth(),z_to+1);
+        std::vector<std::vector<unsigned short> > dwi(handle.src_bvalues.size());
+        if(!read_src_slab(file_name,dim,slab_from,slab_to,dwi))
+            return false;
+
+        std::vector<const unsigned short*> sorted_dwi;
+        for(unsigned int i = 0;i < order.size();++i)
+            sorted_dwi.push_back(&dwi[order[i]][0]);
+        ImageModel::get_slice_correlation(sorted_dwi,tipl::geometry<3>(dim.width(),dim.height(),slab_to-slab_from),
+                                          z_from-slab_from,z_to-slab_from,slab_from,cor_values,thread_count);
+
+        size_t from = size_t(z_from)*dim.plane_size(),to = size_t(z_to)*dim.plane_size();
+        size_t offset = size_t(slab_from)*dim.plane_size();
+        tipl::par_for2(corr_pairs.size(),[&](int index,int)
+        {
+            const unsigned short* I1 = &dwi[corr_pairs[index].first][0];
+            const unsigned short* I2 = &dwi[corr_pairs[index].second][0];
+            double* sum = &pair_sum[index][0];
+            for(size_t i = from;i < to;++i)
+                if(handle.voxel.mask[i])
+                {
+                    double x = I1[i-offset],y = I2[i-offset];
+                    sum[0] += 1.0;
+                    sum[1] += x;
+                    sum[2] += y;
+                    sum[3] += x*x;
+                    sum[4] += y*y;
+                    sum[5] += x*y;
+                }
+        },thread_count);
+    }
+    float self_cor = 0.0f;
+    for(unsigned int index = 0;index < pair_sum.size();++index)
+    {
+        const double* sum = &pair_sum[index][0];
+        double sd = std::sqrt((sum[0]*sum[3]-sum[1]*sum[1])*(sum[0]*sum[4]-sum[2]*sum[2]));
+        self_cor += sd == 0.0 ? 0.0f : float((sum[0]*sum[5]-sum[1]*sum[2])/sd);
+    }
+    result.neighboring_dwi_corr = self_cor/(float)pair_sum.size();
+    result.bad_slice_count = ImageModel::select_bad_slices(cor_values,handle.voxel.mask).size();
+    return true;
+}
+
+// size of all DWIs from the dimension and b-table records ahead of the first image
+static bool get_src_dwi_size(const std::string& file_name,size_t& dwi_size)
+{
+    ImageModel handle;
+    std::vector<std::shared_ptr<mat_record> > header;
+    gz_istream in;
+    if(!in.open(file_name.c_str()))
+        return false;
+    for(std::shared_ptr<mat_record> record(new mat_record);record->read_header(in);record.reset(new mat_record))
+    {
+        if(record->name.compare(0,5,"image") == 0)
+            break;
+        if(!record->read_data(in))
+            return false;
+        record->add_to(handle.mat_reader);
+        header.push_back(record);
+    }
+    if(!handle.read_src_header())
+        return false;
+    dwi_size = handle.voxel.dim.size()*handle.src_bvalues.size()*sizeof(unsigned short);
+    return true;
+}
+
+// SRC files whose DWIs exceed memory_limit are checked slab-by-slab
+static src_qc_result check_src(const std::string& file_name,size_t memory_limit,unsigned int thread_count)
+{
+    src_qc_result result;
+    try
+    {
+        bool by_slab = false;
+        size_t dwi_size = 0;
+        if(memory_limit)
+            by_slab = get_src_dwi_size(file_name,dwi_size) && dwi_size > memory_limit;
+        result.loaded = by_slab ? check_src_by_slab(file_name,memory_limit,thread_count,result) :
+                                  check_src_in_memory(file_name,thread_count,result);
+    }
+    catch(const std::exception&)
+    {
+        result.loaded = false;
+    }
+    return result;
+}
 
 std::string quality_check_src_files(QString dir)
 {
     std::ostringstream out;
     QStringList filenames = search_files(dir,"*src.gz");
     out << "FileName\tImage dimension\tResolution\tDWI count\tMax b-value\tB-table matched\tNeighboring DWI correlation\t# Bad Slices" << std::endl;
+    // a few files are loaded and checked on worker threads, and reported in order.
+    // Each file holds its DWIs in memory, so the number in flight stays small and
+    // the threads are shared among them.
+    int thread_count = std::max<int>(1,po.get("thread_count",int(std::thread::hardware_concurrency())));
+    int file_count = std::min<int>(thread_count,std::max<int>(1,po.get("qc_files",int(2))));
+    unsigned int file_thread_count = std::max<int>(1,thread_count/file_count);
+    size_t memory_limit = size_t(std::max<int>(0,po.get("qc_memory",int(0))))*1024*1024/file_count;
+    std::vector<std::future<src_qc_result> > results(filenames.size());
     int dwi_count = 0;
     float max_b = 0;
-    for(int i = 0;check_prog(i,filenames.size());++i)
+    for(int i = 0,next = 0;check_prog(i,filenames.size());++i)
     {
+        for(;next < filenames.size() && next < i+file_count;++next)
+        {
+            std::string file_name = filenames[next].toStdString();
+            results[next] = std::async(std::launch::async,[file_name,memory_limit,file_thread_count]()
+            {
+                return check_src(file_name,memory_limit,file_thread_count);
+            });
+        }
+        src_qc_result result = results[i].get();
         out << QFileInfo(filenames[i]).baseName().toStdString() << "\t";
-        ImageModel handle;
-        unique_prog(true);
-        if (!handle.load_from_file(filenames[i].toStdString().c_str()))
+        if (!result.loaded)
         {
             out << "Cannot load SRC file"  << std::endl;
             continue;
         }
-        unique_prog(false);
         // output image dimension
-        out << tipl::vector<3,int>(handle.voxel.dim.begin()) << "\t";
+        out << result.dim << "\t";
         // output image resolution
-        out << handle.voxel.vs << "\t";
+        out << result.vs << "\t";
         // output DWI count
-        int cur_dwi_count = 0;
-        out << (cur_dwi_count = handle.src_bvalues.size()) << "\t";
+        out << result.dwi_count << "\t";
         if(i == 0)
-            dwi_count = cur_dwi_count;
+            dwi_count = result.dwi_count;
 
         // output max_b
-        float cur_max_b = 0;
-        out << (cur_max_b = *std::max_element(handle.src_bvalues.begin(),handle.src_bvalues.end())) << "\t";
+        out << result.max_b << "\t";
         if(i == 0)
-            max_b = cur_max_b;
+            max_b = result.max_b;
         // check shell structure
-        out << (max_b == cur_max_b && cur_dwi_count == dwi_count ? "Yes\t" : "No\t");
+        out << (max_b == result.max_b && result.dwi_count == dwi_count ? "Yes\t" : "No\t");
 
         // calculate neighboring DWI correlation
-        out << handle.quality_control_neighboring_dwi_corr() << "\t";
+        out << result.neighboring_dwi_corr << "\t";
 
-        out << handle.get_bad_slices().size() << "\t";
+        out << result.bad_slice_count << "\t";
 
         out << std::endl;
     }
@@ -55,15 +305,20 @@ std::string quality_check_src_files(QString dir)
 
 /**
  perform reconstruction
+ --thread_count: number of threads, shared by the SRC files checked at the same time
+ --qc_files: number of SRC files checked at the same time (default 2)
+ --qc_memory: memory budget in MB shared by the files in flight. A file whose DWI data
+   exceeds its share is checked slab-by-slab, and each slab decompresses the file again,
+   so the reading time grows with the number of slabs (DWI size / share).
  */
 int qc(void)
 {
-    std::string file_name = po.get("source");
-    if(QFileInfo(file_name.c_str()).isDir())
+    std::string dir = po.get("source");
+    if(QFileInfo(dir.c_str()).isDir())
     {
-        file_name += "\\src_report.txt";
+        std::string file_name = dir + "/src_report.txt";
         std::ofstream out(file_name.c_str());
-        out << quality_check_src_files(file_name.c_str());
+        out << quality_check_src_files(dir.c_str());
     }
     return 0;
 }
@@ -184,7 +184,7 @@ int rec(void)
         if(!QFileInfo(template_file_name.c_str()).exists())
         {
             std::cout << "template does not exist." << std::endl;
-            return 0;
+            return 1;
         }
         handle->voxel.external_template = template_file_name;
     }
@@ -224,10 +224,10 @@ int rec(void)
             if(name_value.size() != 2)
             {
                 std::cout << "Invalid command: " << file_list[i].toStdString() << std::endl;
-                return 0;
+                return 1;
             }
             if(!add_other_image(handle.get(),name_value[0],name_value[1],true))
-                return 0;
+                return 1;
         }
     }
     if(po.has("mask"))
@@ -244,7 +244,7 @@ int rec(void)
             ROIRegion roi(fib_handle);
             std::cout << "reading mask..." << mask_file << std::endl;
             if(!load_region(fib_handle,roi,mask_file))
-                return 0;
+                return 1;
             tipl::image<unsigned char,3> external_mask;
             roi.SaveToBuffer(external_mask);
             if(external_mask.geometry() != handle->voxel.dim)
@@ -259,7 +259,7 @@ int rec(void)
         if(!po.has("t1w"))
         {
             std::cout << "Please assign --t1w with T1W file for CDM normalization or assign --reg_method=3 to use CDM without T1W" << std::endl;
-            return 0;
+            return 1;
         }
         handle->voxel.t1w_file_name = po.get("t1w");
     }
@@ -271,7 +271,7 @@ int rec(void)
         if(!in.load_from_file(file_name.c_str()))
         {
             std::cout << "Failed to read " << file_name << std::endl;
-            return 0;
+            return 1;
         }
         tipl::image<float,3> I;
         tipl::vector<3> vs;
@@ -299,5 +299,6 @@ int rec(void)
         std::cout << "Reconstruction finished." << std::endl;
     else
         std::cout << msg << std::endl;
-    return 0;
+    // reconstruction() returns the output file name on success
+    return (!msg || QFileInfo(msg).exists()) ? 0 : 1;
 }
@@ -4,6 +4,8 @@
 #include <iostream>
 #include <iterator>
 #include <string>
+#include <map>
+#include <future>
 #include "tipl/tipl.hpp"
 #include "tracking/region/Regions.h"
 #include "libs/tracking/tract_model.hpp"
@@ -195,8 +197,23 @@ void get_connectivity_matrix(std::shared_ptr<fib_data> handle,
 // test example
 // --action=trk --source=./test/20100129_F026Y_WANFANGYUN.src.gz.odf8.f3rec.de0.dti.fib.gz --method=0 --fiber_count=5000
 
+extern std::map<std::string,std::shared_future<std::shared_ptr<fib_data> > > resident_fib_list;
 std::shared_ptr<fib_data> cmd_load_fib(const std::string file_name)
 {
+    // fib files kept loaded by --action=batch
+    auto resident = resident_fib_list.find(file_name);
+    if(resident != resident_fib_list.end() && !po.has("connectometry_source"))
+    {
+        std::shared_ptr<fib_data> handle = resident->second.get();
+        if(handle.get())
+        {
+            std::cout << "using loaded " << file_name << std::endl;
+            handle->dir.set_tracking_index(0);
+            handle->dir.dt_fa.clear();
+            handle->dir.dt_cur_index = 0;
+            return handle;
+        }
+    }
     std::shared_ptr<fib_data> handle(new fib_data);
     std::cout << "loading " << file_name << "..." <<std::endl;
     if(!QFileInfo(file_name.c_str()).exists())
@@ -347,7 +364,7 @@ int trk_post(std::shared_ptr<fib_data> handle,
                 if(!new_slice.initialize(files,false))
                 {
                     std::cout << "Error reading ref image file:" << po.get("ref") << std::endl;
-                    return 0;
+                    return 1;
                 }
                 new_slice.thread->wait();
                 new_slice.update();
@@ -364,6 +381,7 @@ int trk_post(std::shared_ptr<fib_data> handle,
                 if (!tract_model.save_tracts_to_file(f.c_str()))
                 {
                     std::cout << "Cannot save tracks as " << f << ". Please check write permission, directory, and disk space." << std::endl;
+                    return 1;
                 }
                 if(QFileInfo(f.c_str()).exists())
                     std::cout << "File saved to " << f << std::endl;
@@ -424,14 +442,14 @@ int trk(void)
 
     std::shared_ptr<fib_data> handle = cmd_load_fib(po.get("source"));
     if(!handle.get())
-        return 0;
+        return 1;
     if (po.has("threshold_index"))
     {
         std::cout << "setting index to " << po.get("threshold_index") << std::endl;
         if(!handle->dir.set_tracking_index(po.get("threshold_index")))
         {
             std::cout << "failed...cannot find the index" << std::endl;
-            return 0;
+            return 1;
         }
     }
     if (po.has("dt_threshold_index"))
@@ -440,7 +458,7 @@ int trk(void)
         if(!handle->dir.set_dt_index(po.get("dt_threshold_index")))
         {
             std::cout << "failed...cannot find the dt index" << std::endl;
-            return 0;
+            return 1;
         }
     }
 
@@ -560,6 +578,52 @@ int trk(void)
             return -1;
         }
         connectometry_threshold = QString(po.get("connectometry_threshold").c_str()).split(",");
+        auto run_cnt_tracking = [&](const std::string& output_prefix)
+        {
+            for(unsigned int j = 0;j < connectometry_threshold.size();++j)
+            {
+                double t = connectometry_threshold[j].toDouble();
+                handle->dir.set_tracking_index(handle->dir.index_data.size()-((t > 0) ? 2:1));
+                std::cout << "mapping track with " << ((t > 0) ? "increased":"decreased") << " connectivity at " << std::fabs(t) << std::endl;
+                std::cout << "start tracking." << std::endl;
+                tracking_thread.param.threshold = std::fabs(t);
+                tracking_thread.run(tract_model.get_fib(),po.get("thread_count",int(std::thread::hardware_concurrency())),true);
+                tracking_thread.fetchTracks(&tract_model);
+                std::ostringstream out;
+                out << output_prefix << "." << cnt_type.toStdString()
+                        << ((t > 0) ? "inc":"dec") << std::fabs(t) << ".trk.gz";
+                if(!tract_model.save_tracts_to_file(out.str().c_str()))
+                {
+                    std::cout << "Cannot save file to " << out.str()
+                              << ". Please check write permission, directory, and disk space." << std::endl;
+                    return false;
+                }
+                std::vector<std::vector<float> > tmp;
+                tract_model.release_tracts(tmp);
+            }
+            return true;
+        };
+        // one subject (the first file) compared against all the other files
+        if(cnt_type == "ivr")
+        {
+            std::vector<std::string> ref_file_names;
+            for(unsigned int i = 1;i < cnt_file_name.size();++i)
+                ref_file_names.push_back(cnt_file_name[i].toLocal8Bit().begin());
+            connectometry_result cnt;
+            std::cout << "loading individual file:" << cnt_file_name[0].toStdString() << std::endl;
+            if(!cnt.individual_vs_individuals(handle,cnt_file_name[0].toLocal8Bit().begin(),ref_file_names,0,
+                    [&](unsigned int i)
+                    {
+                        std::cout << "compared with reference file:" << ref_file_names[i] << std::endl;
+                        return run_cnt_tracking(cnt_file_name[0].toStdString() + "." + QFileInfo(ref_file_names[i].c_str()).baseName().toStdString());
+                    }))
+            {
+                if(!cnt.error_msg.empty())
+                    std::cout << "Error loading connectometry file:" << cnt.error_msg <<std::endl;
+                return -1;
+            }
+            return 0;
+        }
         for(unsigned int i = 0;i < cnt_file_name.size();++i)
         {
             connectometry_result cnt;
@@ -585,27 +649,8 @@ int trk(void)
                 }
                 ++i;
             }
-            for(unsigned int j = 0;j < connectometry_threshold.size();++j)
-            {
-                double t = connectometry_threshold[j].toDouble();
-                handle->dir.set_tracking_index(handle->dir.index_data.size()-((t > 0) ? 2:1));
-                std::cout << "mapping track with " << ((t > 0) ? "increased":"decreased") << " connectivity at " << std::fabs(t) << std::endl;
-                std::cout << "start tracking." << std::endl;
-                tracking_thread.param.threshold = std::fabs(t);
-                tracking_thread.run(tract_model.get_fib(),po.get("thread_count",int(std::thread::hardware_concurrency())),true);
-                tracking_thread.fetchTracks(&tract_model);
-                std::ostringstream out;
-                out << cnt_file_name[i].toStdString() << "." << cnt_type.toStdString()
-                        << ((t > 0) ? "inc":"dec") << std::fabs(t) << ".trk.gz" << std::endl;
-                if(!tract_model.save_tracts_to_file(out.str().c_str()))
-                {
-                    std::cout << "Cannot save file to " << out.str()
-                              << ". Please check write permission, directory, and disk space." << std::endl;
-                    return 0;
-                }
-                std::vector<std::vector<float> > tmp;
-                tract_model.release_tracts(tmp);
-            }
+            if(!run_cnt_tracking(cnt_file_name[i].toStdString()))
+                return 1;
         }
         return 0;
     }
@@ -622,7 +667,7 @@ int trk(void)
     if(tract_model.get_visible_track_count() == 0)
     {
         std::cout << "No tract generated. Terminating..." << std::endl;
-        return 0;
+        return 1;
     }
     std::cout << "a total of " << tract_model.get_visible_track_count() << " tracts are generated" << std::endl;
 
@@ -647,5 +692,5 @@ int trk(void)
         std::cout << "program terminated due to unkown exception" << std::endl;
     }
 
-    return 0;
+    return 1;
 }
@@ -2,6 +2,7 @@
 #include <QStringListModel>
 #include <QMessageBox>
 #include <fstream>
+#include <thread>
 #include "createdbdialog.h"
 #include "ui_createdbdialog.h"
 #include "fib_data.hpp"
@@ -282,22 +283,20 @@ void CreateDBDialog::on_create_data_base_clicked()
 
         data->handle->db.index_name = ui->index_of_interest->currentText().toLower().toStdString();
 
+        std::vector<std::string> file_list(group.count()),name_list(group.count());
         for (unsigned int index = 0;index < group.count();++index)
         {
-            begin_prog(QFileInfo(group[index]).baseName().toStdString().c_str());
-            if(!data->handle->db.add_subject_file(group[index].toStdString(),get_file_name(group[index]).toStdString()))
-            {
-                QMessageBox::information(this,"error in loading subject fib files",data->handle->error_msg.c_str(),0);
-                check_prog(0,0);
-                return;
-            }
-            if(prog_aborted())
-            {
-                check_prog(0,0);
-                return;
-            }
+            file_list[index] = group[index].toStdString();
+            name_list[index] = get_file_name(group[index]).toStdString();
+        }
+        if(!data->handle->db.create_db_from_files(ui->output_file_name->text().toStdString().c_str(),
+                                                  file_list,name_list,std::thread::hardware_concurrency()))
+        {
+            check_prog(0,0);
+            if(!prog_aborted())
+                QMessageBox::information(this,"error in creating database",data->handle->error_msg.c_str(),0);
+            return;
         }
-        data->handle->db.save_subject_data(ui->output_file_name->text().toStdString().c_str());
         QMessageBox::information(this,"completed","Connectometry database created",0);
     }
     else
@@ -424,15 +424,16 @@ void db_window::on_actionCalculate_change_triggered()
 
 void db_window::on_actionSave_DB_as_triggered()
 {
+    QString filter;
     QString filename = QFileDialog::getSaveFileName(
                            this,
                            "Save Database",
                            windowTitle()+".modified.db.fib.gz",
-                           "Database files (*db?fib.gz *fib.gz);;All files (*)");
+                           "Database files (*db?fib.gz *fib.gz);;Out-of-core database files (*db?fib.gz *fib.gz);;All files (*)",&filter);
     if (filename.isEmpty())
         return;
     begin_prog("saving");
-    vbc->handle->db.save_subject_data(filename.toStdString().c_str());
+    vbc->handle->db.save_subject_data(filename.toStdString().c_str(),filter.startsWith("Out-of-core"));
     check_prog(0,0);
 }
 
@@ -785,7 +785,15 @@ void group_connectometry::on_run_clicked()
         }
     }
 
-    vbc->run_permutation(ui->multithread->value(),ui->permutation_count->value());
+    if(!vbc->run_permutation(ui->multithread->value(),ui->permutation_count->value()))
+    {
+        if(gui)
+            QMessageBox::information(this,"Error",vbc->error_msg.c_str(),0);
+        else
+            std::cout << vbc->error_msg << std::endl;
+        ui->run->setText("Run");
+        return;
+    }
     if(gui)
     {
         timer.reset(new QTimer(this));
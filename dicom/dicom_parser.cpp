@@ -2,6 +2,7 @@
 #include <QProgressDialog>
 #include <QFileDialog>
 #include <QSettings>
+#include <atomic>
 #include "dicom_parser.h"
 #include "ui_dicom_parser.h"
 #include "tipl/tipl.hpp"
@@ -434,6 +435,37 @@ bool load_4d_2dseq(const char* file_name,std::vector<std::shared_ptr<DwiHeader>
     return true;
 }
 
+// read each file once in parallel; failed files are left as null pointers
+bool open_dwi_files(const QStringList& file_list,std::vector<std::shared_ptr<DwiHeader> >& files)
+{
+    files.clear();
+    files.resize(file_list.size());
+    std::atomic<bool> terminated(false);
+    tipl::par_for2(file_list.size(),[&](int index,int thread_id)
+    {
+        if(terminated)
+            return;
+        if(thread_id == 0)
+        {
+            if(prog_aborted())
+            {
+                terminated = true;
+                return;
+            }
+            check_prog(index,file_list.size());
+        }
+        std::shared_ptr<DwiHeader> dwi(new DwiHeader);
+        std::string file_name = file_list[index].toLocal8Bit().begin();
+        if(dwi->open(file_name.c_str()))
+        {
+            dwi->file_name = file_name;
+            files[index] = dwi;
+        }
+    });
+    check_prog(1,1);
+    return !terminated;
+}
+
 bool load_multiple_slice_dicom(QStringList file_list,std::vector<std::shared_ptr<DwiHeader> >& dwi_files)
 {
     tipl::io::dicom dicom_header;// multiple frame image
@@ -445,111 +477,101 @@ bool load_multiple_slice_dicom(QStringList file_list,std::vector<std::shared_ptr
     if(geo[2] != 1 || dicom_header.is_mosaic)
         return false;
 
-    tipl::io::dicom dicom_header2;
-    if(!dicom_header2.load_from_file(file_list[1].toLocal8Bit().begin()))
+    // all slices are decoded once and their b-table and slice location used as the index
+    std::vector<std::shared_ptr<DwiHeader> > slices;
+    begin_prog("loading images");
+    if(!open_dwi_files(file_list,slices))
         return false;
-    float s1 = dicom_header.get_slice_location();
+    for(unsigned int index = 0;index < slices.size();++index)
+        if(!slices[index].get())
+            return false;
+
+    float s1 = slices[0]->slice_location;
     bool iterate_slice_first = true;
     unsigned int slice_num = 2;
     unsigned int b_num = 2;
     if(s1 == 0.0) // no slice locaton information
     {
-        DwiHeader dwi1,dwi2;
-        dwi1.open(file_list[0].toLocal8Bit().begin());
-        dwi2.open(file_list[1].toLocal8Bit().begin());
-        if(dwi1.bvec == dwi2.bvec && dwi1.bvalue == dwi2.bvalue) // iterater slice first
+        const DwiHeader& dwi1 = *slices[0];
+        if(dwi1.bvec == slices[1]->bvec && dwi1.bvalue == slices[1]->bvalue) // iterater slice first
         {
-            for (;slice_num < file_list.size();++slice_num)
-            {
-                DwiHeader dwi;
-                if(!dwi.open(file_list[slice_num].toLocal8Bit().begin()))
-                    return false;
-                if(dwi1.bvec != dwi.bvec || dwi1.bvalue != dwi.bvalue)
+            for (;slice_num < slices.size();++slice_num)
+                if(dwi1.bvec != slices[slice_num]->bvec || dwi1.bvalue != slices[slice_num]->bvalue)
                     break;
-            }
             geo[2] = slice_num;
             iterate_slice_first = true;
         }
         else
         // iterate b first
         {
-            for (;b_num < file_list.size();++b_num)
-            {
-                DwiHeader dwi;
-                if(!dwi.open(file_list[b_num].toLocal8Bit().begin()))
-                    return false;
-                if(dwi1.bvec == dwi.bvec && dwi1.bvalue == dwi.bvalue)
+            for (;b_num < slices.size();++b_num)
+                if(dwi1.bvec == slices[b_num]->bvec && dwi1.bvalue == slices[b_num]->bvalue)
                     break;
-            }
-            geo[2] = file_list.size()/b_num;
+            geo[2] = slices.size()/b_num;
             iterate_slice_first = false;
         }
     }
     else
     {
-        if(s1 == dicom_header2.get_slice_location()) // iterater b-value first
+        if(s1 == slices[1]->slice_location) // iterater b-value first
         {
-            for (;b_num < file_list.size();++b_num)
-            {
-                if(!dicom_header2.load_from_file(file_list[b_num].toLocal8Bit().begin()))
-                    return false;
-                if(dicom_header2.get_slice_location() != s1)
+            for (;b_num < slices.size();++b_num)
+                if(slices[b_num]->slice_location != s1)
                     break;
-            }
-            geo[2] = std::ceil((float)file_list.size()/(float)b_num);
+            geo[2] = std::ceil((float)slices.size()/(float)b_num);
             iterate_slice_first = false;
         }
         else
         // iterater slice first
         {
-            for (;slice_num < file_list.size();++slice_num)
-            {
-                if(!dicom_header2.load_from_file(file_list[slice_num].toLocal8Bit().begin()))
-                    return false;
-                if(dicom_header2.get_slice_location() == s1)
+            for (;slice_num < slices.size();++slice_num)
+                if(slices[slice_num]->slice_location == s1)
                     break;
-            }
             geo[2] = slice_num;
             iterate_slice_first = true;
         }
     }
 
-
-    begin_prog("loading images");
-    for (unsigned int index = 0,b_index = 0,slice_index = 0;check_prog(index,file_list.size());++index)
+    // the first slice of each volume becomes the volume itself
+    std::vector<std::shared_ptr<DwiHeader> > volumes;
+    std::vector<std::vector<unsigned int> > volume_slices;
+    for (unsigned int index = 0;index < slices.size();++index)
     {
-        std::shared_ptr<DwiHeader> dwi(new DwiHeader);
-        if(!dwi->open(file_list[index].toLocal8Bit().begin()))
-            return false;
+        unsigned int b_index = iterate_slice_first ? index/slice_num : index % b_num;
+        unsigned int slice_index = iterate_slice_first ? index % slice_num : index/b_num;
         if(slice_index == 0)
         {
-            dwi_files.push_back(dwi);
-            dwi_files.back()->file_name = file_list[index].toLocal8Bit().begin();
-            dwi_files.back()->image.resize(geo);
-            dicom_header.get_voxel_size(dwi_files.back()->voxel_size);
-        }
-        else
-            std::copy(dwi->image.begin(),dwi->image.end(),
-                dwi_files[b_index]->image.begin() + slice_index*geo.plane_size());
-        if(iterate_slice_first)
-        {
-            ++slice_index;
-            if(slice_index >= slice_num)
-            {
-                slice_index = 0;
-                ++b_index;
-            }
+            volumes.push_back(slices[index]);
+            volume_slices.push_back(std::vector<unsigned int>());
         }
         else
+            if(slice_index < geo[2] && b_index < volumes.size())
+                volume_slices[b_index].push_back(index);
+    }
+    // assemble one volume at a time and release its slices, so the decoded
+    // slices and the volumes are never both held in full
+    begin_prog("assembling volumes");
+    for (unsigned int b = 0;check_prog(b,volumes.size());++b)
+    {
+        DwiHeader& volume = *volumes[b];
+        if(volume.image.size() != geo.plane_size())
+            volume.image.clear();
+        volume.image.resize(geo);
+        dicom_header.get_voxel_size(volume.voxel_size);
+        const std::vector<unsigned int>& slice_list = volume_slices[b];
+        tipl::par_for(slice_list.size(),[&](int i)
         {
-            ++b_index;
-            if(b_index >= b_num)
-            {
-                b_index = 0;
-                ++slice_index;
-            }
-        }
+            unsigned int index = slice_list[i];
+            unsigned int slice_index = iterate_slice_first ? index % slice_num : index/b_num;
+            if(slices[index]->image.size() == geo.plane_size())
+                std::copy(slices[index]->image.begin(),slices[index]->image.end(),
+                          volume.image.begin() + slice_index*geo.plane_size());
+            slices[index].reset();
+        });
     }
+    if(prog_aborted())
+        return false;
+    dwi_files.insert(dwi_files.end(),volumes.begin(),volumes.end());
     return true;
 }
 bool load_4d_fdf(QStringList file_list,std::vector<std::shared_ptr<DwiHeader> >& dwi_files)
@@ -637,15 +659,13 @@ bool load_4d_fdf(QStringList file_list,std::vector<std::shared_ptr<DwiHeader> >&
 
 bool load_3d_series(QStringList file_list,std::vector<std::shared_ptr<DwiHeader> >& dwi_files)
 {
+    std::vector<std::shared_ptr<DwiHeader> > files;
     begin_prog("loading images");
-    for (unsigned int index = 0;check_prog(index,file_list.size());++index)
-    {
-        std::shared_ptr<DwiHeader> new_file(new DwiHeader);
-        if (!new_file->open(file_list[index].toLocal8Bit().begin()))
-            continue;
-        new_file->file_name = file_list[index].toLocal8Bit().begin();
-        dwi_files.push_back(new_file);
-    }
+    if(!open_dwi_files(file_list,files))
+        return false;
+    for (unsigned int index = 0;index < files.size();++index)
+        if(files[index].get())
+            dwi_files.push_back(files[index]);
     return !dwi_files.empty();
 }
 
@@ -1,5 +1,7 @@
 #include <sstream>
 #include <string>
+#include <future>
+#include <thread>
 #include "tipl/tipl.hpp"
 #include "dwi_header.hpp"
 #include "gzip_interface.hpp"
@@ -71,6 +73,7 @@ bool DwiHeader::open(const char* filename)
             std::copy(I.begin(),I.end(),image.begin());
     }
     header.get_voxel_size(voxel_size);
+    slice_location = header.get_slice_location();
     get_report_from_dicom(header,report);
 
     float orientation_matrix[9];
@@ -475,7 +478,7 @@ bool DwiHeader::output_src(const char* di_file,std::vector<std::shared_ptr<DwiHe
         sort_dwi(dwi_files);
         correct_t2(dwi_files);
     }
-    gz_mat_write write_mat(di_file);
+    gz_mat_parallel_write write_mat(di_file);
     if(!write_mat)
         return false;
 
@@ -525,41 +528,52 @@ bool DwiHeader::output_src(const char* di_file,std::vector<std::shared_ptr<DwiHe
     if(!dwi_files[0]->mask.empty())
         write_mat.write("mask",&*dwi_files[0]->mask.begin(),1,(unsigned int)(dwi_files[0]->mask.size()));
 
-    //store images
+    //store images: volumes are resampled on worker threads ahead of the writer
+    auto resample = [&](unsigned int index)
+    {
+        std::shared_ptr<tipl::image<unsigned short,3> > buffer(new tipl::image<unsigned short,3>(geo));
+        const unsigned short* ptr = (const unsigned short*)dwi_files[index]->begin();
+        std::copy(ptr,ptr+geo.size(),buffer->begin());
+        if(upsampling == 1)
+            tipl::upsampling(*buffer);
+        if(upsampling == 2)
+            tipl::downsampling(*buffer);
+        if(upsampling == 3)
+        {
+            tipl::upsampling(*buffer);
+            tipl::upsampling(*buffer);
+        }
+        if(upsampling == 4)
+        {
+            tipl::downsampling(*buffer);
+            tipl::downsampling(*buffer);
+        }
+        return buffer;
+    };
+    unsigned int window = std::max<unsigned int>(1,std::thread::hardware_concurrency());
+    std::vector<std::future<std::shared_ptr<tipl::image<unsigned short,3> > > > resampled(dwi_files.size());
+    auto launch = [&](unsigned int index)
+    {
+        if(upsampling && index < dwi_files.size())
+            resampled[index] = std::async(std::launch::async,resample,index);
+    };
+    for(unsigned int index = 0;index < window;++index)
+        launch(index);
     begin_prog("Save Files");
     for (unsigned int index = 0;check_prog(index,(unsigned int)(dwi_files.size()));++index)
     {
         std::ostringstream name;
-        tipl::image<unsigned short,3> buffer;
-        const unsigned short* ptr = 0;
         name << "image" << index;
-        ptr = (const unsigned short*)dwi_files[index]->begin();
+        launch(index+window);
         if(upsampling)
         {
-            buffer.resize(geo);
-            std::copy(ptr,ptr+geo.size(),buffer.begin());
-            if(upsampling == 1)
-                tipl::upsampling(buffer);
-            if(upsampling == 2)
-                tipl::downsampling(buffer);
-            if(upsampling == 3)
-            {
-                tipl::upsampling(buffer);
-                tipl::upsampling(buffer);
-            }
-            if(upsampling == 4)
-            {
-                tipl::downsampling(buffer);
-                tipl::downsampling(buffer);
-            }
-            ptr = (const unsigned short*)&*buffer.begin();
+            std::shared_ptr<tipl::image<unsigned short,3> > buffer = resampled[index].get();
+            write_mat.write(name.str().c_str(),(const unsigned short*)&*buffer->begin(),1,output_size);
         }
-        write_mat.write(name.str().c_str(),ptr,1,output_size);
+        else
+            write_mat.write(name.str().c_str(),(const unsigned short*)dwi_files[index]->begin(),1,output_size);
     }
 
-
-
-
     std::string report1 = dwi_files.front()->report;
     std::string report2;
     {
@@ -571,5 +585,8 @@ bool DwiHeader::output_src(const char* di_file,std::vector<std::shared_ptr<DwiHe
     }
     report1 += report2;
     write_mat.write("report",report1.c_str(),1,(unsigned int)report1.length());
+    // checking the writer flushes the pending members and reports compression or write errors
+    if(!write_mat)
+        return false;
     return true;
 }
@@ -19,6 +19,7 @@ public:
     tipl::vector<3,float> bvec;
     float bvalue;
     tipl::vector<3,float> voxel_size;
+    float slice_location = 0.0f;
 public:
     DwiHeader(void): bvalue(0.0), te(0.0) {}
     bool open(const char* filename);
@@ -60,6 +60,7 @@ HEADERS += mainwindow.h \
     reconstruction/reconstruction_window.h \
     tracking/slice_view_scene.h \
     opengl/glwidget.h \
+    opengl/tract_geometry.hpp \
     libs/tracking/tracking_method.hpp \
     libs/tracking/roi.hpp \
     libs/tracking/interpolation_process.hpp \
@@ -140,6 +141,7 @@ SOURCES += main.cpp \
     reconstruction/reconstruction_window.cpp \
     tracking/slice_view_scene.cpp \
     opengl/glwidget.cpp \
+    opengl/tract_geometry.cpp \
     tracking/region/regiontablewidget.cpp \
     tracking/region/Regions.cpp \
     tracking/region/RegionModel.cpp \
@@ -182,6 +184,7 @@ SOURCES += main.cpp \
     regtoolbox.cpp \
     cmd/cnn.cpp \
     cmd/qc.cpp \
+    cmd/batch.cpp \
     libs/dsi/basic_voxel.cpp \
     libs/dsi/image_model.cpp \
     connectometry/nn_connectometry.cpp
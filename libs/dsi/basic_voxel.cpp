@@ -8,11 +8,30 @@ double base_function(double theta)
     return (2*std::cos(theta)+(theta-2.0/theta)*std::sin(theta))/theta/theta;
 }
 
+voxel_mask_index::voxel_mask_index(const tipl::image<unsigned char,3>& mask):vi2si(mask.size())
+{
+    for(unsigned int index = 0;index < mask.size();++index)
+        if(mask[index])
+        {
+            vi2si[index] = si2vi.size();
+            si2vi.push_back(index);
+        }
+}
+
+std::shared_ptr<voxel_mask_index> Voxel::get_mask_index(void)
+{
+    if(!mask_index.get())
+        mask_index = std::make_shared<voxel_mask_index>(mask);
+    return mask_index;
+}
+
 void Voxel::init(void)
 {
+    mask_index.reset();
     voxel_data.resize(thread_count);
     for (unsigned int index = 0; index < thread_count; ++index)
     {
+        voxel_data[index].thread_id = index;
         voxel_data[index].space.resize(bvalues.size());
         voxel_data[index].odf.resize(ti.half_vertices_count);
         voxel_data[index].fa.resize(max_fiber_number);
@@ -53,37 +72,20 @@ void Voxel::calculate_q_vec_t(std::vector<tipl::vector<3,float> >& q_vectors_tim
 
 void Voxel::load_from_src(ImageModel& image_model)
 {
-    std::vector<int> sorted_index(image_model.src_bvalues.size());
-    std::iota(sorted_index.begin(),sorted_index.end(),0);
-
-    std::sort(sorted_index.begin(),sorted_index.end(),
-              [&image_model](int left,int right)
-    {
-        if((int)image_model.src_bvalues[left]/400 == (int)image_model.src_bvalues[right]/400)
-            return image_model.src_bvectors[left] < image_model.src_bvectors[right];
-        return image_model.src_bvalues[left] < image_model.src_bvalues[right];
-    }
-    );
-
-
+    std::vector<int> sorted_index;
+    image_model.get_sorted_dwi_index(sorted_index);
     bvalues.clear();
     bvectors.clear();
     dwi_data.clear();
-    // include only the first b0
-    if(image_model.src_bvalues[sorted_index[0]] == 0.0f)
-    {
-        bvalues.push_back(0);
-        bvectors.push_back(tipl::vector<3,float>(0,0,0));
-        dwi_data.push_back(image_model.src_dwi_data[sorted_index[0]]);
+    if(!sorted_index.empty() && image_model.src_bvalues[sorted_index[0]] == 0.0f)
         b0_index = 0;
-    }
     for(int i = 0;i < sorted_index.size();++i)
-        if(image_model.src_bvalues[sorted_index[i]] != 0.0f)
-        {
-            bvalues.push_back(image_model.src_bvalues[sorted_index[i]]);
-            bvectors.push_back(image_model.src_bvectors[sorted_index[i]]);
-            dwi_data.push_back(image_model.src_dwi_data[sorted_index[i]]);
-        }
+    {
+        bvalues.push_back(image_model.src_bvalues[sorted_index[i]]);
+        bvectors.push_back(image_model.src_bvalues[sorted_index[i]] == 0.0f ?
+                tipl::vector<3,float>(0,0,0) : image_model.src_bvectors[sorted_index[i]]);
+        dwi_data.push_back(image_model.src_dwi_data[sorted_index[i]]);
+    }
 
     if(image_model.has_image_rotation)
         for (unsigned int index = 0;index < bvectors.size();++index)
@@ -131,11 +133,9 @@ void Voxel::run(void)
         if (mask[index])
             ++total_voxel;
 
-    unsigned int total = 0;
     tipl::par_for2(mask.size(),
                     [&](int voxel_index,int thread_id)
     {
-        ++total;
         if(terminated || !mask[voxel_index])
             return;
         if(thread_id == 0)
@@ -145,13 +145,16 @@ void Voxel::run(void)
                 terminated = true;
                 return;
             }
-            check_prog(total,mask.size());
+            check_prog(voxel_index,mask.size());
         }
         voxel_data[thread_id].init();
         voxel_data[thread_id].voxel_index = voxel_index;
         for (int index = 0; index < process_list.size(); ++index)
             process_list[index]->run(*this,voxel_data[thread_id]);
     },thread_count);
+    for (int index = 0; index < process_list.size(); ++index)
+        process_list[index]->merge(*this);
+    prog_add_items(total_voxel);
     check_prog(1,1);
     }
     catch(std::exception& error)
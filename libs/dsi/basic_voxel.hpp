@@ -18,6 +18,8 @@ public:
     BaseProcess(void) {}
     virtual void init(Voxel&) {}
     virtual void run(Voxel&, VoxelData&) {}
+    // called once after all voxels are processed to merge per-thread results
+    virtual void merge(Voxel&) {}
     virtual void end(Voxel&,gz_mat_write&) {}
     virtual ~BaseProcess(void) {}
 };
@@ -26,6 +28,7 @@ public:
 
 struct VoxelData
 {
+    unsigned int thread_id = 0;
     unsigned int voxel_index;
     std::vector<float> space;
     std::vector<float> odf;
@@ -45,6 +48,42 @@ struct VoxelData
     }
 };
 
+// per-thread arg-max candidate, ties are resolved by voxel index
+struct voxel_candidate
+{
+    bool assigned = false;
+    float value = 0.0f;
+    unsigned int voxel_index = 0;
+    std::vector<float> odf;
+    bool better(float value_,unsigned int voxel_index_,bool prefer_lower_index) const
+    {
+        if(!assigned || value_ != value)
+            return !assigned || value_ > value;
+        return prefer_lower_index ? voxel_index_ < voxel_index : voxel_index_ > voxel_index;
+    }
+    void update(float value_,unsigned int voxel_index_,const std::vector<float>& odf_,bool prefer_lower_index)
+    {
+        if(!better(value_,voxel_index_,prefer_lower_index))
+            return;
+        assigned = true;
+        value = value_;
+        voxel_index = voxel_index_;
+        odf = odf_;
+    }
+    void update(const voxel_candidate& rhs,bool prefer_lower_index)
+    {
+        if(rhs.assigned)
+            update(rhs.value,rhs.voxel_index,rhs.odf,prefer_lower_index);
+    }
+};
+
+// maps masked voxels to compact storage, as si2vi/vi2si in connectometry
+struct voxel_mask_index
+{
+    std::vector<unsigned int> si2vi,vi2si;
+    voxel_mask_index(const tipl::image<unsigned char,3>& mask);
+};
+
 struct ImageModel;
 class Voxel
 {
@@ -134,6 +173,9 @@ public:// for template creation
     std::string template_file_name;
 public:
     std::vector<VoxelData> voxel_data;
+public:// built on first use for the current mask, reset whenever the mask changes
+    std::shared_ptr<voxel_mask_index> mask_index;
+    std::shared_ptr<voxel_mask_index> get_mask_index(void);
 public:
     Voxel(void):param(5){}
     template<class ProcessList>
@@ -155,6 +197,42 @@ public:
     BaseProcess* get(unsigned int index);
 };
 
+// per-voxel outputs stored only for masked voxels and expanded when saved
+template<class value_type>
+class masked_voxel_data
+{
+    std::shared_ptr<voxel_mask_index> index;
+    unsigned int value_size = 1;
+public:
+    std::vector<value_type> data;
+public:
+    void init(Voxel& voxel,unsigned int value_size_ = 1)
+    {
+        index = voxel.get_mask_index();
+        value_size = value_size_;
+        data.clear();
+        data.resize(index->si2vi.size()*value_size);
+    }
+    value_type* at(unsigned int voxel_index)
+    {
+        return &data[index->vi2si[voxel_index]*value_size];
+    }
+    void expand(std::vector<value_type>& full) const
+    {
+        full.clear();
+        full.resize(index->vi2si.size()*value_size);
+        for(unsigned int si = 0;si < index->si2vi.size();++si)
+            std::copy(data.begin()+si*value_size,data.begin()+(si+1)*value_size,
+                      full.begin()+index->si2vi[si]*value_size);
+    }
+    void write(gz_mat_write& mat_writer,const char* name) const
+    {
+        std::vector<value_type> full;
+        expand(full);
+        mat_writer.write(name,&*full.begin(),1,full.size());
+    }
+};
+
 struct terminated_class {
     unsigned int total;
     mutable unsigned int now;
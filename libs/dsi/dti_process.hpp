@@ -1,6 +1,7 @@
 #ifndef DTI_PROCESS_HPP
 #define DTI_PROCESS_HPP
 #include <cmath>
+#include <atomic>
 #include "basic_voxel.hpp"
 #include "tipl/tipl.hpp"
 
@@ -23,7 +24,140 @@ private:
     std::vector<std::vector<double> > iKtK; // 6-by-6
     std::vector<std::vector<unsigned int> > iKtK_pivot;
     std::vector<double> Kt;
+    std::vector<std::vector<double> > iKtKKt; // 6-by-b_count for each regularization level
     unsigned int b_count;
+    bool block_fitted = false;
+private:
+    void solve(unsigned int level,const float* signal,double* tensor_param) const
+    {
+        const double* p = &iKtKKt[level][0];
+        for(unsigned int j = 0;j < 6;++j,p += b_count)
+        {
+            double sum = 0.0;
+            for(unsigned int b = 0;b < b_count;++b)
+                sum += p[b]*signal[b];
+            tensor_param[j] = sum;
+        }
+    }
+    static bool decompose(const double* tensor_param,double* tensor,double* V,double* d)
+    {
+        unsigned int tensor_index[9] = {0,3,4,3,1,5,4,5,2};
+        for (unsigned int index = 0; index < 9; ++index)
+            tensor[index] = tensor_param[tensor_index[index]];
+        tipl::mat::eigen_decomposition_sym(tensor,V,d,tipl::dim<3,3>());
+        return d[0] > 0.0 && d[1] > 0.0 && d[2] > 0.0;
+    }
+    // increase regularization until the tensor is positive definite
+    void fit(const float* signal,unsigned int start_level,double* tensor,double* V,double* d) const
+    {
+        double tensor_param[6];
+        for(unsigned int i = start_level;i < iKtKKt.size();++i)
+        {
+            solve(i,signal,tensor_param);
+            if(decompose(tensor_param,tensor,V,d))
+                break;
+        }
+    }
+    float save(Voxel& voxel,unsigned int voxel_index,const double* tensor,const double* V,double* d)
+    {
+        if (d[1] < 0.0)
+        {
+            d[1] = 0.0;
+            d[2] = 0.0;
+        }
+        if (d[2] < 0.0)
+            d[2] = 0.0;
+        if (d[0] < 0.0)
+        {
+            d[0] = 0.0;
+            d[1] = 0.0;
+            d[2] = 0.0;
+        }
+        std::copy(V,V+3,voxel.fib_dir.begin() + voxel_index + voxel_index + voxel_index);
+        float fa = voxel.fib_fa[voxel_index] = get_fa(d[0],d[1],d[2]);
+        if(voxel.output_diffusivity || voxel.method_id == 1)
+        {
+            md[voxel_index] = 1000.0*(d[0]+d[1]+d[2])/3.0;
+            d0[voxel_index] = 1000.0*d[0];
+            d2[voxel_index] = 1000.0*d[1];
+            d3[voxel_index] = 1000.0*d[2];
+            d1[voxel_index] = 1000.0*(d[1]+d[2])/2.0;
+            ha[voxel_index] = std::acos(std::sqrt(V[0]*V[0]+V[1]*V[1]))*180.0f/3.14159265358979323846f;
+        }
+        if(voxel.output_tensor && voxel.method_id == 1)
+        {
+            txx[voxel_index] = tensor[0];
+            txy[voxel_index] = tensor[1];
+            txz[voxel_index] = tensor[2];
+            tyy[voxel_index] = tensor[4];
+            tyz[voxel_index] = tensor[5];
+            tzz[voxel_index] = tensor[8];
+        }
+        return fa;
+    }
+    // DTI reconstruction fits all masked voxels in blocks: log-signals are kept in
+    // structure-of-arrays form so the unregularized solve runs across voxels
+    void fit_blocks(Voxel& voxel)
+    {
+        const std::vector<unsigned int>& si2vi = voxel.get_mask_index()->si2vi;
+        const unsigned int block_size = 256;
+        unsigned int block_count = (si2vi.size()+block_size-1)/block_size;
+        std::atomic<bool> terminated(false);
+        begin_prog("fitting tensors");
+        tipl::par_for2(block_count,[&](unsigned int block,unsigned int thread_id)
+        {
+            if(terminated)
+                return;
+            if(thread_id == 0)
+            {
+                if(prog_aborted())
+                {
+                    terminated = true;
+                    return;
+                }
+                check_prog(block,block_count);
+            }
+            unsigned int from = block*block_size;
+            unsigned int size = std::min<unsigned int>(block_size,si2vi.size()-from);
+            std::vector<float> signal(b_count*block_size);
+            for(unsigned int v = 0;v < size;++v)
+            {
+                unsigned int voxel_index = si2vi[from+v];
+                if(voxel.dwi_data[0][voxel_index] == 0)
+                    continue;
+                float logs0 = std::log(std::max<float>(1.0,voxel.dwi_data[0][voxel_index]));
+                for (unsigned int b = 0; b < b_count; ++b)
+                    signal[b*block_size+v] = std::max<float>(0.0,logs0-std::log(std::max<float>(1.0,voxel.dwi_data[b+1][voxel_index])));
+            }
+            std::vector<double> tensor_param(6*block_size);
+            for(unsigned int j = 0;j < 6;++j)
+            {
+                double* out = &tensor_param[j*block_size];
+                for(unsigned int b = 0;b < b_count;++b)
+                {
+                    double p = iKtKKt[0][j*b_count+b];
+                    const float* s = &signal[b*block_size];
+                    for(unsigned int v = 0;v < size;++v)
+                        out[v] += p*s[v];
+                }
+            }
+            std::vector<float> voxel_signal(b_count);
+            for(unsigned int v = 0;v < size;++v)
+            {
+                double param[6],tensor[9],V[9],d[3];
+                for(unsigned int j = 0;j < 6;++j)
+                    param[j] = tensor_param[j*block_size+v];
+                if(!decompose(param,tensor,V,d))
+                {
+                    for (unsigned int b = 0; b < b_count; ++b)
+                        voxel_signal[b] = signal[b*block_size+v];
+                    fit(&voxel_signal[0],1,tensor,V,d);
+                }
+                save(voxel,si2vi[from+v],tensor,V,d);
+            }
+        },voxel.thread_count);
+        check_prog(1,1);
+    }
 public:
     virtual void init(Voxel& voxel)
     {
@@ -92,6 +226,7 @@ public:
         }
         iKtK.resize(20);
         iKtK_pivot.resize(iKtK.size());
+        iKtKKt.resize(iKtK.size());
         for(unsigned int i = 0;i < iKtK.size();++i)
         {
             iKtK[i].resize(6*6);
@@ -105,11 +240,30 @@ public:
                     iKtK[i][j] += w;
             }
             tipl::mat::lu_decomposition(iKtK[i].begin(),iKtK_pivot[i].begin(),tipl::dyndim(6,6));
+            // precompute (KtK)^-1 Kt so that each fit is a single product
+            iKtKKt[i].resize(6*b_count);
+            for(unsigned int b = 0;b < b_count;++b)
+            {
+                double Kt_col[6],x[6];
+                for(unsigned int j = 0;j < 6;++j)
+                    Kt_col[j] = Kt[j*b_count+b];
+                tipl::mat::lu_solve(iKtK[i].begin(),iKtK_pivot[i].begin(),Kt_col,x,tipl::dyndim(6,6));
+                for(unsigned int j = 0;j < 6;++j)
+                    iKtKKt[i][j*b_count+b] = x[j];
+            }
+        }
+        block_fitted = false;
+        if(voxel.method_id == 1 && b_count)
+        {
+            fit_blocks(voxel);
+            block_fitted = true;
         }
     }
 public:
     virtual void run(Voxel& voxel, VoxelData& data)
     {
+        if(block_fitted)
+            return;
         if(!voxel.output_diffusivity && voxel.method_id != 1)
             return;
         std::vector<float> signal(data.space.size());
@@ -119,58 +273,10 @@ public:
             for (unsigned int i = 1; i < data.space.size(); ++i)
                 signal[i-1] = std::max<float>(0.0,logs0-std::log(std::max<float>(1.0,data.space[i])));
         }
-        //  Kt S = Kt K D
-        double KtS[6],tensor_param[6];
         double tensor[9];
         double V[9],d[3];
-        for(unsigned int i = 0;i < iKtK.size();++i)
-        {
-            tipl::mat::product(Kt.begin(),signal.begin(),KtS,tipl::dyndim(6,b_count),tipl::dyndim(b_count,1));
-            tipl::mat::lu_solve(iKtK[i].begin(),iKtK_pivot[i].begin(),KtS,tensor_param,tipl::dyndim(6,6));
-
-
-            unsigned int tensor_index[9] = {0,3,4,3,1,5,4,5,2};
-            for (unsigned int index = 0; index < 9; ++index)
-                tensor[index] = tensor_param[tensor_index[index]];
-
-            tipl::mat::eigen_decomposition_sym(tensor,V,d,tipl::dim<3,3>());
-            if(d[0] > 0.0 && d[1] > 0.0 && d[2] > 0.0)
-                break;
-        }
-        if (d[1] < 0.0)
-        {
-            d[1] = 0.0;
-            d[2] = 0.0;
-        }
-        if (d[2] < 0.0)
-            d[2] = 0.0;
-        if (d[0] < 0.0)
-        {
-            d[0] = 0.0;
-            d[1] = 0.0;
-            d[2] = 0.0;
-        }
-        std::copy(V,V+3,voxel.fib_dir.begin() + data.voxel_index + data.voxel_index + data.voxel_index);
-        data.fa[0] = voxel.fib_fa[data.voxel_index] = get_fa(d[0],d[1],d[2]);
-        if(voxel.output_diffusivity || voxel.method_id == 1)
-        {
-            md[data.voxel_index] = 1000.0*(d[0]+d[1]+d[2])/3.0;
-            d0[data.voxel_index] = 1000.0*d[0];
-            d2[data.voxel_index] = 1000.0*d[1];
-            d3[data.voxel_index] = 1000.0*d[2];
-            d1[data.voxel_index] = 1000.0*(d[1]+d[2])/2.0;
-            ha[data.voxel_index] = std::acos(std::sqrt(V[0]*V[0]+V[1]*V[1]))*180.0f/3.14159265358979323846f;
-        }
-        if(voxel.output_tensor && voxel.method_id == 1)
-        {
-            txx[data.voxel_index] = tensor[0];
-            txy[data.voxel_index] = tensor[1];
-            txz[data.voxel_index] = tensor[2];
-            tyy[data.voxel_index] = tensor[4];
-            tyz[data.voxel_index] = tensor[5];
-            tzz[data.voxel_index] = tensor[8];
-        }
-
+        fit(&signal[0],0,tensor,V,d);
+        data.fa[0] = save(voxel,data.voxel_index,tensor,V,d);
     }
     virtual void end(Voxel& voxel,gz_mat_write& mat_writer)
     {
@@ -285,6 +285,7 @@ public:
                     VG.at(mni_pos[0],mni_pos[1],mni_pos[2]) > 0.0)
                 voxel.mask[index.index()] = 1;
         }
+        voxel.mask_index.reset();
 
         // other image
         if(!voxel.other_image.empty())
@@ -501,13 +502,19 @@ public:
 
 class EstimateZ0_MNI : public BaseProcess
 {
+    // per-thread samples (voxel index, value) and per-thread maximum
+    std::vector<std::vector<std::pair<unsigned int,float> > > thread_samples;
+    std::vector<float> thread_z0;
     std::vector<float> samples;
-    std::mutex mutex;
 public:
     void init(Voxel& voxel)
     {
         voxel.z0 = 0.0;
-        samples.reserve(20);
+        samples.clear();
+        thread_samples.clear();
+        thread_samples.resize(voxel.thread_count);
+        thread_z0.clear();
+        thread_z0.resize(voxel.thread_count);
     }
     void run(Voxel& voxel, VoxelData& data)
     {
@@ -518,19 +525,31 @@ public:
             if((cur_pos-voxel.csf_pos1).length() <= 1.0 || (cur_pos-voxel.csf_pos2).length() <= 1.0 ||
                (cur_pos-voxel.csf_pos3).length() <= 1.0 || (cur_pos-voxel.csf_pos4).length() <= 1.0)
             {
-                std::lock_guard<std::mutex> lock(mutex);
                 if(voxel.r2_weighted) // multishell GQI2 gives negative ODF, use b0 as the scaling reference
-                    samples.push_back(data.space[0]);
+                    thread_samples[data.thread_id].push_back(std::make_pair(data.voxel_index,data.space[0]));
                 else
-                    samples.push_back(*std::min_element(data.odf.begin(),data.odf.end()));
+                    thread_samples[data.thread_id].push_back(std::make_pair(data.voxel_index,*std::min_element(data.odf.begin(),data.odf.end())));
             }
         }
         else
         // if other template is used
         {
-            voxel.z0 = std::max<float>(voxel.z0,*std::min_element(data.odf.begin(),data.odf.end()));
+            thread_z0[data.thread_id] = std::max<float>(thread_z0[data.thread_id],*std::min_element(data.odf.begin(),data.odf.end()));
         }
     }
+    void merge(Voxel& voxel)
+    {
+        std::vector<std::pair<unsigned int,float> > all_samples;
+        for(unsigned int index = 0;index < thread_samples.size();++index)
+        {
+            all_samples.insert(all_samples.end(),thread_samples[index].begin(),thread_samples[index].end());
+            voxel.z0 = std::max<float>(voxel.z0,thread_z0[index]);
+        }
+        std::sort(all_samples.begin(),all_samples.end());
+        samples.clear();
+        for(unsigned int index = 0;index < all_samples.size();++index)
+            samples.push_back(all_samples[index].second);
+    }
     void end(Voxel& voxel,gz_mat_write&)
     {
         if(!samples.empty())
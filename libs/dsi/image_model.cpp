@@ -12,7 +12,11 @@ void ImageModel::calculate_dwi_sum(void)
         for (unsigned int index = 0;index < src_dwi_data.size();++index)
             dwi_sum[pos] += src_dwi_data[index][pos];
     });
+    normalize_dwi_sum();
+}
 
+void ImageModel::normalize_dwi_sum(void)
+{
     float max_value = *std::max_element(dwi_sum.begin(),dwi_sum.end());
     float min_value = max_value;
     for (unsigned int index = 0;index < dwi_sum.size();++index)
@@ -218,63 +222,65 @@ std::string ImageModel::check_b_table(void)
 
     return std::string();
 }
-std::vector<std::pair<int,int> > ImageModel::get_bad_slices(void)
+void ImageModel::get_slice_correlation(const std::vector<const unsigned short*>& dwi,
+                                       const tipl::geometry<3>& dim,int z_from,int z_to,int z_offset,
+                                       tipl::image<float,2>& cor_values,unsigned int thread_count)
 {
-    voxel.load_from_src(*this);
-    std::vector<char> skip_slice(voxel.dim.depth());
-    for(int i = 0,pos = 0;i < skip_slice.size();++i,pos += voxel.dim.plane_size())
-        if(std::accumulate(voxel.mask.begin()+pos,voxel.mask.begin()+pos+voxel.dim.plane_size(),(int)0) < voxel.dim.plane_size()/16)
-            skip_slice[i] = 1;
-        else
-            skip_slice[i] = 0
-                    ;
-    tipl::image<float,2> cor_values(tipl::geometry<2>(voxel.dwi_data.size(),voxel.dim.depth()));
-
-    tipl::par_for(voxel.dwi_data.size(),[&](int index)
+    int depth = cor_values.height();
+    int plane_size = dim.plane_size();
+    tipl::par_for2(dwi.size(),[&](int index,int)
     {
-        auto I = tipl::make_image(voxel.dwi_data[index],voxel.dim);
-        int value_index = index*(voxel.dim.depth());
-        for(int z = 0,pos = 0;z < voxel.dim.depth();++z,pos += voxel.dim.plane_size())
+        const unsigned short* I = dwi[index];
+        int value_index = index*depth+z_offset;
+        for(int z = z_from,pos = z_from*plane_size;z < z_to;++z,pos += plane_size)
         {
             float cor = 0.0f;
 
             if(z)
-                cor = tipl::correlation(&I[pos],&I[pos]+I.plane_size(),&I[pos]-I.plane_size());
-            if(z+1 < voxel.dim.depth())
-                cor = std::max<float>(cor,tipl::correlation(&I[pos],&I[pos]+I.plane_size(),&I[pos]+I.plane_size()));
+                cor = tipl::correlation(I+pos,I+pos+plane_size,I+pos-plane_size);
+            if(z+1 < dim.depth())
+                cor = std::max<float>(cor,tipl::correlation(I+pos,I+pos+plane_size,I+pos+plane_size));
 
             if(index-1 >= 0)
-                cor = std::max<float>(cor,tipl::correlation(voxel.dwi_data[index]+pos,
-                                        voxel.dwi_data[index]+pos+voxel.dim.plane_size(),
-                                        voxel.dwi_data[index-1]+pos));
-            if(index+1 < voxel.dwi_data.size())
-                cor = std::max<float>(cor,tipl::correlation(voxel.dwi_data[index]+pos,
-                                                            voxel.dwi_data[index]+pos+voxel.dim.plane_size(),
-                                                            voxel.dwi_data[index+1]+pos));
+                cor = std::max<float>(cor,tipl::correlation(I+pos,I+pos+plane_size,dwi[index-1]+pos));
+            if(index+1 < dwi.size())
+                cor = std::max<float>(cor,tipl::correlation(I+pos,I+pos+plane_size,dwi[index+1]+pos));
 
             cor_values[value_index+z] = cor;
         }
-    });
+    },thread_count);
+}
+std::vector<std::pair<int,int> > ImageModel::select_bad_slices(const tipl::image<float,2>& cor_values,
+                                                               const tipl::image<unsigned char,3>& mask)
+{
+    int dwi_count = cor_values.width();
+    int depth = cor_values.height();
+    std::vector<char> skip_slice(depth);
+    for(int i = 0,pos = 0;i < skip_slice.size();++i,pos += mask.plane_size())
+        if(std::accumulate(mask.begin()+pos,mask.begin()+pos+mask.plane_size(),(int)0) < mask.plane_size()/16)
+            skip_slice[i] = 1;
+        else
+            skip_slice[i] = 0;
     // check the difference with neighborings
     std::vector<int> bad_i,bad_z;
     std::vector<float> sum;
-    for(int i = 0,pos = 0;i < voxel.dwi_data.size();++i)
+    for(int i = 0,pos = 0;i < dwi_count;++i)
     {
-        for(int z = 0;z < voxel.dim.depth();++z,++pos)
+        for(int z = 0;z < depth;++z,++pos)
         if(!skip_slice[z])
         {
             // ignore the top and bottom slices
-            if(z <= 1 || z + 2 >= voxel.dim.depth())
+            if(z <= 1 || z + 2 >= depth)
                 continue;
             float v[4] = {0.0f,0.0f,0.0f,0.0f};
             if(z > 0)
                 v[0] = cor_values[pos-1]-cor_values[pos];
-            if(z+1 < voxel.dim.depth())
+            if(z+1 < depth)
                 v[1] = cor_values[pos+1]-cor_values[pos];
             if(i > 0)
-                v[2] = cor_values[pos-voxel.dim.depth()]-cor_values[pos];
-            if(i+1 < voxel.dwi_data.size())
-                v[3] = cor_values[pos+voxel.dim.depth()]-cor_values[pos];
+                v[2] = cor_values[pos-depth]-cor_values[pos];
+            if(i+1 < dwi_count)
+                v[3] = cor_values[pos+depth]-cor_values[pos];
             float s = 0.0;
             s = v[0]+v[1]+v[2]+v[3];
             if(s > 0.4f)
@@ -287,22 +293,44 @@ std::vector<std::pair<int,int> > ImageModel::get_bad_slices(void)
     }
 
     std::vector<std::pair<int,int> > result;
-
     auto arg = tipl::arg_sort(sum,std::less<float>());
-    //tipl::image<float,3> bad_I(tipl::geometry<3>(voxel.dim[0],voxel.dim[1],bad_i.size()));
-    for(int i = 0,out_pos = 0;i < bad_i.size();++i,out_pos += voxel.dim.plane_size())
-    {
+    for(int i = 0;i < bad_i.size();++i)
         result.push_back(std::make_pair(bad_i[arg[i]],bad_z[arg[i]]));
-        //int pos = bad_z[arg[i]]*voxel.dim.plane_size();
-    //    std::copy(voxel.dwi_data[bad_i[arg[i]]]+pos,voxel.dwi_data[bad_i[arg[i]]]+pos+voxel.dim.plane_size(),bad_I.begin()+out_pos);
-    }
-    //bad_I.save_to_file<gz_nifti>("D:/bad.nii.gz");
     return result;
 }
+std::vector<std::pair<int,int> > ImageModel::get_bad_slices(void)
+{
+    voxel.load_from_src(*this);
+    tipl::image<float,2> cor_values(tipl::geometry<2>(voxel.dwi_data.size(),voxel.dim.depth()));
+    get_slice_correlation(voxel.dwi_data,voxel.dim,0,voxel.dim.depth(),0,cor_values,voxel.thread_count);
+    return select_bad_slices(cor_values,voxel.mask);
+}
 
-float ImageModel::quality_control_neighboring_dwi_corr(void)
+void ImageModel::get_sorted_dwi_index(std::vector<int>& order) const
 {
-    std::vector<std::pair<int,int> > corr_pairs;
+    std::vector<int> sorted_index(src_bvalues.size());
+    std::iota(sorted_index.begin(),sorted_index.end(),0);
+
+    std::sort(sorted_index.begin(),sorted_index.end(),
+              [this](int left,int right)
+    {
+        if((int)src_bvalues[left]/400 == (int)src_bvalues[right]/400)
+            return src_bvectors[left] < src_bvectors[right];
+        return src_bvalues[left] < src_bvalues[right];
+    }
+    );
+    order.clear();
+    // include only the first b0
+    if(!sorted_index.empty() && src_bvalues[sorted_index[0]] == 0.0f)
+        order.push_back(sorted_index[0]);
+    for(int i = 0;i < sorted_index.size();++i)
+        if(src_bvalues[sorted_index[i]] != 0.0f)
+            order.push_back(sorted_index[i]);
+}
+
+void ImageModel::get_neighboring_dwi_pairs(std::vector<std::pair<int,int> >& corr_pairs) const
+{
+    corr_pairs.clear();
     for(int i = 0;i < src_bvalues.size();++i)
     {
         if(src_bvalues[i] == 0.0f)
@@ -323,9 +351,14 @@ float ImageModel::quality_control_neighboring_dwi_corr(void)
         }
         corr_pairs.push_back(std::make_pair(i,min_j));
     }
-    float self_cor = 0.0f;
-    unsigned int count = 0;
-    tipl::par_for(corr_pairs.size(),[&](int index)
+}
+
+float ImageModel::quality_control_neighboring_dwi_corr(void)
+{
+    std::vector<std::pair<int,int> > corr_pairs;
+    get_neighboring_dwi_pairs(corr_pairs);
+    std::vector<float> cor(corr_pairs.size());
+    tipl::par_for2(corr_pairs.size(),[&](int index,int)
     {
         int i1 = corr_pairs[index].first;
         int i2 = corr_pairs[index].second;
@@ -338,10 +371,12 @@ float ImageModel::quality_control_neighboring_dwi_corr(void)
                 I1.push_back(src_dwi_data[i1][i]);
                 I2.push_back(src_dwi_data[i2][i]);
             }
-        self_cor += tipl::correlation(I1.begin(),I1.end(),I2.begin());
-        ++count;
-    });
-    self_cor/= (float)count;
+        cor[index] = tipl::correlation(I1.begin(),I1.end(),I2.begin());
+    },voxel.thread_count);
+    float self_cor = 0.0f;
+    for(unsigned int index = 0;index < cor.size();++index)
+        self_cor += cor[index];
+    self_cor/= (float)cor.size();
     return self_cor;
 }
 bool ImageModel::is_human_data(void) const
@@ -866,16 +901,10 @@ void ImageModel::get_report(std::string& report)
     report = out.str();
 }
 
-bool ImageModel::load_from_file(const char* dwi_file_name)
+// dimension, voxel size, and b-table in mat_reader
+bool ImageModel::read_src_header(void)
 {
-    file_name = dwi_file_name;
-    if (!mat_reader.load_from_file(dwi_file_name))
-    {
-        error_msg = "Cannot open file";
-        return false;
-    }
     unsigned int row,col;
-
     const unsigned short* dim_ptr = 0;
     if (!mat_reader.read("dimension",row,col,dim_ptr))
     {
@@ -918,7 +947,20 @@ bool ImageModel::load_from_file(const char* dwi_file_name)
         src_bvectors[index].normalize();
         table += 4;
     }
+    return true;
+}
 
+bool ImageModel::load_from_file(const char* dwi_file_name)
+{
+    file_name = dwi_file_name;
+    if (!mat_reader.load_from_file(dwi_file_name))
+    {
+        error_msg = "Cannot open file";
+        return false;
+    }
+    if(!read_src_header())
+        return false;
+    unsigned int row,col;
     const char* report_buf = 0;
     if(mat_reader.read("report",row,col,report_buf))
         voxel.report = std::string(report_buf,report_buf+row*col);
@@ -1,11 +1,123 @@
 #ifndef IMAGE_MODEL_HPP
 #define IMAGE_MODEL_HPP
+#include <numeric>
+#include <thread>
 #include "tipl/tipl.hpp"
 #include "basic_voxel.hpp"
+// least-squares solve of one row: the normal matrix of the displacement
+// model only couples voxels whose displaced positions overlap, so it is banded
+struct distortion_row_solver{
+    std::vector<int> col_count,col_start,col_row;
+    std::vector<float> col_value;
+    std::vector<double> band,rhs;
+    void solve(int n,const int* i1p,const int* i2p,const float* w1p,const float* w2p,
+               const float* v1p,const float* v2p,float* vp)
+    {
+        int n2 = n + n;
+        // gather the nonzero entries of each column of the 2n-by-n system
+        // zero weights are skipped, they may point one past the row
+        col_count.assign(n2+1,0);
+        for(int i = 0;i < n;++i)
+        {
+            col_count[i1p[i]] += (w1p[i] != 1.0f);
+            col_count[i1p[i]+1] += (w1p[i] != 0.0f);
+            col_count[i2p[i]+n] += (w2p[i] != 1.0f);
+            col_count[i2p[i]+1+n] += (w2p[i] != 0.0f);
+        }
+        col_start.resize(n2+1);
+        col_start[0] = 0;
+        for(int c = 0;c < n2;++c)
+            col_start[c+1] = col_start[c]+col_count[c];
+        col_row.resize(col_start[n2]);
+        col_value.resize(col_start[n2]);
+        std::fill(col_count.begin(),col_count.end(),0);
+        auto add_entry = [&](int c,int row,float value)
+        {
+            if(value == 0.0f)
+                return;
+            int pos = col_start[c]+col_count[c]++;
+            col_row[pos] = row;
+            col_value[pos] = value;
+        };
+        for(int i = 0;i < n;++i)
+        {
+            add_entry(i1p[i],i,1.0f-w1p[i]);
+            add_entry(i1p[i]+1,i,w1p[i]);
+            add_entry(i2p[i]+n,i,1.0f-w2p[i]);
+            add_entry(i2p[i]+1+n,i,w2p[i]);
+        }
+        int bw = 0;
+        for(int c = 0;c < n2;++c)
+            for(int j = col_start[c];j < col_start[c+1];++j)
+                for(int k = col_start[c];k < j;++k)
+                    if(col_value[j] != 0.0f && col_value[k] != 0.0f)
+                        bw = std::max<int>(bw,std::abs(col_row[j]-col_row[k]));
+        int w = bw+1;
+        // lower band of the normal matrix: band[i*w+(j-i+bw)] for i-bw <= j <= i
+        band.assign(n*w,0.0);
+        rhs.assign(n,0.0);
+        for(int c = 0;c < n2;++c)
+        {
+            float y = c < n ? v1p[c] : v2p[c-n];
+            for(int j = col_start[c];j < col_start[c+1];++j)
+            {
+                int r = col_row[j];
+                double vr = col_value[j];
+                if(vr == 0.0)
+                    continue;
+                rhs[r] += vr*y;
+                for(int k = col_start[c];k < col_start[c+1];++k)
+                {
+                    int t = col_row[k];
+                    if(t <= r && col_value[k] != 0.0f)
+                        band[r*w+t-r+bw] += vr*col_value[k];
+                }
+            }
+        }
+        // small ridge in place of the pseudo-inverse for unconstrained voxels
+        double max_diag = 0.0;
+        for(int i = 0;i < n;++i)
+            max_diag = std::max<double>(max_diag,band[i*w+bw]);
+        double ridge = max_diag*1.0e-6+1.0e-12;
+        for(int i = 0;i < n;++i)
+            band[i*w+bw] += ridge;
+        // banded Cholesky factorization
+        for(int i = 0;i < n;++i)
+            for(int j = std::max<int>(0,i-bw);j <= i;++j)
+            {
+                double sum = band[i*w+j-i+bw];
+                for(int k = std::max<int>(0,i-bw);k < j;++k)
+                    sum -= band[i*w+k-i+bw]*band[j*w+k-j+bw];
+                if(i == j)
+                    band[i*w+bw] = std::sqrt(std::max<double>(sum,ridge));
+                else
+                    band[i*w+j-i+bw] = sum/band[j*w+bw];
+            }
+        // forward and backward substitution
+        for(int i = 0;i < n;++i)
+        {
+            double sum = rhs[i];
+            for(int k = std::max<int>(0,i-bw);k < i;++k)
+                sum -= band[i*w+k-i+bw]*rhs[k];
+            rhs[i] = sum/band[i*w+bw];
+        }
+        for(int i = n-1;i >= 0;--i)
+        {
+            double sum = rhs[i];
+            for(int k = i+1;k <= std::min<int>(n-1,i+bw);++k)
+                sum -= band[k*w+i-k+bw]*rhs[k];
+            rhs[i] = sum/band[i*w+bw];
+        }
+        std::copy(rhs.begin(),rhs.end(),vp);
+    }
+};
+
 struct distortion_map{
     const float pi_2 = 3.14159265358979323846f/2.0f;
     tipl::image<int,3> i1,i2;
     tipl::image<float,3> w1,w2;
+    unsigned int thread_count = std::max<unsigned int>(1,std::thread::hardware_concurrency());
+    std::vector<distortion_row_solver> solvers; // one per thread, reused across iterations
     void operator=(const tipl::image<float,3>& d)
     {
         int n = d.width();
@@ -32,8 +144,8 @@ struct distortion_map{
                     w2p[i] = 0.0f;
                     continue;
                 }
-                float p1 = std::max<float>(0.0f,std::min<float>((float)i+d[i],max_n));
-                float p2 = std::max<float>(0.0f,std::min<float>((float)i-d[i],max_n));
+                float p1 = std::max<float>(0.0f,std::min<float>((float)i+dp[i],max_n));
+                float p2 = std::max<float>(0.0f,std::min<float>((float)i-dp[i],max_n));
                 i1p[i] = p1;
                 i2p[i] = p2;
                 w1p[i] = p1-std::floor(p1);
@@ -46,8 +158,6 @@ struct distortion_map{
                              const tipl::image<float,3>& v)
     {
         int n = v.width();
-        j1.clear();
-        j2.clear();
         j1.resize(v.geometry());
         j2.resize(v.geometry());
         tipl::par_for(v.height()*v.depth(),[&](int pos)
@@ -60,6 +170,8 @@ struct distortion_map{
             const float* vp = &*v.begin()+pos;
             float* j1p = &j1[0]+pos;
             float* j2p = &j2[0]+pos;
+            std::fill(j1p,j1p+n,0.0f);
+            std::fill(j2p,j2p+n,0.0f);
             for(int i = 0;i < n;++i)
             {
                 float value = vp[i];
@@ -73,9 +185,6 @@ struct distortion_map{
                 j2p[i2+1] += vw2;
             }
         });
-
-
-
     }
 
     void calculate_original(const tipl::image<float,3>& v1,
@@ -83,42 +192,20 @@ struct distortion_map{
                 tipl::image<float,3>& v)
     {
         int n = v1.width();
-        int n2 = n + n;
-        int block2 = n*n;
-        v.clear();
         v.resize(v1.geometry());
-        tipl::par_for(v1.height()*v1.depth(),[&](int pos)
+        solvers.resize(thread_count);
+        tipl::par_for2(v1.height()*v1.depth(),[&](int pos,int thread_id)
         {
             pos *= n;
-            const int* i1p = &i1[0]+pos;
-            const int* i2p = &i2[0]+pos;
-            const float* w1p = &w1[0]+pos;
-            const float* w2p = &w2[0]+pos;
-            std::vector<float> M(block2*2); // a col by col + col matrix
-            float* p = &M[0];
-            for(int i = 0;i < n;++i,p += n2)
-            {
-                int i1v = i1p[i];
-                int i2v = i2p[i];
-                p[i1v] += 1.0f-w1p[i];
-                p[i1v+1] += w1p[i];
-                p[i2v+n] += 1.0f-w2p[i];
-                p[i2v+1+n] += w2p[i];
-            }
-            const float* v1p = &*v1.begin()+pos;
-            const float* v2p = &*v2.begin()+pos;
-            std::vector<float> y(n2);
-            std::copy(v1p,v1p+n,y.begin());
-            std::copy(v2p,v2p+n,y.begin()+n);
-            tipl::mat::pseudo_inverse_solve(&M[0],&y[0],&v[0]+pos,tipl::dyndim(n,n2));
-        });
+            solvers[thread_id].solve(n,&i1[0]+pos,&i2[0]+pos,&w1[0]+pos,&w2[0]+pos,
+                                     &*v1.begin()+pos,&*v2.begin()+pos,&v[0]+pos);
+        },thread_count);
     }
     void sample_gradient(const tipl::image<float,3>& g1,
                          const tipl::image<float,3>& g2,
                          tipl::image<float,3>& new_g)
     {
         int n = g1.width();
-        new_g.clear();
         new_g.resize(g1.geometry());
         tipl::par_for(g1.height()*g1.depth(),[&](int pos)
         {
@@ -136,11 +223,26 @@ struct distortion_map{
                 int i2 = i2p[i];
                 float w1 = w1p[i];
                 float w2 = w2p[i];
-                new_gp[i] += g1p[i1]*(1.0f-w1)+g1p[i1+1]*w1;
-                new_gp[i] += g2p[i2]*(1.0f-w2)+g2p[i2+1]*w2;
+                new_gp[i] = g1p[i1]*(1.0f-w1)+g1p[i1+1]*w1+
+                            g2p[i2]*(1.0f-w2)+g2p[i2+1]*w2;
             }
         });
     }
+    // sum of squared differences, reduced per thread
+    double cost(const tipl::image<float,3>& j1,const tipl::image<float,3>& j2) const
+    {
+        int n = j1.width();
+        std::vector<double> sum(thread_count);
+        tipl::par_for2(j1.height()*j1.depth(),[&](int pos,int thread_id)
+        {
+            pos *= n;
+            double s = 0.0;
+            for(int i = pos;i < pos+n;++i)
+                s += j1[i]*j1[i]+j2[i]*j2[i];
+            sum[thread_id] += s;
+        },thread_count);
+        return std::accumulate(sum.begin(),sum.end(),0.0);
+    }
 };
 
 
@@ -172,11 +274,13 @@ void distortion_estimate(const image_type& v1,const image_type& v2,
     else
         d.resize(geo);
     int n = v1.width();
-    tipl::image<float,3> old_d(geo),v(geo),new_g(geo),j1(geo),j2(geo);
-    float sum_dif = 0.0f;
+    tipl::image<float,3> old_d(geo),v(geo),new_g(geo),j1(geo),j2(geo),g1(geo),g2(geo);
+    double sum_dif = 0.0,first_cost = 0.0;
     float s = 0.5f;
+    unsigned int rollback_count = 0;
+    int iter = 0;
     distortion_map m;
-    for(int iter = 0;iter < 200;++iter)
+    for(;iter < 200;++iter)
     {
         m = d;
         // estimate the original signal v using d
@@ -187,16 +291,12 @@ void distortion_estimate(const image_type& v1,const image_type& v2,
         tipl::minus(j1,v1);
         tipl::minus(j2,v2);
 
-        float sum = 0.0f;
-        for(int i = 0;i < j1.size();++i)
-        {
-            sum += j1[i]*j1[i];
-            sum += j2[i]*j2[i];
-        }
-        std::cout << "total dif=" << sum << std::endl;
+        double sum = m.cost(j1,j2);
+        if(!iter)
+            first_cost = sum;
         if(iter && sum > sum_dif)
         {
-            std::cout << "cost increased.roll back." << std::endl;
+            ++rollback_count;
             if(s < 0.05f)
                 break;
             s *= 0.5f;
@@ -205,25 +305,30 @@ void distortion_estimate(const image_type& v1,const image_type& v2,
         else
         {
             sum_dif = sum;
-            tipl::image<float,3> g1(geo),g2(geo);
             tipl::gradient(j1.begin(),j1.end(),g1.begin(),2,1);
             tipl::gradient(j2.begin(),j2.end(),g2.begin(),2,1);
-            for(int i = 0;i < g1.size();++i)
+            tipl::par_for(g1.size(),[&](int i)
+            {
                 g1[i] = -g1[i];
+            });
             // sample gradient
             m.sample_gradient(g1,g2,new_g);
             old_d = d;
         }
-        tipl::multiply_constant(new_g,s);
-        tipl::add(d,new_g);
-        tipl::lower_threshold(d,0.0f);
-        for(int i = 0,pos = 0;i < geo.depth()*geo.height();++i,pos+=n)
+        tipl::par_for(d.height()*d.depth(),[&](int pos)
         {
+            pos *= n;
+            for(int i = pos;i < pos+n;++i)
+            {
+                new_g[i] *= s;
+                d[i] = std::max<float>(0.0f,d[i]+new_g[i]);
+            }
             d[pos] = 0.0f;
             d[pos+n-1] = 0.0f;
-        }
+        });
     }
-    std::cout << "end" << std::endl;
+    std::cout << "distortion estimation at width " << n << ": " << iter << " iterations, "
+              << rollback_count << " roll backs, cost " << first_cost << " -> " << sum_dif << std::endl;
 }
 
 struct ImageModel
@@ -246,6 +351,7 @@ public:
     tipl::image<float,3> dwi_sum;
     std::shared_ptr<ImageModel> study_src;
     void calculate_dwi_sum(void);
+    void normalize_dwi_sum(void);
     void remove(unsigned int index);
     void pre_dti(void);
     std::string check_b_table(void);
@@ -258,8 +364,17 @@ public:
     bool is_multishell(void);
     void get_report(std::string& report);
 public:
+    // both run on voxel.thread_count threads
     std::vector<std::pair<int,int> > get_bad_slices(void);
     float quality_control_neighboring_dwi_corr(void);
+    void get_sorted_dwi_index(std::vector<int>& order) const;
+    void get_neighboring_dwi_pairs(std::vector<std::pair<int,int> >& corr_pairs) const;
+    // dwi holds slices [z_offset,z_offset+dim.depth()) of each sorted DWI, and slices [z_from,z_to) of dwi are evaluated
+    static void get_slice_correlation(const std::vector<const unsigned short*>& dwi,
+                                      const tipl::geometry<3>& dim,int z_from,int z_to,int z_offset,
+                                      tipl::image<float,2>& cor_values,unsigned int thread_count);
+    static std::vector<std::pair<int,int> > select_bad_slices(const tipl::image<float,2>& cor_values,
+                                                              const tipl::image<unsigned char,3>& mask);
     bool is_human_data(void) const;
     void flip_b_table(const unsigned char* order);
     void flip_b_table(unsigned char dim);
@@ -277,6 +392,7 @@ public:
 
 
 public:
+    bool read_src_header(void);
     bool load_from_file(const char* dwi_file_name);
     void save_fib(const std::string& ext);
     void save_to_file(gz_mat_write& mat_writer);
@@ -7,8 +7,8 @@
 
 struct EstimateResponseFunction : public BaseProcess
 {
-    float max_value;
-    std::mutex  mutex;
+    // candidates are kept per thread and merged after the parallel run
+    std::vector<voxel_candidate> free_water,response;
     bool has_assigned_odf;
     unsigned int assigned_index;
 public:
@@ -27,27 +27,41 @@ public:
             has_assigned_odf = false;
         voxel.response_function.resize(voxel.ti.half_vertices_count);
         voxel.reponse_function_scaling = 0;
-        max_value = 0;
         std::fill(voxel.response_function.begin(),voxel.response_function.end(),1.0);
+        free_water.clear();
+        response.clear();
+        free_water.resize(voxel.thread_count);
+        response.resize(voxel.thread_count);
     }
-    virtual void run(Voxel& voxel, VoxelData& data)
+    virtual void run(Voxel&, VoxelData& data)
     {
-        std::lock_guard<std::mutex> lock(mutex);
-
+        // the first voxel with the largest diffusion wins
         float max_diffusion_value = std::accumulate(data.odf.begin(),data.odf.end(),0.0)/data.odf.size();
-        if (max_diffusion_value > voxel.reponse_function_scaling)
-		{
-			voxel.reponse_function_scaling = max_diffusion_value;
-			voxel.free_water_diffusion = data.odf;
-        }
+        if (max_diffusion_value > 0.0f)
+            free_water[data.thread_id].update(max_diffusion_value,data.voxel_index,data.odf,true);
 
         if(has_assigned_odf && data.voxel_index != assigned_index)
             return;
+        // the last voxel with the largest anisotropy wins
         float cur_value = data.fa[0]-data.fa[1]-data.fa[2];
-        if (cur_value < max_value)
-            return;
-        voxel.response_function = data.odf;
-        max_value = cur_value;
+        if (cur_value >= 0.0f)
+            response[data.thread_id].update(cur_value,data.voxel_index,data.odf,false);
+    }
+    virtual void merge(Voxel& voxel)
+    {
+        voxel_candidate max_free_water,max_response;
+        for(unsigned int index = 0;index < free_water.size();++index)
+        {
+            max_free_water.update(free_water[index],true);
+            max_response.update(response[index],false);
+        }
+        if(max_free_water.assigned)
+        {
+            voxel.reponse_function_scaling = max_free_water.value;
+            voxel.free_water_diffusion.swap(max_free_water.odf);
+        }
+        if(max_response.assigned)
+            voxel.response_function.swap(max_response.odf);
     }
 };
 
@@ -157,21 +157,15 @@ struct OutputODF : public BaseProcess
 {
 protected:
     std::vector<std::vector<float> > odf_data;
-    std::vector<unsigned int> odf_index_map;
+    std::shared_ptr<voxel_mask_index> mask_index;
 public:
     virtual void init(Voxel& voxel)
     {
         odf_data.clear();
         if (voxel.need_odf)
         {
-            unsigned int total_count = 0;
-            odf_index_map.resize(voxel.mask.size());
-            for (unsigned int index = 0;index < voxel.mask.size();++index)
-                if (voxel.mask[index])
-                {
-                    odf_index_map[index] = total_count;
-                    ++total_count;
-                }
+            mask_index = voxel.get_mask_index();
+            unsigned int total_count = mask_index->si2vi.size();
             try
             {
                 std::vector<unsigned int> size_list;
@@ -206,7 +200,7 @@ public:
 
         if (voxel.need_odf && data.fa[0] + 1.0 != 1.0)
         {
-            unsigned int odf_index = odf_index_map[data.voxel_index];
+            unsigned int odf_index = mask_index->vi2si[data.voxel_index];
             std::copy(data.odf.begin(),data.odf.end(),
                       odf_data[odf_index/odf_block_size].begin() + (odf_index%odf_block_size)*(voxel.ti.half_vertices_count));
         }
@@ -322,11 +316,12 @@ double base_function(double theta);
 struct SaveMetrics : public BaseProcess
 {
 protected:
-    std::vector<float> iso,gfa;
-    std::vector<std::vector<float> > fa,rdi,qa_inc,qa_dec;
+    masked_voxel_data<float> iso,gfa;
+    std::vector<masked_voxel_data<float> > fa,rdi,qa_inc,qa_dec;
+    std::vector<float> thread_z0;
 
     void output_anisotropy(gz_mat_write& mat_writer,
-                           const char* name,const std::vector<std::vector<float> >& metrics)
+                           const char* name,const std::vector<masked_voxel_data<float> >& metrics)
     {
         for (unsigned int index = 0;index < metrics.size();++index)
         {
@@ -335,7 +330,7 @@ protected:
             std::string num = out.str();
             std::string str = name + num;
             set_title(str.c_str());
-            mat_writer.write(str.c_str(),&*metrics[index].begin(),1,metrics[index].size());
+            metrics[index].write(mat_writer,str.c_str());
         }
     }
 
@@ -344,19 +339,30 @@ protected:
 public:
     virtual void init(Voxel& voxel)
     {
-        fa = std::move(std::vector<std::vector<float> >(voxel.max_fiber_number,std::vector<float>(voxel.dim.size())));
-        gfa = std::move(std::vector<float>(voxel.dim.size()));
-        iso= std::move(std::vector<float>(voxel.dim.size()));
+        fa.resize(voxel.max_fiber_number);
+        for (unsigned int index = 0;index < fa.size();++index)
+            fa[index].init(voxel);
+        gfa.init(voxel);
+        iso.init(voxel);
         if(voxel.compare_voxel) // DDI
         {
-            qa_inc = std::move(std::vector<std::vector<float> >(voxel.max_fiber_number,std::vector<float>(voxel.dim.size())));;
-            qa_dec = std::move(std::vector<std::vector<float> >(voxel.max_fiber_number,std::vector<float>(voxel.dim.size())));;
+            qa_inc.resize(voxel.max_fiber_number);
+            qa_dec.resize(voxel.max_fiber_number);
+            for (unsigned int index = 0;index < voxel.max_fiber_number;++index)
+            {
+                qa_inc[index].init(voxel);
+                qa_dec[index].init(voxel);
+            }
         }
         if(voxel.output_rdi)
         {
             float sigma = voxel.param[0]; //optimal 1.24
+            rdi.clear();
             for(float L = 0.2f;L <= sigma;L+= 0.2f)
-                rdi.push_back(std::move(std::vector<float>(voxel.dim.size())));
+            {
+                rdi.push_back(masked_voxel_data<float>());
+                rdi.back().init(voxel);
+            }
         }
 
         if(voxel.csf_calibration)
@@ -380,18 +386,20 @@ public:
         }
 
         voxel.z0 = 0.0;
+        thread_z0.clear();
+        thread_z0.resize(voxel.thread_count);
     }
     virtual void run(Voxel& voxel, VoxelData& data)
     {
-        iso[data.voxel_index] = data.min_odf;
-        gfa[data.voxel_index] = GeneralizedFA()(data.odf);
+        *iso.at(data.voxel_index) = data.min_odf;
+        *gfa.at(data.voxel_index) = GeneralizedFA()(data.odf);
         for (unsigned int index = 0;index < voxel.max_fiber_number;++index)
-            fa[index][data.voxel_index] = data.fa[index];
+            *fa[index].at(data.voxel_index) = data.fa[index];
         if(voxel.output_rdi)
             for (unsigned int index = 0;index < data.rdi.size();++index)
-                rdi[index][data.voxel_index] = data.rdi[index];
-        if(data.min_odf > voxel.z0)
-            voxel.z0 = data.min_odf;
+                *rdi[index].at(data.voxel_index) = data.rdi[index];
+        if(data.min_odf > thread_z0[data.thread_id])
+            thread_z0[data.thread_id] = data.min_odf;
         if(voxel.compare_voxel) // DDI
         {
             for (unsigned int index = 0;index < voxel.max_fiber_number;++index)
@@ -401,18 +409,23 @@ public:
                     float value2 = data.odf2[data.dir_index[index]];
                     float change = value2-value1;
                     if(change > 0.0f)
-                        qa_inc[index][data.voxel_index] = change/data.fa[index];
+                        *qa_inc[index].at(data.voxel_index) = change/data.fa[index];
                     else
-                        qa_dec[index][data.voxel_index] = -change/data.fa[index];
+                        *qa_dec[index].at(data.voxel_index) = -change/data.fa[index];
                 }
             data.odf = data.odf2;
             tipl::minus(data.odf,data.odf1);
         }
     }
+    virtual void merge(Voxel& voxel)
+    {
+        for (unsigned int index = 0;index < thread_z0.size();++index)
+            voxel.z0 = std::max<float>(voxel.z0,thread_z0[index]);
+    }
     virtual void end(Voxel& voxel,gz_mat_write& mat_writer)
     {
         set_title("output data");
-        mat_writer.write("gfa",&*gfa.begin(),1,gfa.size());
+        gfa.write(mat_writer,"gfa");
         if(voxel.csf_calibration)
             voxel.z0 = z0;
         if(voxel.z0 + 1.0 == 1.0)
@@ -422,23 +435,24 @@ public:
 
 
         for (unsigned int index = 0;index < voxel.max_fiber_number;++index)
-            tipl::divide_constant(fa[index],voxel.z0);
+            tipl::divide_constant(fa[index].data,voxel.z0);
         output_anisotropy(mat_writer,"fa",fa);
 
-        tipl::divide_constant(iso,voxel.z0);
-        mat_writer.write("iso",&*iso.begin(),1,iso.size());
+        tipl::divide_constant(iso.data,voxel.z0);
+        iso.write(mat_writer,"iso");
 
 
         // output normalized qa
         {
             float max_qa = 0.0;
             for (unsigned int i = 0;i < voxel.max_fiber_number;++i)
-                max_qa = std::max<float>(*std::max_element(fa[i].begin(),fa[i].end()),max_qa);
+                if(!fa[i].data.empty())
+                    max_qa = std::max<float>(*std::max_element(fa[i].data.begin(),fa[i].data.end()),max_qa);
 
             if(max_qa != 0.0)
             {
                 for (unsigned int index = 0;index < voxel.max_fiber_number;++index)
-                    tipl::divide_constant(fa[index],max_qa);
+                    tipl::divide_constant(fa[index].data,max_qa);
                 output_anisotropy(mat_writer,"nqa",fa);
             }
             if(voxel.compare_voxel) // DDI
@@ -448,26 +462,21 @@ public:
 
                 mat_writer.write("base_fa",&*voxel.fib_fa.begin(),1,voxel.fib_fa.size());
                 mat_writer.write("study_fa",&*voxel.compare_voxel->fib_fa.begin(),1,voxel.compare_voxel->fib_fa.size());
+                // fa differences cover the whole volume
+                std::vector<float> inc_fa(voxel.dim.size()),dec_fa(voxel.dim.size()),zero(voxel.dim.size());
                 for(int i = 0;i < voxel.dim.size();++i)
                     if(voxel.compare_voxel->fib_fa[i] > voxel.fib_fa[i])
-                    {
-                        qa_inc[0][i] = voxel.compare_voxel->fib_fa[i] - voxel.fib_fa[i];
-                        qa_dec[0][i] = 0;
-                    }
-                else
-                    {
-                        qa_dec[0][i] = voxel.fib_fa[i]-voxel.compare_voxel->fib_fa[i];
-                        qa_inc[0][i] = 0;
-                    }
-
-                for (unsigned int index = 1;index < voxel.max_fiber_number;++index)
+                        inc_fa[i] = voxel.compare_voxel->fib_fa[i] - voxel.fib_fa[i];
+                    else
+                        dec_fa[i] = voxel.fib_fa[i]-voxel.compare_voxel->fib_fa[i];
+                for (unsigned int index = 0;index < voxel.max_fiber_number;++index)
                 {
-                    std::fill(qa_inc[index].begin(),qa_inc[index].end(),0.0f);
-                    std::fill(qa_dec[index].begin(),qa_dec[index].end(),0.0f);
+                    std::ostringstream out1,out2;
+                    out1 << "inc_fa" << index;
+                    out2 << "dec_fa" << index;
+                    mat_writer.write(out1.str().c_str(),index ? &zero[0] : &inc_fa[0],1,zero.size());
+                    mat_writer.write(out2.str().c_str(),index ? &zero[0] : &dec_fa[0],1,zero.size());
                 }
-                output_anisotropy(mat_writer,"inc_fa",qa_inc);
-                output_anisotropy(mat_writer,"dec_fa",qa_dec);
-
             }
         }
 
@@ -475,25 +484,25 @@ public:
         if(voxel.output_rdi)
         {
             for(unsigned int i = 0;i < rdi.size();++i)
-                tipl::divide_constant(rdi[i],voxel.z0);
+                tipl::divide_constant(rdi[i].data,voxel.z0);
             float L = 0.2f;
             for(unsigned int i = 0;i < rdi.size();++i,L += 0.2f)
             {
                 std::ostringstream out;
                 out.precision(2);
                 out << "rdi" << std::setfill('0') << std::setw(2) << int(L*10) << "L";
-                mat_writer.write(out.str().c_str(),&*rdi[i].begin(),1,rdi[i].size());
+                rdi[i].write(mat_writer,out.str().c_str());
             }
-            for(unsigned int i = 0;i < rdi[0].size();++i)
+            for(unsigned int i = 0;i < rdi[0].data.size();++i)
             for(unsigned int j = 0;j < rdi.size();++j)
-                rdi[j][i] = rdi[rdi.size()-1][i]-rdi[j][i];
+                rdi[j].data[i] = rdi[rdi.size()-1].data[i]-rdi[j].data[i];
             L = 0.2f;
             for(unsigned int i = 0;i < rdi.size();++i,L += 0.2f)
             {
                 std::ostringstream out2;
                 out2.precision(2);
                 out2 << "nrdi" << std::setfill('0') << std::setw(2) << int(L*10) << "L";
-                mat_writer.write(out2.str().c_str(),&*rdi[i].begin(),1,rdi[i].size());
+                rdi[i].write(mat_writer,out2.str().c_str());
             }
         }
     }
@@ -504,20 +513,20 @@ public:
 struct SaveDirIndex : public BaseProcess
 {
 protected:
-    std::vector<std::vector<short> > findex;
+    std::vector<masked_voxel_data<short> > findex;
 public:
     virtual void init(Voxel& voxel)
     {
 
         findex.resize(voxel.max_fiber_number);
         for (unsigned int index = 0;index < voxel.max_fiber_number;++index)
-            findex[index].resize(voxel.dim.size());
+            findex[index].init(voxel);
     }
     virtual void run(Voxel& voxel, VoxelData& data)
     {
 
         for (unsigned int index = 0;index < voxel.max_fiber_number;++index)
-            findex[index][data.voxel_index] = data.dir_index[index];
+            *findex[index].at(data.voxel_index) = data.dir_index[index];
     }
     virtual void end(Voxel& voxel,gz_mat_write& mat_writer)
     {
@@ -529,7 +538,7 @@ public:
             std::string index_str = "index";
             index_str += num;
             set_title(index_str.c_str());
-            mat_writer.write(index_str.c_str(),&*findex[index].begin(),1,findex[index].size());
+            findex[index].write(mat_writer,index_str.c_str());
         }
     }
 };
@@ -538,21 +547,19 @@ public:
 struct SaveDir : public BaseProcess
 {
 protected:
-    std::vector<std::vector<float> > dir;
+    std::vector<masked_voxel_data<float> > dir;
 public:
     virtual void init(Voxel& voxel)
     {
 
         dir.resize(voxel.max_fiber_number);
         for (unsigned int index = 0;index < voxel.max_fiber_number;++index)
-            dir[index].resize(voxel.dim.size()*3);
+            dir[index].init(voxel,3);
     }
     virtual void run(Voxel& voxel, VoxelData& data)
     {
-
-        unsigned int dir_index = data.voxel_index;
         for (unsigned int index = 0;index < voxel.max_fiber_number;++index)
-            std::copy(data.dir[index].begin(),data.dir[index].end(),dir[index].begin() + dir_index + dir_index + dir_index);
+            std::copy(data.dir[index].begin(),data.dir[index].end(),dir[index].at(data.voxel_index));
     }
     virtual void end(Voxel& voxel,gz_mat_write& mat_writer)
     {
@@ -564,7 +571,7 @@ public:
             std::string index_str = "dir";
             index_str += num;
             set_title(index_str.c_str());
-            mat_writer.write(index_str.c_str(),&*dir[index].begin(),1,dir[index].size());
+            dir[index].write(mat_writer,index_str.c_str());
         }
     }
 };
@@ -626,21 +633,22 @@ struct SearchLocalMaximum
 
 struct DetermineFiberDirections : public BaseProcess
 {
-    SearchLocalMaximum lm;
-    std::mutex mutex;
+    std::vector<SearchLocalMaximum> lm;// one per thread
 public:
     virtual void init(Voxel& voxel)
     {
-        lm.init(voxel);
+        lm.resize(1);
+        lm[0].init(voxel);
+        lm.resize(voxel.thread_count,lm[0]);
     }
 
     virtual void run(Voxel& voxel,VoxelData& data)
     {
         data.min_odf = *std::min_element(data.odf.begin(),data.odf.end());
-        std::lock_guard<std::mutex> lock(mutex);
-        lm.search(data.odf);
-        std::map<float,unsigned short,std::greater<float> >::const_iterator iter = lm.max_table.begin();
-        std::map<float,unsigned short,std::greater<float> >::const_iterator end = lm.max_table.end();
+        SearchLocalMaximum& local_max = lm[data.thread_id];
+        local_max.search(data.odf);
+        std::map<float,unsigned short,std::greater<float> >::const_iterator iter = local_max.max_table.begin();
+        std::map<float,unsigned short,std::greater<float> >::const_iterator end = local_max.max_table.end();
         for (unsigned int index = 0;iter != end && index < voxel.max_fiber_number;++index,++iter)
         {
             data.dir_index[index] = iter->second;
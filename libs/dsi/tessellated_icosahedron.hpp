@@ -22,6 +22,64 @@ public:
     std::vector<tipl::vector<3,float> > vertices;
     std::vector<tipl::vector<3,short> > faces;
     std::vector<std::vector<float> > icosa_cos;
+private:
+    // candidate vertices for each cell of a cube-map over the direction sphere
+    unsigned int grid_size = 0;
+    std::vector<std::vector<unsigned short> > grid_candidates;
+    unsigned int grid_cell(const tipl::vector<3,float>& v) const
+    {
+        unsigned char a = 0;
+        if(std::abs(v[1]) > std::abs(v[a]))
+            a = 1;
+        if(std::abs(v[2]) > std::abs(v[a]))
+            a = 2;
+        float u = v[(a+1)%3]/v[a],w = v[(a+2)%3]/v[a];
+        unsigned int i = std::min<unsigned int>(grid_size-1,(unsigned int)std::max<float>(0.0f,(u+1.0f)*0.5f*grid_size));
+        unsigned int j = std::min<unsigned int>(grid_size-1,(unsigned int)std::max<float>(0.0f,(w+1.0f)*0.5f*grid_size));
+        return (a*grid_size+j)*grid_size+i;
+    }
+    void build_grid(void)
+    {
+        // the maximum edge length bounds the distance from any direction to its nearest vertex
+        double cover_angle = M_PI;
+        if(!faces.empty())
+        {
+            cover_angle = 0.0;
+            for(unsigned int i = 0;i < faces.size();++i)
+                for(unsigned int j = 0;j < 3;++j)
+                {
+                    double c = vertices[faces[i][j]]*vertices[faces[i][(j+1)%3]];
+                    cover_angle = std::max<double>(cover_angle,std::acos(std::max<double>(-1.0,std::min<double>(1.0,c))));
+                }
+        }
+        grid_size = std::max<unsigned int>(2,fold*2);
+        grid_candidates.clear();
+        grid_candidates.resize(3*grid_size*grid_size);
+        for(unsigned char a = 0;a < 3;++a)
+            for(unsigned int j = 0;j < grid_size;++j)
+                for(unsigned int i = 0;i < grid_size;++i)
+                {
+                    auto get_dir = [&](double u,double w)
+                    {
+                        tipl::vector<3,double> d;
+                        d[a] = 1.0;
+                        d[(a+1)%3] = u*2.0/grid_size-1.0;
+                        d[(a+2)%3] = w*2.0/grid_size-1.0;
+                        d.normalize();
+                        return d;
+                    };
+                    tipl::vector<3,double> center = get_dir(i+0.5,j+0.5);
+                    double radius = 0.0;
+                    for(unsigned int k = 0;k < 4;++k)
+                        radius = std::max<double>(radius,std::acos(std::min<double>(1.0,center*get_dir(i+(k & 1),j+(k >> 1)))));
+                    double angle = radius+cover_angle+0.01;
+                    double min_cos = angle >= M_PI*0.5 ? -1.0 : std::cos(angle);
+                    std::vector<unsigned short>& candidates = grid_candidates[(a*grid_size+j)*grid_size+i];
+                    for (unsigned int index = 0; index < half_vertices_count; ++index)
+                        if(std::abs(tipl::vector<3,double>(vertices[index])*center) >= min_cos)
+                            candidates.push_back(index);
+                }
+    }
 private:
     float face_dis,angle_res;
     unsigned short cur_vertex;
@@ -415,6 +473,7 @@ public:
             vertices[index] = odf_buffer;
         for (unsigned int  index = 0;index < faces_count_;++index,face_buffer += 3)
             faces[index] = face_buffer;
+        build_grid();
     }
 
     void init(unsigned int fold_)
@@ -465,7 +524,7 @@ public:
         check_vertex();
         check_face();
         #endif
-
+        build_grid();
     }
 
     short vertices_pair(short v1)
@@ -523,17 +582,34 @@ public:
             std::copy(faces[i].begin(),faces[i].end(),short_data.begin()+index);
     }
 
-    unsigned short discretize(const tipl::vector<3,float>& v)
+    // same result as scanning all vertices: candidates of the cell are
+    // scanned in index order, and include every vertex that can be the maximum
+    unsigned short discretize(const tipl::vector<3,float>& v) const
     {
         short dir_index = 0;
         float max_value = 0.0;
-        for (unsigned int index = 0; index < half_vertices_count; ++index)
+        if(grid_candidates.empty() ||
+           !(std::max(std::abs(v[0]),std::max(std::abs(v[1]),std::abs(v[2]))) > 0.0f))
+        {
+            for (unsigned int index = 0; index < half_vertices_count; ++index)
+            {
+                float value = std::abs(vertices[index]*v);
+                if (value > max_value)
+                {
+                    max_value = value;
+                    dir_index = index;
+                }
+            }
+            return dir_index;
+        }
+        const std::vector<unsigned short>& candidates = grid_candidates[grid_cell(v)];
+        for (unsigned int i = 0; i < candidates.size(); ++i)
         {
-            float value = std::abs(vertices[index]*v);
+            float value = std::abs(vertices[candidates[i]]*v);
             if (value > max_value)
             {
                 max_value = value;
-                dir_index = index;
+                dir_index = candidates[i];
             }
         }
         return dir_index;
@@ -5,13 +5,45 @@
 #else
 #include "zlib.h"
 #endif
+#include <cstring>
+#include <cstdint>
+#include <deque>
+#include <future>
+#include <thread>
+#include <atomic>
 #include "tipl/tipl.hpp"
 #include "prog_interface_static_link.h"
 extern bool prog_aborted_;
+// an empty gzip member whose extra field ('D','S') stores the total uncompressed size,
+// appended by gz_parallel_ostream so that gz_istream knows the size of multi-member files
+const size_t gz_size_member_length = 34;
+inline void write_size_member(uint64_t total_size,unsigned char* member)
+{
+    const unsigned char header[] = {0x1f,0x8b,8,4,0,0,0,0,0,255, // gzip header with FEXTRA
+                                    12,0,'D','S',8,0};            // XLEN and subfield header
+    std::memcpy(member,header,sizeof(header));
+    for(unsigned int i = 0;i < 8;++i)
+        member[16+i] = (unsigned char)(total_size >> (i*8));
+    std::fill(member+24,member+gz_size_member_length,0);
+    member[24] = 3; // empty final deflate block, followed by zero CRC32 and ISIZE
+}
+inline bool read_size_member(const unsigned char* member,uint64_t& total_size)
+{
+    unsigned char expected[gz_size_member_length];
+    write_size_member(0,expected);
+    if(!std::equal(member,member+16,expected) || !std::equal(member+24,member+gz_size_member_length,expected+24))
+        return false;
+    total_size = 0;
+    for(unsigned int i = 0;i < 8;++i)
+        total_size |= uint64_t(member[16+i]) << (i*8);
+    return true;
+}
 class gz_istream{
     size_t size_;
     std::ifstream in;
     gzFile handle;
+    // a stream read on a worker thread aborts on its own flag instead of the progress dialog
+    const std::atomic<bool>* abort_flag = nullptr;
     bool is_gz(const char* file_name)
     {
         std::string filename = file_name;
@@ -35,30 +67,66 @@ public:
         prog_aborted_ = false;
         in.open(file_name,std::ios::binary);
         unsigned int gz_size = 0;
+        bool has_total_size = false;
         if(in)
         {
-            in.seekg(-4,std::ios::end);
-            size_ = (size_t)in.tellg()+4;
-            in.read((char*)&gz_size,4);
+            in.seekg(0,std::ios::end);
+            size_ = (size_t)in.tellg();
+            // gz_parallel_ostream ends its multi-member output with an empty member holding the total size
+            unsigned char tail[gz_size_member_length];
+            if(size_ >= sizeof(tail))
+            {
+                in.seekg(-(long)sizeof(tail),std::ios::end);
+                in.read((char*)tail,sizeof(tail));
+                uint64_t total_size = 0;
+                if(in && read_size_member(tail,total_size))
+                {
+                    gz_size = 0;
+                    size_ = total_size;
+                    has_total_size = true;
+                }
+            }
+            if(!has_total_size && size_ >= 4)
+            {
+                in.seekg(-4,std::ios::end);
+                in.read((char*)&gz_size,4);
+            }
+            in.clear();
             in.seekg(0,std::ios::beg);
         }
         if(is_gz(file_name))
         {
             in.close();
-            if(size_ > gz_size) // size > 4G
-                size_ = size_*2;
-            else
-                size_ = gz_size;
+            if(!has_total_size)
+            {
+                if(size_ > gz_size) // size > 4G
+                    size_ = size_*2;
+                else
+                    size_ = gz_size;
+            }
             handle = gzopen(file_name, "rb");
             return handle;
         }
         return in.good();
     }
+    void set_abort_flag(const std::atomic<bool>* flag)
+    {
+        abort_flag = flag;
+    }
     bool read(void* buf,size_t buf_size)
     {
-        check_prog(100*cur()/size(),100);
-        if(prog_aborted())
-            return false;
+        if(abort_flag)
+        {
+            if(*abort_flag)
+                return false;
+        }
+        else
+        {
+            check_prog(100*cur()/size(),100);
+            if(prog_aborted())
+                return false;
+        }
+        prog_add_bytes_read(buf_size);
         if(handle)
         {
 
@@ -156,6 +224,7 @@ public:
     }
     void write(const void* buf,size_t size)
     {
+        prog_add_bytes_written(size);
         if(handle)
         {
             const size_t block_size = 524288000;// 500mb
@@ -190,9 +259,157 @@ public:
     bool operator!() const	{return !(handle? true:out.good());}
 };
 
+// SRC output only: deflates 4 MB chunks as independent gzip members on worker threads
+// and writes them in order, bounding the number of chunks in flight. The output ends
+// with an empty member holding the total size (see write_size_member); gzip, zcat and
+// zlib's gzread read it as part of the concatenated stream.
+// Checking the stream state (if(!writer)) first writes out everything buffered so far,
+// so a check after the last write reports compression and write errors.
+class gz_parallel_ostream{
+    std::ofstream out;
+    bool gz = false;
+    static const size_t chunk_size = 4194304;// 4mb
+    std::vector<unsigned char> buffer;
+    std::deque<std::future<std::vector<unsigned char> > > compressed;
+    bool has_member = false;
+    uint64_t total_size = 0;
+    bool is_gz(const char* file_name)
+    {
+        std::string filename = file_name;
+        if (filename.length() > 3 &&
+                filename[filename.length()-3] == '.' &&
+                filename[filename.length()-2] == 'g' &&
+                filename[filename.length()-1] == 'z')
+            return true;
+        return false;
+    }
+    static std::vector<unsigned char> deflate_member(const std::vector<unsigned char>& data)
+    {
+        std::vector<unsigned char> result;
+        z_stream strm;
+        std::memset(&strm,0,sizeof(strm));
+        if(deflateInit2(&strm,Z_DEFAULT_COMPRESSION,Z_DEFLATED,15+16,8,Z_DEFAULT_STRATEGY) != Z_OK)
+            return result;
+        result.resize(deflateBound(&strm,(uLong)data.size())+64);
+        strm.next_in = data.empty() ? 0 : (Bytef*)&data[0];
+        strm.avail_in = (uInt)data.size();
+        strm.next_out = (Bytef*)&result[0];
+        strm.avail_out = (uInt)result.size();
+        if(deflate(&strm,Z_FINISH) != Z_STREAM_END)
+            result.clear();
+        else
+            result.resize(strm.total_out);
+        deflateEnd(&strm);
+        return result;
+    }
+    bool write_member(void)
+    {
+        std::vector<unsigned char> result = compressed.front().get();
+        compressed.pop_front();
+        if(result.empty())
+        {
+            out.setstate(std::ios::failbit);
+            return false;
+        }
+        out.write((const char*)&result[0],result.size());
+        return out.good();
+    }
+    bool flush_chunk(bool force)
+    {
+        if(buffer.empty() && !force)
+            return true;
+        std::shared_ptr<std::vector<unsigned char> > data(new std::vector<unsigned char>);
+        data->swap(buffer);
+        compressed.push_back(std::async(std::launch::async,[data](){return deflate_member(*data);}));
+        has_member = true;
+        size_t max_pending = std::max<size_t>(2,std::thread::hardware_concurrency());
+        while(compressed.size() > max_pending)
+            if(!write_member())
+                return false;
+        return true;
+    }
+    // writes out the buffered data and all pending members
+    bool sync(void)
+    {
+        if(gz)
+        {
+            if(!flush_chunk(false))
+                return false;
+            while(!compressed.empty())
+                if(!write_member())
+                    return false;
+        }
+        out.flush();
+        return out.good();
+    }
+public:
+    gz_parallel_ostream(void){}
+    ~gz_parallel_ostream(void)
+    {
+        close();
+    }
+public:
+    template<class char_type>
+    bool open(const char_type* file_name)
+    {
+        gz = is_gz(file_name);
+        has_member = false;
+        total_size = 0;
+        out.open(file_name,std::ios::binary);
+        return out.good();
+    }
+    void write(const void* buf,size_t size)
+    {
+        prog_add_bytes_written(size);
+        if(gz)
+        {
+            total_size += size;
+            const unsigned char* ptr = (const unsigned char*)buf;
+            while(size)
+            {
+                if(buffer.empty())
+                    buffer.reserve(chunk_size);
+                size_t length = std::min<size_t>(size,chunk_size-buffer.size());
+                buffer.insert(buffer.end(),ptr,ptr+length);
+                ptr += length;
+                size -= length;
+                if(buffer.size() == chunk_size && !flush_chunk(false))
+                {
+                    close();
+                    throw std::runtime_error("Cannot output gz file");
+                }
+            }
+        }
+        else
+            if(out)
+                out.write((const char*)buf,size);
+    }
+    void close(void)
+    {
+        if(gz)
+        {
+            gz = false;
+            // an empty file still gets a valid gzip member
+            flush_chunk(!has_member);
+            while(!compressed.empty())
+                write_member();
+            buffer.clear();
+            unsigned char member[gz_size_member_length];
+            write_size_member(total_size,member);
+            if(out)
+                out.write((const char*)member,sizeof(member));
+        }
+        if(out.is_open())
+            out.close();
+    }
+    operator bool() const	{return const_cast<gz_parallel_ostream*>(this)->sync();}
+    bool operator!() const	{return !const_cast<gz_parallel_ostream*>(this)->sync();}
+};
+
 
 typedef tipl::io::nifti_base<gz_istream,gz_ostream> gz_nifti;
 typedef tipl::io::mat_write_base<gz_ostream> gz_mat_write;
+typedef tipl::io::mat_write_base<gz_parallel_ostream> gz_mat_parallel_write;
 typedef tipl::io::mat_read_base<gz_istream> gz_mat_read;
 
 #endif // GZIP_INTERFACE_HPP
@@ -1,7 +1,71 @@
+#include <QFile>
+#include <QFileInfo>
+#include <random>
+#include <chrono>
 #include "connectometry_db.hpp"
 #include "fib_data.hpp"
 
+// The out-of-core subject file stores the subject matrices uncompressed and page-aligned
+// so that they can be memory-mapped. Header: tag, key, subject count, subject length, 1/sd of each subject.
+// The key is also stored in the db as "subject_file_key" to tie the two files together.
+const char subject_file_tag[8] = {'D','B','S','U','B','J','0','2'};
+const size_t subject_file_page = 4096;
+size_t subject_file_round(size_t size)
+{
+    return (size+subject_file_page-1)/subject_file_page*subject_file_page;
+}
+size_t subject_file_offset(unsigned int subject_count)
+{
+    return subject_file_round(sizeof(subject_file_tag)+sizeof(unsigned int)*4+sizeof(float)*subject_count);
+}
+class subject_file_writer{
+    std::ofstream out;
+    unsigned int subject_count,subject_length;
+    std::vector<float> sd;
+    std::vector<char> padding;
+public:
+    unsigned int key[2];
+public:
+    subject_file_writer(const char* file_name,unsigned int subject_count_,unsigned int subject_length_):
+        out(file_name,std::ios::binary),subject_count(subject_count_),subject_length(subject_length_),
+        padding(subject_file_round(subject_length_*sizeof(float))-subject_length_*sizeof(float))
+    {
+        std::random_device rd;
+        key[0] = rd();
+        key[1] = rd() ^ (unsigned int)std::chrono::system_clock::now().time_since_epoch().count();
+        std::vector<char> header(subject_file_offset(subject_count));
+        out.write(&header[0],header.size());
+    }
+    bool add(const float* data,float subject_sd)
+    {
+        out.write((const char*)data,subject_length*sizeof(float));
+        if(!padding.empty())
+            out.write(&padding[0],padding.size());
+        sd.push_back(subject_sd);
+        return out.good();
+    }
+    bool close(void)
+    {
+        if(sd.size() != subject_count)
+            return false;
+        out.seekp(0,std::ios::beg);
+        out.write(subject_file_tag,sizeof(subject_file_tag));
+        out.write((const char*)key,sizeof(key));
+        out.write((const char*)&subject_count,sizeof(unsigned int));
+        out.write((const char*)&subject_length,sizeof(unsigned int));
+        if(subject_count)
+            out.write((const char*)&sd[0],sizeof(float)*subject_count);
+        out.close();
+        return out.good();
+    }
+};
+
+
 void connectometry_db::read_db(fib_data* handle_)
+{
+    read_db(handle_,handle_->mat_reader);
+}
+void connectometry_db::read_db(fib_data* handle_,gz_mat_read& subject_reader)
 {
     handle = handle_;
     subject_qa.clear();
@@ -12,7 +76,7 @@ void connectometry_db::read_db(fib_data* handle_)
         std::ostringstream out;
         out << "subject" << index;
         const float* buf = 0;
-        handle->mat_reader.read(out.str().c_str(),row,col,buf);
+        subject_reader.read(out.str().c_str(),row,col,buf);
         if (!buf)
             break;
         if(!index)
@@ -21,6 +85,18 @@ void connectometry_db::read_db(fib_data* handle_)
         subject_qa_sd.push_back(0);
     }
 
+    if(subject_qa.empty() && QFileInfo(subject_file_name.c_str()).exists())
+    {
+        // map_subject_file reports the reason in handle->error_msg
+        if(!map_subject_file(subject_file_name))
+        {
+            num_subjects = 0;
+            subject_qa.clear();
+            subject_qa_sd.clear();
+            return;
+        }
+    }
+    else
     tipl::par_for(subject_qa.size(),[&](int i){
         subject_qa_sd[i] = tipl::standard_deviation(subject_qa[i],subject_qa[i]+subject_qa_length);
         if(subject_qa_sd[i] == 0.0)
@@ -70,6 +146,67 @@ void connectometry_db::read_db(fib_data* handle_)
     calculate_si2vi();
 }
 
+bool connectometry_db::map_subject_file(const std::string& file_name)
+{
+    std::shared_ptr<QFile> file(new QFile(file_name.c_str()));
+    char tag[sizeof(subject_file_tag)];
+    unsigned int key[2];
+    unsigned int header[2];
+    if(!file->open(QIODevice::ReadOnly) ||
+       file->read(tag,sizeof(tag)) != sizeof(tag) ||
+       !std::equal(tag,tag+sizeof(tag),subject_file_tag) ||
+       file->read((char*)key,sizeof(key)) != sizeof(key) ||
+       file->read((char*)header,sizeof(header)) != sizeof(header))
+    {
+        handle->error_msg = "Invalid subject data file ";
+        handle->error_msg += file_name;
+        return false;
+    }
+    // the subject file must be the one written with this db, and match its subjects and voxels
+    {
+        unsigned int row,col;
+        const unsigned int* db_key = 0;
+        const float* r2_values = 0;
+        size_t voxel_count = 0;
+        for(size_t index = 0;index < handle->dim.size();++index)
+            if(handle->dir.fa[0][index] != 0.0)
+                ++voxel_count;
+        if(!handle->mat_reader.read("subject_file_key",row,col,db_key) || row*col != 2 ||
+           db_key[0] != key[0] || db_key[1] != key[1] ||
+           !handle->mat_reader.read("R2",row,col,r2_values) || row*col != header[0] ||
+           size_t(header[1]) != handle->dir.num_fiber*voxel_count)
+        {
+            handle->error_msg = "The subject data file does not match the database: ";
+            handle->error_msg += file_name;
+            return false;
+        }
+    }
+    size_t stride = subject_file_round(header[1]*sizeof(float));
+    size_t offset = subject_file_offset(header[0]);
+    std::vector<float> sd(header[0]);
+    if((header[0] && file->read((char*)&sd[0],sizeof(float)*header[0]) != sizeof(float)*header[0]) ||
+       (size_t)file->size() < offset+stride*header[0])
+    {
+        handle->error_msg = "Incomplete subject data file ";
+        handle->error_msg += file_name;
+        return false;
+    }
+    // the subject data are paged in by the OS on demand
+    const uchar* ptr = file->map(0,file->size());
+    if(!ptr)
+    {
+        handle->error_msg = "Cannot map subject data file ";
+        handle->error_msg += file_name;
+        return false;
+    }
+    subject_qa.resize(header[0]);
+    for(unsigned int index = 0;index < header[0];++index)
+        subject_qa[index] = (const float*)(ptr + offset + stride*index);
+    subject_qa_sd.swap(sd);
+    subject_qa_length = header[1];
+    subject_file = file;
+    return true;
+}
 void connectometry_db::remove_subject(unsigned int index)
 {
     if(index >= subject_qa.size())
@@ -100,12 +237,12 @@ bool connectometry_db::sample_odf(gz_mat_read& m,std::vector<float>& data)
     if(!subject_odf.read(m))
         return false;
     set_title("load data");
-    for(unsigned int index = 0;index < si2vi.size();++index)
+    tipl::par_for(si2vi.size(),[&](unsigned int index)
     {
         unsigned int cur_index = si2vi[index];
         const float* odf = subject_odf.get_odf_data(cur_index);
         if(odf == 0)
-            continue;
+            return;
         float min_value = *std::min_element(odf, odf + handle->dir.half_odf_size);
         unsigned int pos = index;
         for(unsigned char i = 0;i < handle->dir.num_fiber;++i,pos += (unsigned int)si2vi.size())
@@ -115,7 +252,7 @@ bool connectometry_db::sample_odf(gz_mat_read& m,std::vector<float>& data)
             // 0: subject index 1:findex by s_index (fa > 0)
             data[pos] = odf[handle->dir.findex[i][cur_index]]-min_value;
         }
-    }
+    });
     return true;
 }
 bool connectometry_db::sample_index(gz_mat_read& m,std::vector<float>& data,const char* index_name)
@@ -124,7 +261,7 @@ bool connectometry_db::sample_index(gz_mat_read& m,std::vector<float>& data,cons
     unsigned int row,col;
     if(!m.read(index_name,row,col,index_of_interest))
         return false;
-    for(unsigned int index = 0;index < si2vi.size();++index)
+    tipl::par_for(si2vi.size(),[&](unsigned int index)
     {
         unsigned int cur_index = si2vi[index];
         unsigned int pos = index;
@@ -134,7 +271,7 @@ bool connectometry_db::sample_index(gz_mat_read& m,std::vector<float>& data,cons
                 break;
             data[pos] = index_of_interest[cur_index];
         }
-    }
+    });
     return true;
 }
 bool connectometry_db::is_consistent(gz_mat_read& m)
@@ -178,17 +315,11 @@ bool connectometry_db::is_consistent(gz_mat_read& m)
     }
     return true;
 }
-bool connectometry_db::add_subject_file(const std::string& file_name,
-                                         const std::string& subject_name)
+bool connectometry_db::sample_subject(gz_mat_read& m,const std::string& file_name,
+                                       std::vector<float>& data,float& r2)
 {
-    gz_mat_read m;
-    if(!m.load_from_file(file_name.c_str()))
-    {
-        handle->error_msg = "failed to load subject data ";
-        handle->error_msg += file_name;
-        return false;
-    }
-    std::vector<float> new_subject_qa(subject_qa_length);
+    data.clear();
+    data.resize(subject_qa_length);
     if(index_name == "sdf" || index_name.empty())
     {
         if(!is_consistent(m))
@@ -196,7 +327,7 @@ bool connectometry_db::add_subject_file(const std::string& file_name,
             handle->error_msg += file_name;
             return false;
         }
-        if(!sample_odf(m,new_subject_qa))
+        if(!sample_odf(m,data))
         {
             handle->error_msg = "Failed to read odf ";
             handle->error_msg += file_name;
@@ -205,7 +336,7 @@ bool connectometry_db::add_subject_file(const std::string& file_name,
     }
     else
     {
-        if(!sample_index(m,new_subject_qa,index_name.c_str()))
+        if(!sample_index(m,data,index_name.c_str()))
         {
             handle->error_msg = "Failed to sample ";
             handle->error_msg += index_name;
@@ -224,10 +355,27 @@ bool connectometry_db::add_subject_file(const std::string& file_name,
         handle->error_msg += file_name;
         return false;
     }
-    R2.push_back(*value);
+    r2 = *value;
     const char* report_buf = 0;
     if(subject_report.empty() && m.read("report",row,col,report_buf))
         subject_report = std::string(report_buf,report_buf+row*col);
+    return true;
+}
+bool connectometry_db::add_subject_file(const std::string& file_name,
+                                         const std::string& subject_name)
+{
+    gz_mat_read m;
+    if(!m.load_from_file(file_name.c_str()))
+    {
+        handle->error_msg = "failed to load subject data ";
+        handle->error_msg += file_name;
+        return false;
+    }
+    std::vector<float> new_subject_qa;
+    float r2 = 0.0f;
+    if(!sample_subject(m,file_name,new_subject_qa,r2))
+        return false;
+    R2.push_back(r2);
     subject_qa_buf.push_back(std::move(new_subject_qa));
     subject_qa.push_back(&(subject_qa_buf.back()[0]));
     subject_names.push_back(subject_name);
@@ -241,33 +389,151 @@ bool connectometry_db::add_subject_file(const std::string& file_name,
     modified = true;
     return true;
 }
+bool connectometry_db::create_db_from_files(const char* output_name,
+                                            const std::vector<std::string>& file_names,
+                                            const std::vector<std::string>& names,
+                                            unsigned int thread_count,
+                                            bool out_of_core)
+{
+    bool result = false;
+    {
+        gz_mat_write matfile(output_name);
+        if(!matfile)
+        {
+            handle->error_msg = "Cannot output file";
+            return false;
+        }
+        result = write_db_from_files(matfile,output_name,file_names,names,thread_count,out_of_core);
+        if(result && !matfile)
+        {
+            handle->error_msg = "Cannot output file";
+            result = false;
+        }
+    }
+    // a failed or aborted database is incomplete, so it is not left behind
+    if(!result)
+    {
+        QFile::remove(output_name);
+        if(out_of_core)
+            QFile::remove((std::string(output_name)+".subjects").c_str());
+    }
+    return result;
+}
+bool connectometry_db::write_db_from_files(gz_mat_write& matfile,
+                                           const char* output_name,
+                                           const std::vector<std::string>& file_names,
+                                           const std::vector<std::string>& names,
+                                           unsigned int thread_count,
+                                           bool out_of_core)
+{
+    write_template(matfile);
+    std::shared_ptr<subject_file_writer> subject_out;
+    if(out_of_core)
+        subject_out.reset(new subject_file_writer((std::string(output_name)+".subjects").c_str(),
+                                                  (unsigned int)file_names.size(),subject_qa_length));
+    // subject files are decompressed ahead on worker threads, while the loaded ones are
+    // sampled and appended to the output in order. At most thread_count files are in memory.
+    auto load_file = [](std::string file_name)
+    {
+        std::shared_ptr<gz_mat_read> m(new gz_mat_read);
+        if(!m->load_from_file(file_name.c_str()))
+            m.reset();
+        return m;
+    };
+    if(thread_count < 1)
+        thread_count = 1;
+    std::vector<std::future<std::shared_ptr<gz_mat_read> > > loaders(file_names.size());
+    for(unsigned int index = 0;index < thread_count && index < file_names.size();++index)
+        loaders[index] = std::async(std::launch::async,load_file,file_names[index]);
 
+    std::vector<float> new_R2;
+    std::vector<float> data;
+    begin_prog("creating database");
+    for(unsigned int index = 0;check_prog(index,(unsigned int)file_names.size());++index)
+    {
+        std::shared_ptr<gz_mat_read> m = loaders[index].get();
+        if(index + thread_count < file_names.size())
+            loaders[index + thread_count] = std::async(std::launch::async,load_file,file_names[index + thread_count]);
+        if(!m.get())
+        {
+            handle->error_msg = "failed to load subject data ";
+            handle->error_msg += file_names[index];
+            return false;
+        }
+        float r2 = 0.0f;
+        if(!sample_subject(*m.get(),file_names[index],data,r2))
+            return false;
+        m.reset();
+        new_R2.push_back(r2);
+        if(subject_out.get())
+        {
+            float sd = tipl::standard_deviation(data.begin(),data.end());
+            if(!subject_out->add(&data[0],sd == 0.0f ? 1.0f : 1.0f/sd))
+            {
+                handle->error_msg = "Cannot output subject data file";
+                return false;
+            }
+            continue;
+        }
+        std::ostringstream out;
+        out << "subject" << index;
+        matfile.write(out.str().c_str(),&data[0],handle->dir.num_fiber,(unsigned int)si2vi.size());
+    }
+    if(prog_aborted())
+    {
+        handle->error_msg = "Database creation aborted";
+        return false;
+    }
+    if(subject_out.get())
+    {
+        if(!subject_out->close())
+        {
+            handle->error_msg = "Cannot output subject data file";
+            return false;
+        }
+        matfile.write("subject_file_key",subject_out->key,1,2);
+    }
+    write_db_info(matfile,names,new_R2);
+    return true;
+}
+void connectometry_db::get_subject_fixel_pos(std::vector<unsigned int>& fixel_pos,
+                                             const tipl::image<int,3>& cerebrum_mask,float fiber_threshold) const
+{
+    fixel_pos.clear();
+    for(unsigned int s_index = 0;s_index < si2vi.size();++s_index)
+    {
+        unsigned int cur_index = si2vi[s_index];
+        if(!cerebrum_mask[cur_index])
+            continue;
+        for(unsigned int j = 0,fib_offset = 0;j < handle->dir.num_fiber && handle->dir.fa[j][cur_index] > fiber_threshold;
+                ++j,fib_offset+=si2vi.size())
+            fixel_pos.push_back(s_index + fib_offset);
+    }
+}
+void normalize_subject_vector(std::vector<float>& subject_vector)
+{
+    float sd = tipl::standard_deviation(subject_vector.begin(),subject_vector.end(),tipl::mean(subject_vector.begin(),subject_vector.end()));
+    if(sd > 0.0)
+        tipl::multiply_constant(subject_vector.begin(),subject_vector.end(),1.0/sd);
+}
 void connectometry_db::get_subject_vector(unsigned int from,unsigned int to,
                                           std::vector<std::vector<float> >& subject_vector,
                         const tipl::image<int,3>& cerebrum_mask,float fiber_threshold,bool normalize_fp) const
 {
+    std::vector<unsigned int> fixel_pos;
+    get_subject_fixel_pos(fixel_pos,cerebrum_mask,fiber_threshold);
     unsigned int total_count = to-from;
     subject_vector.clear();
     subject_vector.resize(total_count);
     tipl::par_for(total_count,[&](unsigned int index)
     {
-        unsigned int subject_index = index + from;
-        for(unsigned int s_index = 0;s_index < si2vi.size();++s_index)
-        {
-            unsigned int cur_index = si2vi[s_index];
-            if(!cerebrum_mask[cur_index])
-                continue;
-            for(unsigned int j = 0,fib_offset = 0;j < handle->dir.num_fiber && handle->dir.fa[j][cur_index] > fiber_threshold;
-                    ++j,fib_offset+=si2vi.size())
-                subject_vector[index].push_back(subject_qa[subject_index][s_index + fib_offset]);
-        }
-    });
-    if(normalize_fp)
-    tipl::par_for(num_subjects,[&](unsigned int index)
-    {
-        float sd = tipl::standard_deviation(subject_vector[index].begin(),subject_vector[index].end(),tipl::mean(subject_vector[index].begin(),subject_vector[index].end()));
-        if(sd > 0.0)
-            tipl::multiply_constant(subject_vector[index].begin(),subject_vector[index].end(),1.0/sd);
+        const float* qa = subject_qa[index + from];
+        std::vector<float>& v = subject_vector[index];
+        v.resize(fixel_pos.size());
+        for(unsigned int i = 0;i < fixel_pos.size();++i)
+            v[i] = qa[fixel_pos[i]];
+        if(normalize_fp)
+            normalize_subject_vector(v);
     });
 }
 void connectometry_db::get_subject_vector_pos(std::vector<int>& subject_vector_pos,
@@ -287,22 +553,25 @@ void connectometry_db::get_subject_vector_pos(std::vector<int>& subject_vector_p
 void connectometry_db::get_subject_vector(unsigned int subject_index,std::vector<float>& subject_vector,
                         const tipl::image<int,3>& cerebrum_mask,float fiber_threshold,bool normalize_fp) const
 {
-    subject_vector.clear();
-    for(unsigned int s_index = 0;s_index < si2vi.size();++s_index)
-    {
-        unsigned int cur_index = si2vi[s_index];
-        if(!cerebrum_mask[cur_index])
-            continue;
-        for(unsigned int j = 0,fib_offset = 0;j < handle->dir.num_fiber && handle->dir.fa[j][cur_index] > fiber_threshold;
-                ++j,fib_offset+=si2vi.size())
-            subject_vector.push_back(subject_qa[subject_index][s_index + fib_offset]);
-    }
+    std::vector<unsigned int> fixel_pos;
+    get_subject_fixel_pos(fixel_pos,cerebrum_mask,fiber_threshold);
+    subject_vector.resize(fixel_pos.size());
+    for(unsigned int i = 0;i < fixel_pos.size();++i)
+        subject_vector[i] = subject_qa[subject_index][fixel_pos[i]];
     if(normalize_fp)
-    {
-        float sd = tipl::standard_deviation(subject_vector.begin(),subject_vector.end(),tipl::mean(subject_vector.begin(),subject_vector.end()));
-        if(sd > 0.0)
-            tipl::multiply_constant(subject_vector.begin(),subject_vector.end(),1.0/sd);
-    }
+        normalize_subject_vector(subject_vector);
+}
+// single precision dot product over a short chunk, independent lanes allow vectorization
+inline float chunk_dot(const float* a,const float* b,unsigned int size)
+{
+    float sum[8] = {0.0f,0.0f,0.0f,0.0f,0.0f,0.0f,0.0f,0.0f};
+    unsigned int i = 0;
+    for(;i+8 <= size;i += 8)
+        for(unsigned int k = 0;k < 8;++k)
+            sum[k] += a[i+k]*b[i+k];
+    for(;i < size;++i)
+        sum[0] += a[i]*b[i];
+    return ((sum[0]+sum[1])+(sum[2]+sum[3]))+((sum[4]+sum[5])+(sum[6]+sum[7]));
 }
 void connectometry_db::get_dif_matrix(std::vector<float>& matrix,const tipl::image<int,3>& cerebrum_mask,float fiber_threshold,bool normalize_fp)
 {
@@ -310,18 +579,49 @@ void connectometry_db::get_dif_matrix(std::vector<float>& matrix,const tipl::ima
     matrix.resize(num_subjects*num_subjects);
     std::vector<std::vector<float> > subject_vector;
     get_subject_vector(0,num_subjects,subject_vector,cerebrum_mask,fiber_threshold,normalize_fp);
+    if(!num_subjects || subject_vector[0].empty())
+        return;
+    // rmse(a,b)^2 = (|a|^2+|b|^2-2a.b)/n, where a.b is computed as a blocked Gram matrix
+    // chunks are summed in single precision and accumulated in double precision
+    const unsigned int block_size = 16;
+    const unsigned int chunk_size = 2048;
+    unsigned int length = (unsigned int)subject_vector[0].size();
+    std::vector<double> norm2(num_subjects);
+    tipl::par_for(num_subjects,[&](unsigned int i)
+    {
+        const float* a = &subject_vector[i][0];
+        double sum = 0.0;
+        for(unsigned int from = 0;from < length;from += chunk_size)
+            sum += chunk_dot(a+from,a+from,std::min<unsigned int>(chunk_size,length-from));
+        norm2[i] = sum;
+    });
+    std::vector<std::pair<unsigned int,unsigned int> > blocks;
+    for(unsigned int i = 0;i < num_subjects;i += block_size)
+        for(unsigned int j = i;j < num_subjects;j += block_size)
+            blocks.push_back(std::make_pair(i,j));
     begin_prog("calculating");
-    tipl::par_for2(num_subjects,[&](int i,int id){
+    tipl::par_for2(blocks.size(),[&](int b,int id){
         if(id == 0)
-            check_prog(i,num_subjects);
-        for(unsigned int j = i+1; j < num_subjects;++j)
+            check_prog(b,blocks.size());
+        unsigned int i_from = blocks[b].first,i_to = std::min<unsigned int>(i_from+block_size,num_subjects);
+        unsigned int j_from = blocks[b].second,j_to = std::min<unsigned int>(j_from+block_size,num_subjects);
+        std::vector<double> dot(block_size*block_size);
+        for(unsigned int from = 0;from < length;from += chunk_size)
         {
-            double result = tipl::root_mean_suqare_error(
-                        subject_vector[i].begin(),subject_vector[i].end(),
-                        subject_vector[j].begin());
-            matrix[i*num_subjects+j] = result;
-            matrix[j*num_subjects+i] = result;
+            unsigned int size = std::min<unsigned int>(chunk_size,length-from);
+            for(unsigned int i = i_from;i < i_to;++i)
+                for(unsigned int j = std::max<unsigned int>(j_from,i+1);j < j_to;++j)
+                    dot[(i-i_from)*block_size+j-j_from] +=
+                        chunk_dot(&subject_vector[i][from],&subject_vector[j][from],size);
         }
+        for(unsigned int i = i_from;i < i_to;++i)
+            for(unsigned int j = std::max<unsigned int>(j_from,i+1);j < j_to;++j)
+            {
+                double result = std::sqrt(std::max<double>(0.0,
+                        (norm2[i]+norm2[j]-2.0*dot[(i-i_from)*block_size+j-j_from])/double(length)));
+                matrix[i*num_subjects+j] = result;
+                matrix[j*num_subjects+i] = result;
+            }
     });
     check_prog(0,0);
 }
@@ -402,43 +702,67 @@ void connectometry_db::save_subject_vector(const char* output_name,
     }
     check_prog(0,0);
 }
-bool connectometry_db::save_subject_data(const char* output_name)
+void connectometry_db::write_template(gz_mat_write& matfile) const
 {
-    // store results
-    gz_mat_write matfile(output_name);
-    if(!matfile)
-    {
-        handle->error_msg = "Cannot output file";
-        return false;
-    }
     for(unsigned int index = 0;index < handle->mat_reader.size();++index)
         if(handle->mat_reader[index].get_name() != "report" &&
            handle->mat_reader[index].get_name().find("subject") != 0)
             matfile.write(handle->mat_reader[index]);
-    for(unsigned int index = 0;check_prog(index,(unsigned int)subject_qa.size());++index)
-    {
-        std::ostringstream out;
-        out << "subject" << index;
-        matfile.write(out.str().c_str(),subject_qa[index],handle->dir.num_fiber,(unsigned int)si2vi.size());
-    }
+}
+void connectometry_db::write_db_info(gz_mat_write& matfile,
+                                     const std::vector<std::string>& names,
+                                     const std::vector<float>& r2) const
+{
     std::string name_string;
-    for(unsigned int index = 0;index < num_subjects;++index)
+    for(unsigned int index = 0;index < r2.size();++index)
     {
-        name_string += subject_names[index];
+        name_string += names[index];
         name_string += "\n";
     }
     matfile.write("subject_names",name_string.c_str(),1,(unsigned int)name_string.size());
     matfile.write("index_name",index_name.c_str(),1,(unsigned int)index_name.size());
-    matfile.write("R2",&*R2.begin(),1,(unsigned int)R2.size());
+    matfile.write("R2",&*r2.begin(),1,(unsigned int)r2.size());
 
     {
         std::ostringstream out;
-        out << "A total of " << num_subjects << " diffusion MRI scans were included in the connectometry database." << subject_report.c_str();
+        out << "A total of " << r2.size() << " diffusion MRI scans were included in the connectometry database." << subject_report.c_str();
         out << " The " << index_name << " values were used in the connectometry analysis.";
         std::string report = out.str();
         matfile.write("subject_report",&*subject_report.c_str(),1,(unsigned int)subject_report.length());
         matfile.write("report",&*report.c_str(),1,(unsigned int)report.length());
     }
+}
+bool connectometry_db::save_subject_data(const char* output_name,bool out_of_core)
+{
+    // store results
+    gz_mat_write matfile(output_name);
+    if(!matfile)
+    {
+        handle->error_msg = "Cannot output file";
+        return false;
+    }
+    write_template(matfile);
+    if(out_of_core)
+    {
+        subject_file_writer subject_out((std::string(output_name)+".subjects").c_str(),num_subjects,subject_qa_length);
+        for(unsigned int index = 0;check_prog(index,(unsigned int)subject_qa.size());++index)
+            if(!subject_out.add(subject_qa[index],subject_qa_sd[index]))
+                break;
+        if(!subject_out.close())
+        {
+            handle->error_msg = "Cannot output subject data file";
+            return false;
+        }
+        matfile.write("subject_file_key",subject_out.key,1,2);
+    }
+    else
+    for(unsigned int index = 0;check_prog(index,(unsigned int)subject_qa.size());++index)
+    {
+        std::ostringstream out;
+        out << "subject" << index;
+        matfile.write(out.str().c_str(),subject_qa[index],handle->dir.num_fiber,(unsigned int)si2vi.size());
+    }
+    write_db_info(matfile,subject_names,R2);
     modified = false;
     return true;
 }
@@ -733,30 +1057,57 @@ void calculate_spm(std::shared_ptr<fib_data> handle,connectometry_result& data,s
                    float fiber_threshold,bool normalize_qa,bool& terminated)
 {
     data.initialize(handle);
-    std::vector<double> population(handle->db.subject_qa.size());
-    for(unsigned int s_index = 0;s_index < handle->db.si2vi.size() && !terminated;++s_index)
+    const connectometry_db& db = handle->db;
+    unsigned int subject_count = (unsigned int)db.subject_qa.size();
+    unsigned int si_count = (unsigned int)db.si2vi.size();
+    if(!subject_count)
+        return;
+    // Fixels are processed in tiles so that each subject array is read sequentially
+    // (necessary for memory-mapped db) and the tile of all subjects stays in cache.
+    unsigned int tile_size = std::max<unsigned int>(64,(1 << 18)/subject_count);
+    std::vector<float> tile(size_t(tile_size)*subject_count);
+    std::vector<unsigned char> fib_count(tile_size);
+    std::vector<double> population(subject_count);
+    for(unsigned int from = 0;from < si_count && !terminated;from += tile_size)
     {
-        unsigned int cur_index = handle->db.si2vi[s_index];
-        for(unsigned int fib = 0,fib_offset = 0;fib < handle->dir.num_fiber && handle->dir.fa[fib][cur_index] > fiber_threshold;
-                ++fib,fib_offset+=handle->db.si2vi.size())
+        unsigned int size = std::min<unsigned int>(tile_size,si_count-from);
+        unsigned char max_fib_count = 0;
+        for(unsigned int i = 0;i < size;++i)
         {
-            unsigned int pos = s_index + fib_offset;
-            if(normalize_qa)
-                for(unsigned int index = 0;index < population.size();++index)
-                    population[index] = handle->db.subject_qa[index][pos]*handle->db.subject_qa_sd[index];
-            else
-                for(unsigned int index = 0;index < population.size();++index)
-                    population[index] = handle->db.subject_qa[index][pos];
-
-            if(std::find(population.begin(),population.end(),0.0) != population.end())
-                continue;
-            double result = info(population,pos);
+            unsigned int cur_index = db.si2vi[from+i];
+            unsigned char fib = 0;
+            while(fib < handle->dir.num_fiber && handle->dir.fa[fib][cur_index] > fiber_threshold)
+                ++fib;
+            fib_count[i] = fib;
+            max_fib_count = std::max<unsigned char>(max_fib_count,fib);
+        }
+        for(unsigned int fib = 0,fib_offset = 0;fib < max_fib_count;++fib,fib_offset += si_count)
+        {
+            for(unsigned int index = 0;index < subject_count;++index)
+                std::copy(db.subject_qa[index]+fib_offset+from,
+                          db.subject_qa[index]+fib_offset+from+size,tile.begin()+size_t(index)*size);
+            for(unsigned int i = 0;i < size;++i)
+            {
+                if(fib_count[i] <= fib)
+                    continue;
+                unsigned int cur_index = db.si2vi[from+i];
+                unsigned int pos = from + i + fib_offset;
+                if(normalize_qa)
+                    for(unsigned int index = 0;index < subject_count;++index)
+                        population[index] = tile[size_t(index)*size+i]*db.subject_qa_sd[index];
+                else
+                    for(unsigned int index = 0;index < subject_count;++index)
+                        population[index] = tile[size_t(index)*size+i];
 
-            if(result > 0.0) // group 0 > group 1
-                data.greater[fib][cur_index] = result;
-            if(result < 0.0) // group 0 < group 1
-                data.lesser[fib][cur_index] = -result;
+                if(std::find(population.begin(),population.end(),0.0) != population.end())
+                    continue;
+                double result = info(population,pos);
 
+                if(result > 0.0) // group 0 > group 1
+                    data.greater[fib][cur_index] = result;
+                if(result < 0.0) // group 0 < group 1
+                    data.lesser[fib][cur_index] = -result;
+            }
         }
     }
 }
@@ -836,83 +1187,104 @@ bool connectometry_result::individual_vs_db(std::shared_ptr<fib_data> handle,con
     add_mapping_for_tracking(handle,"inc_db","dec_db");
     return true;
 }
+struct compare_stat{
+    double sum1 = 0.0,sum2 = 0.0,sq1 = 0.0,sq2 = 0.0,cross = 0.0;
+    float max1 = 0.0f,max2 = 0.0f;
+    void add(const compare_stat& rhs)
+    {
+        sum1 += rhs.sum1;
+        sum2 += rhs.sum2;
+        sq1 += rhs.sq1;
+        sq2 += rhs.sq2;
+        cross += rhs.cross;
+        max1 = std::max(max1,rhs.max1);
+        max2 = std::max(max2,rhs.max2);
+    }
+};
+
 bool connectometry_result::compare(std::shared_ptr<fib_data> handle,const std::vector<const float*>& fa1,
                                         const std::vector<const float*>& fa2,unsigned char normalization)
 {
-    std::ostringstream out;
-    if(normalization == 0) // no normalization
+    const unsigned int block_size = 65536;
+    unsigned int size = (unsigned int)handle->dim.size();
+    unsigned int block_count = (size+block_size-1)/block_size;
+    // all normalization statistics are gathered from the first fiber in a single pass
+    compare_stat stat;
+    if(normalization)
     {
-        for(unsigned char fib = 0;fib < handle->dir.num_fiber;++fib)
+        std::vector<compare_stat> block_stat(block_count);
+        tipl::par_for(block_count,[&](unsigned int b)
         {
-            for(unsigned int index = 0;index < handle->dim.size();++index)
-                if(fa1[fib][index] > 0.0 && fa2[fib][index] > 0.0)
-                {
-                    float f1 = fa1[fib][index];
-                    float f2 = fa2[fib][index];
-                    if(f1 > f2)
-                        lesser[fib][index] = f1-f2;  // subject decreased connectivity
-                    else
-                        greater[fib][index] = f2-f1; // subject increased connectivity
-                }
-        }
+            const float* f1 = fa1[0];
+            const float* f2 = fa2[0];
+            compare_stat& st = block_stat[b];
+            st.max1 = f1[b*block_size];
+            st.max2 = f2[b*block_size];
+            for(unsigned int index = b*block_size,end = std::min(size,index+block_size);index < end;++index)
+            {
+                float v1 = f1[index];
+                float v2 = f2[index];
+                st.sum1 += v1;
+                st.sum2 += v2;
+                st.sq1 += v1*v1;
+                st.sq2 += v2*v2;
+                st.cross += v1*v2;
+                st.max1 = std::max(st.max1,v1);
+                st.max2 = std::max(st.max2,v2);
+            }
+        });
+        stat = block_stat[0];
+        for(unsigned int b = 1;b < block_count;++b)
+            stat.add(block_stat[b]);
     }
+    // f1 = fa1*scale1, f2 = fa2*scale2+shift2
+    float scale1 = 1.0f,scale2 = 1.0f,shift2 = 0.0f;
+    std::ostringstream out;
     if(normalization == 1) // max to one
     {
         out << " Normalization was conducted to make the highest anisotropy to one.";
-        float max1 = *std::max_element(fa1[0],fa1[0] + handle->dim.size());
-        float max2 = *std::max_element(fa2[0],fa2[0] + handle->dim.size());
-
-        for(unsigned char fib = 0;fib < handle->dir.num_fiber;++fib)
-        {
-            for(unsigned int index = 0;index < handle->dim.size();++index)
-                if(fa1[fib][index] > 0.0 && fa2[fib][index] > 0.0)
-                {
-                    float f1 = fa1[fib][index]/max1;
-                    float f2 = fa2[fib][index]/max2;
-                    if(f1 > f2)
-                        lesser[fib][index] = f1-f2;  // subject decreased connectivity
-                    else
-                        greater[fib][index] = f2-f1; // subject increased connectivity
-                }
-        }
+        scale1 = 1.0f/stat.max1;
+        scale2 = 1.0f/stat.max2;
     }
     if(normalization == 2) // linear regression
     {
         out << " Normalization was conducted by a linear regression between the comparison scans.";
-        std::pair<double,double> r = tipl::linear_regression(fa2[0],fa2[0] + handle->dim.size(),fa1[0]);
-        for(unsigned char fib = 0;fib < handle->dir.num_fiber;++fib)
-        {
-            for(unsigned int index = 0;index < handle->dim.size();++index)
-                if(fa1[fib][index] > 0.0 && fa2[fib][index] > 0.0)
-                {
-                    float f1 = fa1[fib][index];
-                    float f2 = fa2[fib][index]*r.first+r.second;
-                    if(f1 > f2)
-                        lesser[fib][index] = f1-f2;  // subject decreased connectivity
-                    else
-                        greater[fib][index] = f2-f1; // subject increased connectivity
-                }
-        }
+        // regress fa1 on fa2
+        double n = size;
+        double var2 = n*stat.sq2-stat.sum2*stat.sum2;
+        double slope = var2 == 0.0 ? 0.0 : (n*stat.cross-stat.sum1*stat.sum2)/var2;
+        scale2 = slope;
+        shift2 = (stat.sum1-slope*stat.sum2)/n;
     }
     if(normalization == 3) // variance to one
     {
         out << " Normalization was conducted by scaling the variance to one.";
-        float sd1 = tipl::standard_deviation(fa1[0],fa1[0] + handle->dim.size());
-        float sd2 = tipl::standard_deviation(fa2[0],fa2[0] + handle->dim.size());
-        for(unsigned char fib = 0;fib < handle->dir.num_fiber;++fib)
+        double n = size;
+        double m1 = stat.sum1/n,m2 = stat.sum2/n;
+        scale1 = 1.0/std::sqrt(std::max<double>(0.0,stat.sq1/n-m1*m1));
+        scale2 = 1.0/std::sqrt(std::max<double>(0.0,stat.sq2/n-m2*m2));
+    }
+    // greater/lesser maps of all fibers in one branch-free pass
+    unsigned int num_fiber = handle->dir.num_fiber;
+    tipl::par_for(block_count*num_fiber,[&](unsigned int job)
+    {
+        unsigned int fib = job/block_count;
+        unsigned int from = (job%block_count)*block_size;
+        unsigned int to = std::min(size,from+block_size);
+        const float* f1 = fa1[fib];
+        const float* f2 = fa2[fib];
+        float* g = &greater[fib][0];
+        float* l = &lesser[fib][0];
+        for(unsigned int index = from;index < to;++index)
         {
-            for(unsigned int index = 0;index < handle->dim.size();++index)
-                if(fa1[fib][index] > 0.0 && fa2[fib][index] > 0.0)
-                {
-                    float f1 = fa1[fib][index]/sd1;
-                    float f2 = fa2[fib][index]/sd2;
-                    if(f1 > f2)
-                        lesser[fib][index] = f1-f2;  // subject decreased connectivity
-                    else
-                        greater[fib][index] = f2-f1; // subject increased connectivity
-                }
+            float v1 = f1[index];
+            float v2 = f2[index];
+            float dif = (v2*scale2+shift2)-v1*scale1;
+            bool valid = v1 > 0.0f && v2 > 0.0f;
+            g[index] = valid ? std::max(dif,0.0f) : g[index]; // subject increased connectivity
+            l[index] = valid ? std::max(-dif,0.0f) : l[index];// subject decreased connectivity
         }
-    }
+    });
     report += out.str();
     return true;
 }
@@ -972,6 +1344,45 @@ bool connectometry_result::individual_vs_individual(std::shared_ptr<fib_data> ha
 
 
 
+bool connectometry_result::individual_vs_individuals(std::shared_ptr<fib_data> handle,const char* file_name,
+                                                     const std::vector<std::string>& ref_file_names,
+                                                     unsigned char normalization,
+                                                     std::function<bool(unsigned int)> process_result)
+{
+    // the template and the subject data are loaded once for all references
+    handle->dir.set_tracking_index(0);
+    std::vector<std::vector<float> > data;
+    if(!handle->db.get_qa_profile(file_name,data))
+    {
+        error_msg = handle->error_msg;
+        return false;
+    }
+    std::vector<const float*> ptr(data.size());
+    for(unsigned int i = 0;i < ptr.size();++i)
+        ptr[i] = &(data[i][0]);
+    std::vector<std::vector<float> > ref_data;
+    std::vector<const float*> ref_ptr;
+    for(unsigned int index = 0;index < ref_file_names.size();++index)
+    {
+        report = " Individual connectometry was conducted by comparing individual scans (Yeh, NeuroImage: Clinical 2,912-921,2013).";
+        if(!handle->db.get_qa_profile(ref_file_names[index].c_str(),ref_data))
+        {
+            error_msg = handle->error_msg;
+            return false;
+        }
+        ref_ptr.resize(ref_data.size());
+        for(unsigned int i = 0;i < ref_ptr.size();++i)
+            ref_ptr[i] = &(ref_data[i][0]);
+        initialize(handle);
+        if(!compare(handle,ref_ptr,ptr,normalization))
+            return false;
+        add_mapping_for_tracking(handle,"inc_qa","dec_qa");
+        if(!process_result(index))
+            return false;
+    }
+    return true;
+}
+
 void stat_model::init(unsigned int subject_count)
 {
     subject_index.resize(subject_count);
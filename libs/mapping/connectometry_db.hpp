@@ -2,9 +2,13 @@
 #define CONNECTOMETRY_DB_H
 #include <vector>
 #include <string>
+#include <future>
+#include <functional>
+#include <random>
 #include "gzip_interface.hpp"
 #include "tipl/tipl.hpp"
 class fib_data;
+class QFile;
 class connectometry_db
 {
 public:
@@ -19,6 +23,8 @@ public:// subject specific data
     std::vector<float> subject_qa_sd;
 public:
     std::list<std::vector<float> > subject_qa_buf;// merged from other db
+    std::string subject_file_name;// out-of-core subject data
+    std::shared_ptr<QFile> subject_file;
     unsigned int subject_qa_length;
     tipl::image<unsigned int,3> vi2si;
     std::vector<unsigned int> si2vi;
@@ -31,13 +37,30 @@ public:
     connectometry_db():num_subjects(0),modified(false){;}
     bool has_db(void)const{return num_subjects > 0;}
     void read_db(fib_data* handle);
+    void read_db(fib_data* handle,gz_mat_read& subject_reader);
     void remove_subject(unsigned int index);
     void calculate_si2vi(void);
+    bool map_subject_file(const std::string& file_name);
     bool sample_odf(gz_mat_read& m,std::vector<float>& data);
     bool sample_index(gz_mat_read& m,std::vector<float>& data,const char* index_name);
     bool is_consistent(gz_mat_read& m);
+    bool sample_subject(gz_mat_read& m,const std::string& file_name,
+                        std::vector<float>& data,float& r2);
     bool add_subject_file(const std::string& file_name,
                             const std::string& subject_name);
+    bool create_db_from_files(const char* output_name,
+                              const std::vector<std::string>& file_names,
+                              const std::vector<std::string>& names,
+                              unsigned int thread_count,
+                              bool out_of_core = false);
+    bool write_db_from_files(gz_mat_write& matfile,
+                             const char* output_name,
+                             const std::vector<std::string>& file_names,
+                             const std::vector<std::string>& names,
+                             unsigned int thread_count,
+                             bool out_of_core);
+    void get_subject_fixel_pos(std::vector<unsigned int>& fixel_pos,
+                               const tipl::image<int,3>& cerebrum_mask,float fiber_threshold) const;
     void get_subject_vector_pos(std::vector<int>& subject_vector_pos,
                                 const tipl::image<int,3>& cerebrum_mask,float fiber_threshold) const;
     void get_subject_vector(unsigned int from,unsigned int to,
@@ -50,7 +73,11 @@ public:
                              const tipl::image<int,3>& cerebrum_mask,
                              float fiber_threshold,
                              bool normalize_fp) const;
-    bool save_subject_data(const char* output_name);
+    void write_template(gz_mat_write& matfile) const;
+    void write_db_info(gz_mat_write& matfile,
+                       const std::vector<std::string>& names,
+                       const std::vector<float>& r2) const;
+    bool save_subject_data(const char* output_name,bool out_of_core = false);
     void get_subject_slice(unsigned int subject_index,unsigned char dim,unsigned int pos,
                             tipl::image<float,2>& slice) const;
     void get_subject_fa(unsigned int subject_index,std::vector<std::vector<float> >& fa_data) const;
@@ -67,9 +94,16 @@ public:
 
 
 
+// random number generator for resampling, reset with a seed for each permutation
+struct resample_rand{
+    std::mt19937 gen;
+    void reset(unsigned int seed = 0){gen.seed(seed);}
+    int operator()(int size){return std::uniform_int_distribution<int>(0,size-1)(gen);}
+};
+
 class stat_model{
 public:
-    tipl::uniform_dist<int> rand_gen;
+    resample_rand rand_gen;
     std::mutex  lock_random;
 public:
     std::vector<unsigned int> subject_index;
@@ -141,6 +175,9 @@ public:
     bool individual_vs_db(std::shared_ptr<fib_data> handle,const char* file_name);
     bool individual_vs_individual(std::shared_ptr<fib_data> handle,
                                   const char* file_name1,const char* file_name2,unsigned char normalization);
+    bool individual_vs_individuals(std::shared_ptr<fib_data> handle,const char* file_name,
+                                   const std::vector<std::string>& ref_file_names,unsigned char normalization,
+                                   std::function<bool(unsigned int)> process_result);
 
 };
 
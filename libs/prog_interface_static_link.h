@@ -1,5 +1,6 @@
 #ifndef PROG_INTERFACE_STATIC_LINKH
 #define PROG_INTERFACE_STATIC_LINKH
+#include <cstddef>
 
 
 void begin_prog(const char* title,bool lock = false);
@@ -8,5 +9,18 @@ void set_title(const char* title);
 bool check_prog(unsigned int now,unsigned int total);
 bool prog_aborted(void);
 bool is_running(void);
+
+// stage telemetry for --profile: scoped stages nest, and begin_prog/set_title
+// open sub-stages that last until the next call at the same level
+struct prog_stage{
+    size_t depth;
+    prog_stage(const char* name);
+    ~prog_stage(void);
+};
+void prog_add_items(size_t count);
+void prog_add_bytes_read(size_t bytes);
+void prog_add_bytes_written(size_t bytes);
+void begin_profile(void);
+bool save_profile(const char* file_name);
 #endif
 
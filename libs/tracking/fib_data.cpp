@@ -1,5 +1,7 @@
 #include <QCoreApplication>
+#include <QFile>
 #include <QFileInfo>
+#include <QDateTime>
 #include "fib_data.hpp"
 #include "fa_template.hpp"
 #include "tessellated_icosahedron.hpp"
@@ -7,7 +9,7 @@
 extern std::vector<atlas> atlas_list;
 
 
-bool odf_data::read(gz_mat_read& mat_reader)
+bool odf_data::read_odfs(gz_mat_read& mat_reader)
 {
     unsigned int row,col;
     {
@@ -33,9 +35,14 @@ bool odf_data::read(gz_mat_read& mat_reader)
             }
         }
     }
-    if(!has_odfs())
-        return false;
+    return has_odfs();
+}
 
+bool odf_data::read(gz_mat_read& mat_reader)
+{
+    if(!read_odfs(mat_reader))
+        return false;
+    unsigned int row,col;
     // dimension
     tipl::geometry<3> dim;
     {
@@ -45,16 +52,23 @@ bool odf_data::read(gz_mat_read& mat_reader)
         std::copy(dim_buf,dim_buf+3,dim.begin());
     }
     // odf_vertices
+    unsigned int half_size = 0;
     {
         const float* odf_buffer;
         if (!mat_reader.read("odf_vertices",row,col,odf_buffer))
             return false;
-        half_odf_size = col / 2;
+        half_size = col / 2;
     }
     const float* fa0 = 0;
     if (!mat_reader.read("fa0",row,col,fa0))
         return false;
+    build_index(dim,half_size,fa0);
+    return true;
+}
 
+void odf_data::build_index(const tipl::geometry<3>& dim,unsigned int half_odf_size_,const float* fa0)
+{
+    half_odf_size = half_odf_size_;
     if (odfs)
     {
         voxel_index_map.resize(dim);
@@ -109,7 +123,6 @@ bool odf_data::read(gz_mat_read& mat_reader)
                 ++voxel_index;
             }
     }
-    return true;
 }
 
 
@@ -451,10 +464,80 @@ bool tracking_data::is_white_matter(const tipl::vector<3,float>& pos,float t) co
 }
 
 
-bool fib_data::load_from_file(const char* file_name)
+// MATLAB v4 record: type, rows, cols, imagf, name length, name, and data
+bool mat_record::read_header(gz_istream& in)
+{
+    unsigned int header[5];
+    if(!in.read(header,sizeof(header)) || header[0] >= 1000 || !header[4] || header[4] > 256)
+        return false;
+    type = header[0];
+    rows = header[1];
+    cols = header[2];
+    imagf = header[3];
+    name.resize(header[4]);
+    if(!in.read(&name[0],header[4]))
+        return false;
+    name.resize(std::strlen(name.c_str()));
+    return true;
+}
+size_t mat_record::data_size(void) const
+{
+    const unsigned int element_size[6] = {8,4,4,2,2,1};
+    unsigned int precision = (type/10)%10;
+    if(precision > 5 || imagf)
+        return 0;
+    return size_t(rows)*size_t(cols)*element_size[precision];
+}
+bool mat_record::read_data(gz_istream& in)
+{
+    if((type/10)%10 > 5 || imagf)
+        return false;
+    data.resize(data_size());
+    return data.empty() || in.read(&data[0],data.size());
+}
+bool mat_record::is_bulk(void) const
+{
+    // ODF blocks and subject data take most of the file but are not needed for tracking
+    auto is_numbered = [&](const std::string& prefix)
+    {
+        return name.length() > prefix.length() && name.compare(0,prefix.length(),prefix) == 0 &&
+               name.find_first_not_of("0123456789",prefix.length()) == std::string::npos;
+    };
+    return name == "odfs" || is_numbered("odf") || is_numbered("subject");
+}
+void mat_record::add_to(gz_mat_read& reader) const
+{
+    switch((type/10)%10)
+    {
+    case 0:
+        reader.add(name.c_str(),(const double*)data.data(),rows,cols);
+        break;
+    case 1:
+        reader.add(name.c_str(),(const float*)data.data(),rows,cols);
+        break;
+    case 2:
+        reader.add(name.c_str(),(const int*)data.data(),rows,cols);
+        break;
+    case 3:
+        reader.add(name.c_str(),(const short*)data.data(),rows,cols);
+        break;
+    case 4:
+        reader.add(name.c_str(),(const unsigned short*)data.data(),rows,cols);
+        break;
+    case 5:
+        if(type%10 == 1) // text
+            reader.add(name.c_str(),(const char*)data.data(),rows,cols);
+        else
+            reader.add(name.c_str(),(const unsigned char*)data.data(),rows,cols);
+        break;
+    }
+}
+
+bool fib_data::load_from_file(const char* file_name,bool staged)
 {
     tipl::image<float,3> I;
     tipl::vector<3,float> vs_;
+    fib_file_name = file_name;
     if(QFileInfo(file_name).completeSuffix() == "nii" ||
        QFileInfo(file_name).completeSuffix() == "nii.gz")
     {
@@ -536,6 +619,69 @@ bool fib_data::load_from_file(const char* file_name)
         view_item[0].name = "image";
         return true;
     }
+    db.subject_file_name = file_name;
+    db.subject_file_name += ".subjects";
+    if(staged)
+    {
+        // read the tracking data in the foreground and stop at the first ODF or subject block
+        std::shared_ptr<gz_istream> in(new gz_istream);
+        if(!in->open(file_name))
+        {
+            error_msg = "Cannot open file";
+            return false;
+        }
+        std::shared_ptr<mat_record> pending;
+        while(1)
+        {
+            std::shared_ptr<mat_record> record(new mat_record);
+            if(!record->read_header(*in))
+                break;
+            if(record->is_bulk())
+            {
+                pending = record;
+                break;
+            }
+            if(!record->read_data(*in))
+            {
+                error_msg = prog_aborted() ? "Loading process aborted" : "Invalid file format";
+                return false;
+            }
+            record->add_to(mat_reader);
+        }
+        if(prog_aborted())
+        {
+            error_msg = "Loading process aborted";
+            return false;
+        }
+        bulk_pending = pending.get();
+        if(!load_from_mat())
+            return false;
+        if(!bulk_pending)
+            return true;
+        tipl::geometry<3> odf_dim(dim);
+        unsigned int half_odf_size = dir.half_odf_size;
+        const float* fa0 = dir.fa[0];
+        // the background read ignores cancellations of unrelated progress dialogs
+        in->set_abort_flag(&bulk_terminated);
+        bulk_loading = std::async(std::launch::async,[this,in,pending,odf_dim,half_odf_size,fa0]() -> bool
+        {
+            std::shared_ptr<mat_record> record(pending);
+            do{
+                if(bulk_terminated || !record->read_data(*in))
+                    return false;
+                if(record->is_bulk())
+                    record->add_to(bulk_reader);
+                else
+                    bulk_records.push_back(record);
+                record.reset(new mat_record);
+            }while(record->read_header(*in));
+            in->close();
+            if(bulk_odf.read_odfs(bulk_reader))
+                bulk_odf.build_index(odf_dim,half_odf_size,fa0);
+            return true;
+        });
+        return true;
+    }
     if (!mat_reader.load_from_file(file_name) || prog_aborted())
     {
         error_msg = prog_aborted() ? "Loading process aborted" : "Invalid file format";
@@ -543,6 +689,18 @@ bool fib_data::load_from_file(const char* file_name)
     }
     return load_from_mat();
 }
+static bool is_view_item_name(const std::string& matrix_name)
+{
+    if(matrix_name.length() >= 2 && matrix_name[matrix_name.length()-2] == '_' &&
+       (matrix_name[matrix_name.length()-1] == 'x' ||
+        matrix_name[matrix_name.length()-1] == 'y' ||
+        matrix_name[matrix_name.length()-1] == 'z' ||
+        matrix_name[matrix_name.length()-1] == 'd'))
+        return false;
+    if(matrix_name[matrix_name.length()-1] >= '0' && matrix_name[matrix_name.length()-1] <= '9')
+        return false;
+    return true;
+}
 bool fib_data::load_from_mat(void)
 {
     {
@@ -618,15 +776,7 @@ bool fib_data::load_from_mat(void)
             continue;
         const float* buf = 0;
         mat_reader.read(index,row,col,buf);
-        if (row*col != dim.size() || !buf)
-            continue;
-        if(matrix_name.length() >= 2 && matrix_name[matrix_name.length()-2] == '_' &&
-           (matrix_name[matrix_name.length()-1] == 'x' ||
-            matrix_name[matrix_name.length()-1] == 'y' ||
-            matrix_name[matrix_name.length()-1] == 'z' ||
-            matrix_name[matrix_name.length()-1] == 'd'))
-            continue;
-        if(matrix_name[matrix_name.length()-1] >= '0' && matrix_name[matrix_name.length()-1] <= '9')
+        if (row*col != dim.size() || !buf || !is_view_item_name(matrix_name))
             continue;
         view_item.push_back(item());
         view_item.back().name = matrix_name;
@@ -698,7 +848,43 @@ bool fib_data::load_from_mat(void)
     }
 
     is_human_data = dim[0]*vs[0] > 100 && dim[1]*vs[1] > 120 && dim[2]*vs[2] > 40;
-    db.read_db(this);
+    if(!bulk_pending)
+        db.read_db(this);
+    return true;
+}
+
+bool fib_data::finish_loading(void)
+{
+    if(!bulk_loading.valid())
+        return true;
+    bulk_pending = false;
+    if(!bulk_loading.get())
+    {
+        error_msg = "Failed to load ODF and connectometry data";
+        return false;
+    }
+    // matrices found after the bulk data
+    unsigned int row,col;
+    for(unsigned int index = 0;index < bulk_records.size();++index)
+    {
+        bulk_records[index]->add_to(mat_reader);
+        const float* buf = 0;
+        const std::string& matrix_name = bulk_records[index]->name;
+        if(!mat_reader.read(matrix_name.c_str(),row,col,buf) ||
+           row*col != dim.size() || !is_view_item_name(matrix_name))
+            continue;
+        view_item.push_back(item());
+        view_item.back().name = matrix_name;
+        view_item.back().image_data = tipl::make_image(buf,dim);
+        view_item.back().set_scale(buf,buf+dim.size());
+    }
+    bulk_records.clear();
+    if(bulk_odf.has_odfs())
+    {
+        odf = bulk_odf;
+        bulk_odf = odf_data();
+    }
+    db.read_db(this,bulk_reader);
     return true;
 }
 
@@ -815,12 +1001,92 @@ void fib_data::get_index_titles(std::vector<std::string>& titles)
     }
 }
 extern fa_template fa_template_imp;
+extern std::string qa_template_1mm;
+
+// normalization depends only on the FA map, its geometry, and the template file
+std::string fib_data::get_normalization_key(void) const
+{
+    unsigned long long hash = 14695981039346656037ULL; // FNV-1a
+    auto add = [&hash](const void* data,size_t size)
+    {
+        const unsigned char* p = (const unsigned char*)data;
+        for(size_t i = 0;i < size;++i)
+            hash = (hash ^ p[i])*1099511628211ULL;
+    };
+    for(unsigned char d = 0;d < 3;++d)
+    {
+        unsigned int length = dim[d];
+        float voxel_size = vs[d];
+        add(&length,sizeof(length));
+        add(&voxel_size,sizeof(voxel_size));
+    }
+    add(dir.fa[0],sizeof(float)*dim.size());
+    QFileInfo template_info(qa_template_1mm.c_str());
+    std::ostringstream out;
+    out << std::hex << hash << std::dec << " " << qa_template_1mm << " " << template_info.size()
+        << " " << template_info.lastModified().toMSecsSinceEpoch();
+    return out.str();
+}
+bool fib_data::load_normalization_cache(void)
+{
+    std::string cache_name = fib_file_name + ".map.gz";
+    if(fib_file_name.empty() || !QFileInfo(cache_name.c_str()).exists())
+        return false;
+    gz_mat_read in;
+    if(!in.load_from_file(cache_name.c_str()))
+        return false;
+    unsigned int row,col;
+    const char* key = 0;
+    const float* mni = 0;
+    if(!in.read("key",row,col,key) || std::string(key,key+row*col) != get_normalization_key() ||
+       !in.read("mni",row,col,mni) || row*col != dim.size()*3)
+        return false;
+    tipl::image<tipl::vector<3,float>,3 > mni_(dim);
+    std::copy(mni,mni+row*col,&mni_[0][0]);
+    mni_position.swap(mni_);
+    return true;
+}
+void fib_data::save_normalization_cache(const std::string& key) const
+{
+    if(fib_file_name.empty())
+        return;
+    // write to a temporary file so that an interrupted save never leaves a partial cache.
+    // The temporary name keeps the .gz extension so that gz_ostream still compresses it.
+    QString file_name = (fib_file_name + ".map.gz").c_str();
+    QString tmp_file_name = (fib_file_name + ".map.tmp.gz").c_str();
+    bool failed = false;
+    {
+        gz_mat_write out(tmp_file_name.toStdString().c_str());
+        if(!out)
+            return;
+        out.write("key",key.c_str(),1,key.length());
+        out.write("mni",&mni_position[0][0],3,mni_position.size());
+        failed = !out;
+    }
+    if(failed)
+    {
+        QFile::remove(tmp_file_name);
+        return;
+    }
+    if(QFile::exists(file_name))
+        QFile::remove(file_name);
+    if(!QFile::rename(tmp_file_name,file_name))
+        QFile::remove(tmp_file_name);
+}
 
 void fib_data::run_normalization(bool background)
 {
     prog = 0;
+    if(load_normalization_cache())
+    {
+        if(!background)
+            std::cout << "Subject normalization loaded from " << fib_file_name << ".map.gz" << std::endl;
+        prog = 5;
+        return;
+    }
     auto lambda = [this]()
     {
+        std::string key = get_normalization_key();
         if(fa_template_imp.I.empty() && !fa_template_imp.load_from_file())
         {
             std::cout << fa_template_imp.error_msg << std::endl;
@@ -861,6 +1127,7 @@ void fib_data::run_normalization(bool background)
         if(thread.terminated)
             return;
         mni_position.swap(mni);
+        save_normalization_cache(key);
         prog = 5;
     };
 
@@ -954,6 +1221,7 @@ bool fib_data::get_profile(const std::vector<float>& tract,
     {
         std::vector<float> smoothed_track_in_mni;
         std::vector<float> tract_in_mni;
+        tract_in_mni.reserve(tract.size());
         for(int j = 0;j < tract.size();j += 3)
         {
             tipl::vector<3> v(&(tract[j]));
@@ -967,6 +1235,7 @@ bool fib_data::get_profile(const std::vector<float>& tract,
     }
 
     tipl::geometry<3> dim(60,75,3);
+    // profile_ may be a reused buffer
     profile_.resize(dim.size());
     auto profile = tipl::make_image(&profile_[0],dim);
     std::fill(profile.begin(),profile.end(),0);
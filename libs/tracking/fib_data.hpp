@@ -3,6 +3,8 @@
 #include <fstream>
 #include <sstream>
 #include <string>
+#include <future>
+#include <atomic>
 #include "prog_interface_static_link.h"
 #include "tipl/tipl.hpp"
 #include "gzip_interface.hpp"
@@ -23,6 +25,8 @@ private:
 public:
     odf_data(void):odfs(0){}
     bool read(gz_mat_read& mat_reader);
+    bool read_odfs(gz_mat_read& mat_reader);
+    void build_index(const tipl::geometry<3>& dim,unsigned int half_odf_size_,const float* fa0);
     bool has_odfs(void) const
     {
         return odfs != 0 || !odf_blocks.empty();
@@ -137,12 +141,38 @@ struct item
     }
 };
 
+// a matrix read from a MATLAB v4 stream that has not been added to a reader
+struct mat_record{
+    unsigned int type = 0,rows = 0,cols = 0,imagf = 0;
+    std::string name;
+    std::vector<char> data;
+    bool read_header(gz_istream& in);
+    size_t data_size(void) const;
+    bool read_data(gz_istream& in);
+    bool is_bulk(void) const;
+    void add_to(gz_mat_read& reader) const;
+};
+
 class fib_data
 {
 public:
     mutable std::string error_msg;
-    std::string report;
+    std::string report,fib_file_name;
     gz_mat_read mat_reader;
+public:// staged loading: ODFs and connectometry data are read in the background
+    gz_mat_read bulk_reader;
+    std::vector<std::shared_ptr<mat_record> > bulk_records;
+    odf_data bulk_odf;
+    std::future<bool> bulk_loading;
+    bool bulk_pending = false;
+    std::atomic<bool> bulk_terminated{false};
+    bool is_loading(void) const{return bulk_loading.valid();}
+    bool bulk_ready(void) const
+    {
+        return bulk_loading.valid() &&
+               bulk_loading.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+    }
+    bool finish_loading(void);
 public:
     tipl::geometry<3> dim;
     tipl::vector<3> vs;
@@ -161,11 +191,14 @@ public:
     tipl::image<tipl::vector<3,float>,3 > native_position;
 public:
     void run_normalization(bool background);
+    std::string get_normalization_key(void) const;
+    bool load_normalization_cache(void);
+    void save_normalization_cache(const std::string& key) const;
     void subject2mni(tipl::vector<3>& pos);
     void subject2mni(tipl::pixel_index<3>& index,tipl::vector<3>& pos);
     void get_atlas_roi(atlas& at,int roi_index,std::vector<tipl::vector<3,short> >& points,float& r);
     const tipl::image<tipl::vector<3,float>,3 >& get_mni_mapping(void);
-    bool has_reg(void)const{return thread.has_started();}
+    bool has_reg(void)const{return thread.has_started() || !mni_position.empty();}
     bool get_profile(const std::vector<float>& tract_data,
                      std::vector<float>& profile);
 
@@ -175,8 +208,14 @@ public:
         vs[0] = vs[1] = vs[2] = 1.0;
     }
     fib_data(tipl::geometry<3> dim_,tipl::vector<3> vs_):dim(dim_),vs(vs_){}
+    ~fib_data(void)
+    {
+        bulk_terminated = true;
+        if(bulk_loading.valid())
+            bulk_loading.wait();
+    }
 public:
-    bool load_from_file(const char* file_name);
+    bool load_from_file(const char* file_name,bool staged = false);
     bool load_from_mat(void);
 public:
     bool has_odfs(void) const{return odf.has_odfs();}
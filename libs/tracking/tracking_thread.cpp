@@ -135,6 +135,7 @@ void ThreadData::run_thread(TrackingMethod* method_ptr,
     {
 
     }
+    prog_add_items(seed_count[thread_id]);
     running[thread_id] = 0;
 }
 
@@ -1,4 +1,3 @@
-#include <set>
 #include "tract_cluster.hpp"
 #include "tipl/tipl.hpp"
 
@@ -14,7 +13,7 @@ struct compare_cluster
 
 void BasicCluster::sort_cluster(void)
 {
-    std::sort(clusters.begin(),clusters.end(),compare_cluster());
+    std::stable_sort(clusters.begin(),clusters.end(),compare_cluster());
 
     for (unsigned int index = 0;index < clusters.size();++index)
         clusters[index]->index = index;
@@ -31,17 +30,6 @@ TractCluster::TractCluster(const float* param):error_distance(param[3])
     dim[2] = fdim[2];
     w = dim[0];
     wh = dim[0]*dim[1];
-    voxel_connection.resize(dim.size());
-
-}
-
-void TractCluster::set_tract_labels(Cluster* from,Cluster* to)
-{
-    std::vector<unsigned int>::const_iterator iter = from->tracts.begin();
-    std::vector<unsigned int>::const_iterator end = from->tracts.end();
-    for (;iter != end;++iter)
-        tract_labels[*iter] = to;
-
 }
 
 int TractCluster::get_index(short x,short y,short z)
@@ -53,71 +41,34 @@ int TractCluster::get_index(short x,short y,short z)
     index += x;
     return index;
 }
-/**
-prerequite:
-    tract_index1 > tract_index2
-*/
+unsigned int TractCluster::find_root(unsigned int tract_index)
+{
+    unsigned int parent;
+    while((parent = tract_parent[tract_index]) != tract_index)
+        tract_index = parent;
+    return tract_index;
+}
+// link the larger root to the smaller one, retried if another thread links it first
 void TractCluster::merge_tract(unsigned int tract_index1,unsigned int tract_index2)
 {
-    if (tract_index1 == tract_index2)
-        return;
-    std::lock_guard<std::mutex> lock(lock_merge);
-    Cluster* cluster_index = tract_labels[tract_index1];
-    if (cluster_index == 0) // no cluster
+    while(true)
     {
-        cluster_index = tract_labels[tract_index2];
-        if (cluster_index == 0) // create a cluster for both
-        {
-            std::shared_ptr<Cluster> new_cluster_index(new Cluster);
-            new_cluster_index->index = clusters.size();
-            clusters.push_back(new_cluster_index);
-
-            new_cluster_index->tracts.push_back(tract_index2);
-            tract_labels[tract_index2] = new_cluster_index.get();
-            new_cluster_index->tracts.push_back(tract_index1);
-            tract_labels[tract_index1] = new_cluster_index.get();
+        tract_index1 = find_root(tract_index1);
+        tract_index2 = find_root(tract_index2);
+        if (tract_index1 == tract_index2)
             return;
-        }
-        else
-        {
-            cluster_index->tracts.push_back(tract_index1);
-            tract_labels[tract_index1] = cluster_index;
+        if (tract_index1 < tract_index2)
+            std::swap(tract_index1,tract_index2);
+        unsigned int expected = tract_index1;
+        if(tract_parent[tract_index1].compare_exchange_strong(expected,tract_index2))
             return;
-        }
-    }
-    else
-    {
-        Cluster* another_cluster_index = tract_labels[tract_index2];
-        if (another_cluster_index == 0) // add tract2 to the cluster
-        {
-            cluster_index->tracts.push_back(tract_index2);
-            tract_labels[tract_index2] = cluster_index;
-            return;
-        }
-        if (another_cluster_index == cluster_index) // already in the same group
-            return;
-        // merge two clusters
-        if (another_cluster_index->tracts.size() > cluster_index->tracts.size())
-            std::swap(cluster_index,another_cluster_index);
-
-        cluster_index->tracts.resize(another_cluster_index->tracts.size()+cluster_index->tracts.size());
-        std::copy(another_cluster_index->tracts.begin(),another_cluster_index->tracts.end(),
-                  cluster_index->tracts.end()-another_cluster_index->tracts.size());
-
-        set_tract_labels(another_cluster_index,cluster_index);
-        clusters.back()->index = another_cluster_index->index;
-        clusters[another_cluster_index->index] = clusters.back();
-        clusters.pop_back();
-
     }
 }
 
 void TractCluster::add_tracts(const std::vector<std::vector<float> >& tracks)
 {
-    tract_labels.clear();
     tract_passed_voxels.clear();
     tract_ranged_voxels.clear();
-    tract_labels.resize(tracks.size());
     tract_length.resize(tracks.size());
     tract_passed_voxels.resize(tracks.size());
     tract_ranged_voxels.resize(tracks.size());
@@ -152,21 +103,37 @@ void TractCluster::add_tracts(const std::vector<std::vector<float> >& tracks)
         }
 
         // delete repeated points
-        {
-            std::set<unsigned short> unique_passed_points(passed_points.begin(),passed_points.end());
-            passed_points = std::vector<unsigned short>(unique_passed_points.begin(),unique_passed_points.end());
-
-            std::set<unsigned short> unique_ranged_points(ranged_points.begin(),ranged_points.end());
-            ranged_points = std::vector<unsigned short>(unique_ranged_points.begin(),unique_ranged_points.end());
-        }
+        std::sort(passed_points.begin(),passed_points.end());
+        passed_points.erase(std::unique(passed_points.begin(),passed_points.end()),passed_points.end());
+        std::sort(ranged_points.begin(),ranged_points.end());
+        ranged_points.erase(std::unique(ranged_points.begin(),ranged_points.end()),ranged_points.end());
     });
     // book keeping passing points
+    voxel_tract_offset.clear();
+    voxel_tract_offset.resize(0x10000+1);
     for(unsigned int tract_index = 0;tract_index < tracks.size();++tract_index)
+        if(!tract_passed_voxels[tract_index].empty())
+        {
+            ++voxel_tract_offset[tract_passed_voxels[tract_index].front()+1];
+            ++voxel_tract_offset[tract_passed_voxels[tract_index].back()+1];
+        }
+    for(unsigned int index = 1;index < voxel_tract_offset.size();++index)
+        voxel_tract_offset[index] += voxel_tract_offset[index-1];
+    voxel_tracts.resize(voxel_tract_offset.back());
     {
-        voxel_connection[tract_passed_voxels[tract_index].front()].push_back(tract_index);
-        voxel_connection[tract_passed_voxels[tract_index].back()].push_back(tract_index);
+        std::vector<unsigned int> pos(voxel_tract_offset.begin(),voxel_tract_offset.end()-1);
+        for(unsigned int tract_index = 0;tract_index < tracks.size();++tract_index)
+            if(!tract_passed_voxels[tract_index].empty())
+            {
+                voxel_tracts[pos[tract_passed_voxels[tract_index].front()]++] = tract_index;
+                voxel_tracts[pos[tract_passed_voxels[tract_index].back()]++] = tract_index;
+            }
     }
 
+    tract_parent = std::vector<std::atomic<unsigned int> >(tracks.size());
+    for(unsigned int tract_index = 0;tract_index < tracks.size();++tract_index)
+        tract_parent[tract_index] = tract_index;
+
     tipl::par_for(tracks.size(),[&](unsigned int tract_index)
     {
         if(tracks[tract_index].empty())
@@ -177,24 +144,21 @@ void TractCluster::add_tracts(const std::vector<std::vector<float> >& tracks)
         if(passed_points.empty() || ranged_points.empty())
             return;
 
-        // get the eligible fibers for merging, and also register the ending points
+        // get the eligible fibers for merging. The criteria are symmetric,
+        // so each pair is checked once by the tract with the larger index
         std::vector<unsigned int> passing_tracts;
-        {
-            std::vector<unsigned int> p1(voxel_connection[tract_passed_voxels[tract_index].front()]);
-            std::vector<unsigned int> p2(voxel_connection[tract_passed_voxels[tract_index].back()]);
-            p1.insert(p1.end(),p2.begin(),p2.end());
-            p1.erase(std::remove(p1.begin(),p1.end(),tract_index),p1.end());
-            std::set<unsigned int> unique_tracts(p1.begin(),p1.end());
-            passing_tracts = std::vector<unsigned int>(unique_tracts.begin(),unique_tracts.end());
-        }
+        for(unsigned short voxel : {passed_points.front(),passed_points.back()})
+            for(unsigned int i = voxel_tract_offset[voxel];i < voxel_tract_offset[voxel+1];++i)
+                if(voxel_tracts[i] < tract_index)
+                    passing_tracts.push_back(voxel_tracts[i]);
+        std::sort(passing_tracts.begin(),passing_tracts.end());
+        passing_tracts.erase(std::unique(passing_tracts.begin(),passing_tracts.end()),passing_tracts.end());
 
         // check each tract to see if anyone is included in the error range
         for (int i = 0;i < passing_tracts.size();++i)
         {
             unsigned int cur_index = passing_tracts[i];
-            Cluster* label1 = tract_labels[tract_index];
-            Cluster* label2 = tract_labels[cur_index];
-            if (label1 != 0 && label1 == label2)
+            if (find_root(tract_index) == find_root(cur_index))
                 continue;
             unsigned int cur_count = tract_length[cur_index];
             float dif = cur_count;
@@ -209,4 +173,23 @@ void TractCluster::add_tracts(const std::vector<std::vector<float> >& tracks)
                 merge_tract(tract_index,cur_index);
         }
     });
+
+    // clusters are connected tracts, listed by their smallest tract index
+    clusters.clear();
+    std::vector<unsigned int> root_cluster(tracks.size(),0);
+    for(unsigned int tract_index = 0;tract_index < tracks.size();++tract_index)
+    {
+        unsigned int root = find_root(tract_index);
+        if(root == tract_index)
+            continue;
+        if(!root_cluster[root])
+        {
+            std::shared_ptr<Cluster> new_cluster(new Cluster);
+            new_cluster->index = clusters.size();
+            new_cluster->tracts.push_back(root);
+            clusters.push_back(new_cluster);
+            root_cluster[root] = clusters.size();
+        }
+        clusters[root_cluster[root]-1]->tracts.push_back(tract_index);
+    }
 }
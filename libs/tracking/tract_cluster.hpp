@@ -3,6 +3,7 @@
 #include <vector>
 #include "tipl/tipl.hpp"
 #include <map>
+#include <atomic>
 
 struct Cluster
 {
@@ -89,17 +90,16 @@ class TractCluster : public BasicCluster
     tipl::geometry<3> dim;
     unsigned int w,wh;
     float error_distance;
-    std::mutex  lock_merge;
 private:
-
-
-    void set_tract_labels(Cluster* from,Cluster* to);
+    // union-find over tracts: a root is the smallest tract index of its cluster
+    std::vector<std::atomic<unsigned int> > tract_parent;
+    unsigned int find_root(unsigned int tract_index);
     void merge_tract(unsigned int tract_index1,unsigned int tract_index2);
     int get_index(short x,short y,short z);
 private:
-    std::vector<std::vector<unsigned int> > voxel_connection;
+    // tracts whose end points are at each voxel, stored as offsets into voxel_tracts
+    std::vector<unsigned int> voxel_tract_offset,voxel_tracts;
 private:
-    std::vector<Cluster*> tract_labels;// 0 is no cluster
     std::vector<std::vector<unsigned short> > tract_passed_voxels;
     std::vector<std::vector<unsigned short> > tract_ranged_voxels;
     std::vector<unsigned int>							 tract_length;
@@ -1,10 +1,13 @@
 //---------------------------------------------------------------------------
 #include <QString>
+#include <QFile>
 #include <fstream>
 #include <sstream>
 #include <iterator>
 #include <set>
 #include <map>
+#include <thread>
+#include <cstring>
 #include "roi.hpp"
 #include "tract_model.hpp"
 #include "prog_interface_static_link.h"
@@ -90,6 +93,76 @@ void resample_tracks(const std::vector<float>& track,std::vector<float>& new_tra
 }
 
 
+// evenly spaced max_count of total tracks, or all of them if max_count is 0
+static void get_tract_subset(size_t total,size_t max_count,std::vector<size_t>& index)
+{
+    if(!max_count || max_count > total)
+        max_count = total;
+    index.resize(max_count);
+    for(size_t i = 0;i < max_count;++i)
+        index[i] = i*total/max_count;
+}
+
+// tck files are memory-mapped and indexed in one pass. Tracks end at a NaN point
+// and the file ends at an Inf point.
+static bool load_tck(const char* file_name,float voxel_size,
+                     std::vector<std::vector<float> >& loaded_tract_data,size_t max_count)
+{
+    QFile file(file_name);
+    if(!file.open(QIODevice::ReadOnly))
+        return false;
+    size_t size = file.size();
+    const uchar* buf = file.map(0,file.size());
+    if(!buf)
+        return false;
+    size_t offset = 0;
+    for(size_t pos = 0;pos < size;)
+    {
+        const uchar* eol = (const uchar*)std::memchr(buf+pos,'\n',size-pos);
+        std::string line(buf+pos,eol ? eol : buf+size);
+        if(line.size() > 4 && line.substr(0,7) == std::string("file: ."))
+        {
+            std::istringstream str(line);
+            std::string s1,s2;
+            str >> s1 >> s2 >> offset;
+            break;
+        }
+        if(line == "END" || !eol)
+            return false;
+        pos = eol-buf+1;
+    }
+    if(!offset || offset >= size)
+        return false;
+    size_t point_count = (size-offset)/(sizeof(float)*3);
+    auto get_point = [&](size_t index,float* p){std::memcpy(p,buf+offset+index*sizeof(float)*3,sizeof(float)*3);};
+    std::vector<std::pair<size_t,size_t> > range;
+    for(size_t index = 0,begin = 0;index < point_count;++index)
+    {
+        float p[3];
+        get_point(index,p);
+        if(std::isinf(p[0]))
+            break;
+        if(std::isnan(p[0]))
+        {
+            if(index > begin)
+                range.push_back(std::make_pair(begin,index));
+            begin = index+1;
+        }
+    }
+    std::vector<size_t> subset;
+    get_tract_subset(range.size(),max_count,subset);
+    loaded_tract_data.resize(subset.size());
+    tipl::par_for(subset.size(),[&](unsigned int i)
+    {
+        const std::pair<size_t,size_t>& r = range[subset[i]];
+        std::vector<float>& tract = loaded_tract_data[i];
+        tract.resize((r.second-r.first)*3);
+        std::memcpy(tract.data(),buf+offset+r.first*sizeof(float)*3,tract.size()*sizeof(float));
+        tipl::divide_constant(tract.begin(),tract.end(),voxel_size);
+    });
+    return true;
+}
+
 struct TrackVis
 {
     char id_string[6];//ID string for track file. The first 5 characters must be "TRACK".
@@ -149,6 +222,27 @@ struct TrackVis
         version = 2;
         hdr_size = 1000;
     }
+    // returns the track properties after the points
+    const float* convert(const float* from,unsigned int n_point,const tipl::vector<3>& vs,float* to) const
+    {
+        unsigned int index_shift = 3 + n_scalars;
+        for (unsigned int i = 0;i < n_point;++i,from += index_shift,to += 3)
+        {
+            float x = from[0]/vs[0];
+            float y = from[1]/vs[1];
+            float z = from[2]/vs[2];
+            if(voxel_order[1] == 'R')
+                to[0] = dim[0]-x-1;
+            else
+                to[0] = x;
+            if(voxel_order[1] == 'A')
+                to[1] = dim[1]-y-1;
+            else
+                to[1] = y;
+            to[2] = z;
+        }
+        return from;
+    }
     static bool load_from_file(const char* file_name_,
                 std::vector<std::vector<float> >& loaded_tract_data,
                 std::vector<unsigned int>& loaded_tract_cluster,
@@ -172,28 +266,61 @@ struct TrackVis
             in.read((char*)&*tract.begin(),sizeof(float)*tract.size());
 
             loaded_tract_data.push_back(std::move(std::vector<float>(n_point*3)));
-            const float *from = &*tract.begin();
-            float *to = &*loaded_tract_data.back().begin();
-            for (unsigned int i = 0;i < n_point;++i,from += index_shift,to += 3)
-            {
-                float x = from[0]/vs[0];
-                float y = from[1]/vs[1];
-                float z = from[2]/vs[2];
-                if(trk.voxel_order[1] == 'R')
-                    to[0] = trk.dim[0]-x-1;
-                else
-                    to[0] = x;
-                if(trk.voxel_order[1] == 'A')
-                    to[1] = trk.dim[1]-y-1;
-                else
-                    to[1] = y;
-                to[2] = z;
-            }
+            const float *from = trk.convert(&*tract.begin(),n_point,vs,&*loaded_tract_data.back().begin());
             if(trk.n_properties == 1)
                 loaded_tract_cluster.push_back(from[0]);
         }
         return true;
     }
+    // uncompressed trk files are memory-mapped: one pass indexes the tracks,
+    // and only the selected tracks are converted on worker threads
+    static bool load_from_mapped_file(const char* file_name_,
+                std::vector<std::vector<float> >& loaded_tract_data,
+                std::vector<unsigned int>& loaded_tract_cluster,
+                               tipl::vector<3> vs,size_t max_count)
+    {
+        QFile file(file_name_);
+        if(!file.open(QIODevice::ReadOnly) || file.size() < 1000)
+            return false;
+        size_t size = file.size();
+        const uchar* buf = file.map(0,file.size());
+        if(!buf)
+            return false;
+        TrackVis trk;
+        std::memcpy(&trk,buf,1000);
+        size_t index_shift = 3 + trk.n_scalars;
+        std::vector<size_t> offsets;
+        for(size_t pos = 1000;pos + sizeof(int) <= size;)
+        {
+            if(trk.n_count > 0 && offsets.size() == size_t(trk.n_count))
+                break;
+            unsigned int n_point;
+            std::memcpy(&n_point,buf+pos,sizeof(int));
+            size_t next = pos + sizeof(int) + sizeof(float)*(index_shift*n_point + trk.n_properties);
+            if(next > size)
+                break;
+            offsets.push_back(pos);
+            pos = next;
+        }
+        std::vector<size_t> subset;
+        get_tract_subset(offsets.size(),max_count,subset);
+        loaded_tract_data.resize(subset.size());
+        if(trk.n_properties == 1)
+            loaded_tract_cluster.resize(subset.size());
+        tipl::par_for(subset.size(),[&](unsigned int i)
+        {
+            const uchar* ptr = buf + offsets[subset[i]];
+            unsigned int n_point;
+            std::memcpy(&n_point,ptr,sizeof(int));
+            // records are 4-byte aligned in the mapped file
+            std::vector<float>& tract = loaded_tract_data[i];
+            tract.resize(n_point*3);
+            const float* from = trk.convert((const float*)(ptr+sizeof(int)),n_point,vs,tract.data());
+            if(trk.n_properties == 1)
+                loaded_tract_cluster[i] = from[0];
+        });
+        return true;
+    }
     static bool save_to_file(const char* file_name,
                              tipl::geometry<3> geo,
                              tipl::vector<3> vs,
@@ -210,29 +337,41 @@ struct TrackVis
             trk.n_scalars = 1;
         out.write((const char*)&trk,1000);
 
+        // tracks are converted block by block on worker threads
+        const size_t block_size = 4096;
+        std::vector<std::vector<float> > block_buffer(block_size);
         begin_prog("saving");
-        for (unsigned int i = 0;check_prog(i,tract_data.size());++i)
+        for (size_t from = 0;check_prog(from,tract_data.size());from += block_size)
         {
-            int n_point = tract_data[i].size()/3;
-            std::vector<float> buffer(trk.n_scalars ? tract_data[i].size()+scalar[i].size() : tract_data[i].size());
-            float* to = &*buffer.begin();
-            for (unsigned int flag = 0,j = 0,k = 0;j < tract_data[i].size();++j,++to)
+            size_t end = std::min<size_t>(tract_data.size(),from+block_size);
+            tipl::par_for(end-from,[&](unsigned int b)
             {
-                *to = tract_data[i][j]*vs[flag];
-                ++flag;
-                if (flag == 3)
+                size_t i = from + b;
+                std::vector<float>& buffer = block_buffer[b];
+                buffer.resize(trk.n_scalars ? tract_data[i].size()+scalar[i].size() : tract_data[i].size());
+                float* to = &*buffer.begin();
+                for (unsigned int flag = 0,j = 0,k = 0;j < tract_data[i].size();++j,++to)
                 {
-                    flag = 0;
-                    if(trk.n_scalars)
+                    *to = tract_data[i][j]*vs[flag];
+                    ++flag;
+                    if (flag == 3)
                     {
-                        ++to;
-                        *to = scalar[i][k];
-                        ++k;
+                        flag = 0;
+                        if(trk.n_scalars)
+                        {
+                            ++to;
+                            *to = scalar[i][k];
+                            ++k;
+                        }
                     }
                 }
+            });
+            for(size_t i = from;i < end;++i)
+            {
+                int n_point = tract_data[i].size()/3;
+                out.write((const char*)&n_point,sizeof(int));
+                out.write((const char*)&*block_buffer[i-from].begin(),sizeof(float)*block_buffer[i-from].size());
             }
-            out.write((const char*)&n_point,sizeof(int));
-            out.write((const char*)&*buffer.begin(),sizeof(float)*buffer.size());
         }
         return true;
     }
@@ -267,7 +406,7 @@ void TractModel::add(const TractModel& rhs)
     is_cut.insert(is_cut.end(),rhs.is_cut.begin(),rhs.is_cut.end());
 }
 //---------------------------------------------------------------------------
-bool TractModel::load_from_file(const char* file_name_,bool append)
+bool TractModel::load_from_file(const char* file_name_,bool append,size_t max_count)
 {
     std::string file_name(file_name_);
     std::vector<std::vector<float> > loaded_tract_data;
@@ -277,7 +416,13 @@ bool TractModel::load_from_file(const char* file_name_,bool append)
     if(file_name.length() > 4)
         ext = std::string(file_name.end()-4,file_name.end());
 
-    if(ext == std::string(".trk") || ext == std::string("k.gz"))
+    if(ext == std::string(".trk"))
+        {
+            if(!TrackVis::load_from_mapped_file(file_name_,loaded_tract_data,loaded_tract_cluster,vs,max_count))
+                return false;
+        }
+        else
+        if(ext == std::string("k.gz"))
         {
             if(!TrackVis::load_from_file(file_name_,loaded_tract_data,loaded_tract_cluster,vs))
                 return false;
@@ -335,49 +480,26 @@ bool TractModel::load_from_file(const char* file_name_,bool append)
     else
                 if (ext == std::string(".tck"))
                 {
-                    unsigned int offset = 0;
-                    {
-                        std::ifstream in(file_name.c_str());
-                        if(!in)
-                            return false;
-                        std::string line;
-                        while(std::getline(in,line))
-                        {
-                            if(line.size() > 4 &&
-                                    line.substr(0,7) == std::string("file: ."))
-                            {
-                                std::istringstream str(line);
-                                std::string s1,s2;
-                                str >> s1 >> s2 >> offset;
-                                break;
-                            }
-                        }
-                        if(!in)
-                            return false;
-                    }
-                    std::ifstream in(file_name.c_str(),std::ios::binary);
-                    if(!in)
+                    if(!load_tck(file_name_,handle->vs[0],loaded_tract_data,max_count))
                         return false;
-                    in.seekg(0,std::ios::end);
-                    unsigned int total_size = in.tellg();
-                    in.seekg(offset,std::ios::beg);
-                    std::vector<unsigned int> buf((total_size-offset)/4);
-                    in.read((char*)&*buf.begin(),total_size-offset-16);// 16 skip the final inf
-                    for(unsigned int index = 0;index < buf.size();)
-                    {
-                        unsigned int end = std::find(buf.begin()+index,buf.end(),2143289344)-buf.begin(); // NaN
-                        loaded_tract_data.push_back(std::move(std::vector<float>(end-index)));
-                        std::copy((const float*)&*buf.begin() + index,
-                                  (const float*)&*buf.begin() + end,
-                                  loaded_tract_data.back().begin());
-                        tipl::divide_constant(loaded_tract_data.back().begin(),loaded_tract_data.back().end(),handle->vs[0]);
-                        index = end+3;
-                    }
-
                 }
 
     if (loaded_tract_data.empty())
         return false;
+    if(max_count && loaded_tract_data.size() > max_count)
+    {
+        std::vector<size_t> subset;
+        get_tract_subset(loaded_tract_data.size(),max_count,subset);
+        for(size_t i = 0;i < subset.size();++i)
+        {
+            loaded_tract_data[i].swap(loaded_tract_data[subset[i]]);
+            if(loaded_tract_cluster.size() > subset[i])
+                loaded_tract_cluster[i] = loaded_tract_cluster[subset[i]];
+        }
+        loaded_tract_data.resize(subset.size());
+        if(loaded_tract_cluster.size() > subset.size())
+            loaded_tract_cluster.resize(subset.size());
+    }
     if (append)
     {
         add_tracts(loaded_tract_data);
@@ -1063,48 +1185,94 @@ void TractModel::select_tracts(const std::vector<unsigned int>& tracts_to_select
 void TractModel::delete_repeated(double d)
 {
     auto norm1 = [](const float* v1,const float* v2){return std::fabs(v1[0]-v2[0])+std::fabs(v1[1]-v2[1])+std::fabs(v1[2]-v2[2]);};
-    std::vector<bool> repeated(tract_data.size());
-    tipl::par_for(tract_data.size(),[&](int i)
+    auto is_repeated = [&](unsigned int i,unsigned int j)
     {
-        if(!repeated[i])
+        for(int m = 0;m < tract_data[i].size();m += 3)
         {
-        for(int j = i+1;j < tract_data.size();++j)
-            if(!repeated[j])
-            {
-                // check endpoints
-                if(norm1(&tract_data[i][0],&tract_data[j][0]) > d ||
-                   norm1(&tract_data[i][tract_data[i].size()-3],&tract_data[j][tract_data[j].size()-3]) > d)
-                    continue;
-
-                bool not_repeated = false;
-                for(int m = 0;m < tract_data[i].size();m += 3)
-                {
-                    float min_dis = norm1(&tract_data[i][m],&tract_data[j][0]);
-                    for(int n = 3;n < tract_data[j].size();n += 3)
-                        min_dis = std::min<float>(min_dis,norm1(&tract_data[i][m],&tract_data[j][n]));
-                    if(min_dis > d)
+            float min_dis = norm1(&tract_data[i][m],&tract_data[j][0]);
+            for(int n = 3;n < tract_data[j].size();n += 3)
+                min_dis = std::min<float>(min_dis,norm1(&tract_data[i][m],&tract_data[j][n]));
+            if(min_dis > d)
+                return false;
+        }
+        for(int m = 0;m < tract_data[j].size();m += 3)
+        {
+            float min_dis = norm1(&tract_data[j][m],&tract_data[i][0]);
+            for(int n = 3;n < tract_data[i].size();n += 3)
+                min_dis = std::min<float>(min_dis,norm1(&tract_data[j][m],&tract_data[i][n]));
+            if(min_dis > d)
+                return false;
+        }
+        return true;
+    };
+    // repeated tracts have both end points within d, so tracts are hashed by the grid cell
+    // of their first point and only those in the neighboring cells are compared
+    float cell_size = d > 0.0 ? d*1.01f : 1.0f;
+    auto cell_key = [&](const float* p,int dx,int dy,int dz)
+    {
+        return (uint64_t(std::floor(p[0]/cell_size)+dx+(1 << 20)) << 42) |
+               (uint64_t(std::floor(p[1]/cell_size)+dy+(1 << 20)) << 21) |
+                uint64_t(std::floor(p[2]/cell_size)+dz+(1 << 20));
+    };
+    std::vector<std::pair<uint64_t,unsigned int> > grid(tract_data.size());
+    tipl::par_for(tract_data.size(),[&](unsigned int i)
+    {
+        grid[i] = std::make_pair(cell_key(&tract_data[i][0],0,0,0),i);
+    });
+    std::sort(grid.begin(),grid.end());
+
+    // a tract is repeated if it matches an earlier tract that is not repeated,
+    // as if the tracts were checked one by one in their order.
+    // tracts are checked in blocks: matches to earlier blocks are resolved in parallel,
+    // and matches within a block are resolved in order afterward
+    std::vector<char> repeated(tract_data.size());
+    const unsigned int block_size = 4096;
+    for(unsigned int from = 0;from < tract_data.size();from += block_size)
+    {
+        unsigned int to = std::min<unsigned int>(tract_data.size(),from+block_size);
+        std::vector<std::vector<unsigned int> > block_match(to-from);
+        tipl::par_for(to-from,[&](unsigned int k)
+        {
+            unsigned int j = from+k;
+            const float* beg = &tract_data[j][0];
+            const float* end = &tract_data[j][tract_data[j].size()-3];
+            std::vector<unsigned int> candidates;
+            for(int dx = -1;dx <= 1;++dx)
+                for(int dy = -1;dy <= 1;++dy)
+                    for(int dz = -1;dz <= 1;++dz)
                     {
-                        not_repeated = true;
-                        break;
+                        uint64_t key = cell_key(beg,dx,dy,dz);
+                        for(auto iter = std::lower_bound(grid.begin(),grid.end(),std::make_pair(key,0u));
+                            iter != grid.end() && iter->first == key && iter->second < j;++iter)
+                        {
+                            unsigned int i = iter->second;
+                            // check endpoints
+                            if(norm1(&tract_data[i][0],beg) > d ||
+                               norm1(&tract_data[i][tract_data[i].size()-3],end) > d)
+                                continue;
+                            candidates.push_back(i);
+                        }
                     }
-                }
-                if(!not_repeated)
-                for(int m = 0;m < tract_data[j].size();m += 3)
+            std::sort(candidates.begin(),candidates.end());
+            for(unsigned int i : candidates)
+            {
+                if(i < from && repeated[i])
+                    continue;
+                if(!is_repeated(i,j))
+                    continue;
+                block_match[k].push_back(i);
+                if(i < from)
+                    break;
+            }
+        });
+        for(unsigned int k = 0;k < block_match.size();++k)
+            for(unsigned int i : block_match[k])
+                if(!repeated[i])
                 {
-                    float min_dis = norm1(&tract_data[j][m],&tract_data[i][0]);
-                    for(int n = 3;n < tract_data[i].size();n += 3)
-                        min_dis = std::min<float>(min_dis,norm1(&tract_data[j][m],&tract_data[i][n]));
-                    if(min_dis > d)
-                    {
-                        not_repeated = true;
-                        break;
-                    }
+                    repeated[from+k] = 1;
+                    break;
                 }
-                if(!not_repeated)
-                    repeated[j] = true;
-            }
-        }
-    });
+    }
     std::vector<unsigned int> track_to_delete;
     for(unsigned int i = 0;i < tract_data.size();++i)
         if(repeated[i])
@@ -1533,14 +1701,61 @@ void TractModel::add_tracts(std::vector<std::vector<float> >& new_tract, unsigne
     }
 }
 //---------------------------------------------------------------------------
-void TractModel::get_density_map(tipl::image<unsigned int,3>& mapping,
+struct tdi_color_entry{
+    unsigned int index;
+    float r,g,b;
+};
+inline unsigned int tdi_entry_index(unsigned int index){return index;}
+inline unsigned int tdi_entry_index(const tdi_color_entry& entry){return entry.index;}
+// Tracts are processed in chunks. Each worker collects the voxel entries of a contiguous
+// block of tracts, binned by z-slab, and then each slab is accumulated by one worker.
+// Entries of a voxel are always added in tract order, so the result does not depend on
+// the thread count. With show_prog, the progress dialog can cancel the loop, and false is
+// returned if not all tracts were added.
+template<class entry_type,class collect_type,class add_type>
+bool accumulate_tract_voxels(size_t tract_count,const tipl::geometry<3>& geo,bool show_prog,
+                             collect_type&& collect,add_type&& add)
+{
+    const unsigned int block_count = std::max<unsigned int>(1,std::thread::hardware_concurrency());
+    const unsigned int slab_depth = std::max<unsigned int>(1,(geo.depth()+block_count*4-1)/(block_count*4));
+    const size_t slab_size = size_t(geo.plane_size())*slab_depth;
+    const unsigned int slab_count = (geo.depth()+slab_depth-1)/slab_depth;
+    const size_t chunk_size = 32768;
+    size_t from = 0;
+    for(;show_prog ? check_prog(from,tract_count) : from < tract_count;from += chunk_size)
+    {
+        size_t to = std::min<size_t>(tract_count,from+chunk_size);
+        std::vector<std::vector<std::vector<entry_type> > > bins(block_count,
+                        std::vector<std::vector<entry_type> >(slab_count));
+        tipl::par_for(block_count,[&](unsigned int block)
+        {
+            std::vector<entry_type> entries;
+            for(size_t i = from+(to-from)*block/block_count;i < from+(to-from)*(block+1)/block_count;++i)
+            {
+                entries.clear();
+                collect(i,entries);
+                for(unsigned int j = 0;j < entries.size();++j)
+                    bins[block][tdi_entry_index(entries[j])/slab_size].push_back(entries[j]);
+            }
+        });
+        tipl::par_for(slab_count,[&](unsigned int slab)
+        {
+            for(unsigned int block = 0;block < block_count;++block)
+                for(unsigned int j = 0;j < bins[block][slab].size();++j)
+                    add(bins[block][slab][j]);
+        });
+    }
+    return from >= tract_count;
+}
+//---------------------------------------------------------------------------
+bool TractModel::get_density_map(tipl::image<unsigned int,3>& mapping,
                                  const tipl::matrix<4,4,float>& transformation,bool endpoint)
 {
     tipl::geometry<3> geometry = mapping.geometry();
     begin_prog("calculating");
-    for (unsigned int i = 0;check_prog(i,tract_data.size());++i)
+    return accumulate_tract_voxels<unsigned int>(tract_data.size(),geometry,true,
+                            [&](size_t i,std::vector<unsigned int>& point_list)
     {
-        std::set<unsigned int> point_set;
         for (unsigned int j = 0;j < tract_data[i].size();j+=3)
         {
             if(j && endpoint)
@@ -1554,13 +1769,16 @@ void TractModel::get_density_map(tipl::image<unsigned int,3>& mapping,
             int z = std::round(tmp[2]);
             if (!geometry.is_valid(x,y,z))
                 continue;
-            point_set.insert((z*mapping.height()+y)*mapping.width()+x);
+            point_list.push_back((z*mapping.height()+y)*mapping.width()+x);
         }
-
-        std::vector<unsigned int> point_list(point_set.begin(),point_set.end());
-        for(unsigned int j = 0;j < point_list.size();++j)
-            ++mapping[point_list[j]];
-    }
+        // each tract counts once in a voxel
+        std::sort(point_list.begin(),point_list.end());
+        point_list.erase(std::unique(point_list.begin(),point_list.end()),point_list.end());
+    },
+    [&](unsigned int index)
+    {
+        ++mapping[index];
+    });
 }
 //---------------------------------------------------------------------------
 void TractModel::get_density_map(
@@ -1570,7 +1788,9 @@ void TractModel::get_density_map(
     tipl::geometry<3> geometry = mapping.geometry();
     tipl::image<float,3> map_r(geometry),
                             map_g(geometry),map_b(geometry);
-    for (unsigned int i = 0;i < tract_data.size();++i)
+    // the caller may be showing its own progress, so this pass does not report any
+    accumulate_tract_voxels<tdi_color_entry>(tract_data.size(),geometry,false,
+                            [&](size_t i,std::vector<tdi_color_entry>& entries)
     {
         const float* buf = &*tract_data[i].begin();
         for (unsigned int j = 3;j < tract_data[i].size();j+=3)
@@ -1589,21 +1809,29 @@ void TractModel::get_density_map(
             int z = std::round(tmp[2]);
             if (!geometry.is_valid(x,y,z))
                 continue;
-            unsigned int ptr = (z*mapping.height()+y)*mapping.width()+x;
-            map_r[ptr] += std::fabs(dir[0]);
-            map_g[ptr] += std::fabs(dir[1]);
-            map_b[ptr] += std::fabs(dir[2]);
+            tdi_color_entry entry;
+            entry.index = (z*mapping.height()+y)*mapping.width()+x;
+            entry.r = std::fabs(dir[0]);
+            entry.g = std::fabs(dir[1]);
+            entry.b = std::fabs(dir[2]);
+            entries.push_back(entry);
         }
-    }
+    },
+    [&](const tdi_color_entry& entry)
+    {
+        map_r[entry.index] += entry.r;
+        map_g[entry.index] += entry.g;
+        map_b[entry.index] += entry.b;
+    });
     float max_value = 0.0f;
     for(unsigned int index = 0;index < mapping.size();++index)
         max_value = std::max<float>(max_value,map_r[index]+map_g[index]+map_b[index]);
 
-    for(unsigned int index = 0;index < mapping.size();++index)
+    tipl::par_for(mapping.size(),[&](unsigned int index)
     {
         float sum = map_r[index]+map_g[index]+map_b[index];
         if(sum == 0.0f)
-            continue;
+            return;
         tipl::vector<3> v(map_r[index],map_g[index],map_b[index]);
         sum = v.normalize();
         v*=255.0*std::log(200.0f*sum/max_value+1)/2.303f;
@@ -1611,10 +1839,10 @@ void TractModel::get_density_map(
                 (unsigned char)std::min<float>(255,v[0]),
                 (unsigned char)std::min<float>(255,v[1]),
                 (unsigned char)std::min<float>(255,v[2]));
-    }
+    });
 }
 
-void TractModel::save_tdi(const char* file_name,bool sub_voxel,bool endpoint,const std::vector<float>& trans)
+bool TractModel::save_tdi(const char* file_name,bool sub_voxel,bool endpoint,const std::vector<float>& trans)
 {
     tipl::matrix<4,4,float> tr;
     tr.zero();
@@ -1629,7 +1857,8 @@ void TractModel::save_tdi(const char* file_name,bool sub_voxel,bool endpoint,con
     else
         tdi.resize(geometry);
 
-    get_density_map(tdi,tr,endpoint);
+    if(!get_density_map(tdi,tr,endpoint))
+        return false;
     gz_nifti nii_header;
     nii_header.set_voxel_size(new_vs);
     if(!trans.empty())
@@ -1648,7 +1877,7 @@ void TractModel::save_tdi(const char* file_name,bool sub_voxel,bool endpoint,con
     tipl::flip_xy(tdi);
     nii_header << tdi;
     nii_header.save_to_file(file_name);
-
+    return true;
 }
 
 
@@ -1687,14 +1916,28 @@ void TractModel::get_quantitative_data(std::vector<float>& data)
     // tract volume
     {
 
-        std::set<tipl::vector<3,int> > pass_map;
-        for (unsigned int i = 0;i < tract_data.size();++i)
+        // voxels inside the volume are marked on a mask, and the rest are counted by a set
+        tipl::image<unsigned char,3> pass_mask(geometry);
+        unsigned int thread_count = std::max<unsigned int>(1,std::thread::hardware_concurrency());
+        std::vector<std::vector<tipl::vector<3,int> > > outside(thread_count);
+        tipl::par_for2(tract_data.size(),[&](unsigned int i,unsigned int id)
+        {
             for (unsigned int j = 0;j < tract_data[i].size();j += 3)
-                pass_map.insert(tipl::vector<3,int>(std::round(tract_data[i][j]),
-                                              std::round(tract_data[i][j+1]),
-                                              std::round(tract_data[i][j+2])));
-
-        data.push_back(pass_map.size()*voxel_volume);
+            {
+                tipl::vector<3,int> p(std::round(tract_data[i][j]),
+                                      std::round(tract_data[i][j+1]),
+                                      std::round(tract_data[i][j+2]));
+                if(geometry.is_valid(p))
+                    pass_mask.at(p[0],p[1],p[2]) = 1;
+                else
+                    outside[id].push_back(p);
+            }
+        },thread_count);
+        std::set<tipl::vector<3,int> > pass_map;
+        for(unsigned int id = 0;id < outside.size();++id)
+            pass_map.insert(outside[id].begin(),outside[id].end());
+        size_t pass_count = pass_map.size()+std::count(pass_mask.begin(),pass_mask.end(),1);
+        data.push_back(pass_count*voxel_volume);
     }
 
     // output mean and std of each index
@@ -1747,22 +1990,40 @@ void TractModel::get_quantitative_info(std::string& result)
 
 extern track_recognition track_network;
 
+// calls fun(tract_index,profile,thread_id) for each tract with a profile. Each thread
+// reuses its own profile buffer, which the network can then overwrite with its output.
+// Tracts still go through the network one at a time: tipl::ml::network has no batched
+// forward pass, so the callers only share the per-thread buffers and accumulators.
+template<class fun_type>
+static void for_each_profile(const std::shared_ptr<fib_data>& handle,
+                             const std::vector<std::vector<float> >& tract_data,
+                             unsigned int thread_count,fun_type fun)
+{
+    std::vector<std::vector<float> > profile(thread_count);
+    tipl::par_for2(tract_data.size(),[&](unsigned int i,unsigned int id)
+    {
+        if(handle->get_profile(tract_data[i],profile[id]))
+            fun(i,profile[id],id);
+    },thread_count);
+}
 
 bool TractModel::recognize(std::map<float,std::string,std::greater<float> >& result)
 {
     if(!track_network.can_recognize())
         return false;
-    std::vector<float> accu_input(track_network.cnn.get_output_size());
-    tipl::par_for(tract_data.size(),[&](int i)
+    unsigned int thread_count = std::max<unsigned int>(1,std::thread::hardware_concurrency());
+    // each thread sums its own output
+    std::vector<std::vector<float> > accu_inputs(thread_count,std::vector<float>(track_network.cnn.get_output_size()));
+    for_each_profile(handle,tract_data,thread_count,[&](unsigned int,std::vector<float>& input,unsigned int id)
     {
-        std::vector<float> input;
-        if(!handle->get_profile(tract_data[i],input))
-            return;
         track_network.cnn.forward_propagation(input);
         tipl::minus_constant(input,*std::min_element(input.begin(),input.end()));
         tipl::multiply_constant(input,1.0f/std::accumulate(input.begin(),input.end(),0.0f));
-        tipl::add(accu_input,input);
+        tipl::add(accu_inputs[id],input);
     });
+    std::vector<float> accu_input(track_network.cnn.get_output_size());
+    for(unsigned int id = 0;id < thread_count;++id)
+        tipl::add(accu_input,accu_inputs[id]);
     tipl::multiply_constant(accu_input,1.0f/std::accumulate(accu_input.begin(),accu_input.end(),0.0f));
     for(int i = 0;i < accu_input.size();++i)
         result[accu_input[i]] = track_network.track_name[i];
@@ -1814,16 +2075,17 @@ void TractModel::recognize_report(std::string& report)
     */
     if(!handle->is_human_data || !track_network.can_recognize())
         return;
-    std::vector<int> recog_count(track_network.cnn.get_output_size());
-    tipl::par_for(tract_data.size(),[&](int i)
+    unsigned int thread_count = std::max<unsigned int>(1,std::thread::hardware_concurrency());
+    std::vector<std::vector<int> > recog_counts(thread_count,std::vector<int>(track_network.cnn.get_output_size()));
+    for_each_profile(handle,tract_data,thread_count,[&](unsigned int,std::vector<float>& input,unsigned int id)
     {
-        std::vector<float> input;
-        if(!handle->get_profile(tract_data[i],input))
-            return;
         track_network.cnn.forward_propagation(input);
         input[80] = -100;// suppress false tracks ID:20
-        ++recog_count[std::max_element(input.begin(),input.end())-input.begin()];
+        ++recog_counts[id][std::max_element(input.begin(),input.end())-input.begin()];
     });
+    std::vector<int> recog_count(track_network.cnn.get_output_size());
+    for(unsigned int id = 0;id < thread_count;++id)
+        tipl::add(recog_count,recog_counts[id]);
     {
         std::map<int,std::string,std::greater<int> > sorted_result;
         unsigned int report_threshold = tract_data.size()/20; //5%
@@ -2145,11 +2407,9 @@ void TractModel::run_clustering(unsigned char method_id,unsigned int cluster_cou
             std::fill(tract_cluster.begin(),tract_cluster.end(),80);
             if(!track_network.can_recognize())
                 return;
-            tipl::par_for(tract_data.size(),[&](int i)
+            for_each_profile(handle,tract_data,std::max<unsigned int>(1,std::thread::hardware_concurrency()),
+                             [&](unsigned int i,std::vector<float>& input,unsigned int)
             {
-                std::vector<float> input;
-                if(!handle->get_profile(tract_data[i],input))
-                    return;
                 track_network.cnn.predict(input,tract_cluster[i]);
             });
         }
@@ -2470,79 +2730,98 @@ bool ConnectivityMatrix::calculate(TractModel& tract_model,std::string matrix_va
     return true;
 
 }
+template<class fun_type>
+void for_each_source(unsigned int n,bool multi_thread,fun_type fun)
+{
+    if(multi_thread)
+        tipl::par_for(n,fun);
+    else
+        for(unsigned int i = 0;i < n;++i)
+            fun(i);
+}
+// breadth-first search from each node. The diagonal is the shortest cycle through the node.
 template<class matrix_type>
-void distance_bin(const matrix_type& bin,tipl::image<float,2>& D)
+void distance_bin(const matrix_type& bin,tipl::image<float,2>& D,bool multi_thread = true)
 {
     unsigned int n = bin.width();
-    tipl::image<unsigned int,2> A,Lpath;
-    A = bin;
-    Lpath = bin;
-    D = bin;
-    for(unsigned int l = 2;1;++l)
-    {
-        tipl::image<unsigned int,2> t(A.geometry());
-        tipl::mat::product(Lpath.begin(),A.begin(),t.begin(),tipl::dyndim(n,n),tipl::dyndim(n,n));
-        std::swap(Lpath,t);
-        bool con = false;
-        for(unsigned int i = 0;i < D.size();++i)
-            if(Lpath[i] != 0 && D[i] == 0)
+    std::vector<std::vector<unsigned int> > edges(n);
+    for(unsigned int v = 0,pos = 0;v < n;++v)
+        for(unsigned int w = 0;w < n;++w,++pos)
+            if(bin[pos] != 0)
+                edges[v].push_back(w);
+    D.clear();
+    D.resize(tipl::geometry<2>(n,n));
+    std::fill(D.begin(),D.end(),std::numeric_limits<float>::max());
+    for_each_source(n,multi_thread,[&](unsigned int i)
+    {
+        float* Di = &D[0]+size_t(i)*n;
+        std::vector<unsigned int> level(n),queue(1,i);
+        std::vector<unsigned char> visited(n);
+        visited[i] = 1;
+        for(size_t head = 0;head < queue.size();++head)
+        {
+            unsigned int v = queue[head];
+            for(unsigned int w : edges[v])
             {
-                D[i] = l;
-                con = true;
+                if(w == i)
+                    Di[i] = std::min<float>(Di[i],level[v]+1);
+                if(visited[w])
+                    continue;
+                visited[w] = 1;
+                level[w] = level[v]+1;
+                Di[w] = level[w];
+                queue.push_back(w);
             }
-        if(!con)
-            break;
-    }
-    std::replace(D.begin(),D.end(),(float)0,std::numeric_limits<float>::max());
+        }
+    });
 }
+// Dijkstra's algorithm from each node on the inverse weights
 template<class matrix_type>
-void distance_wei(const matrix_type& W_,tipl::image<float,2>& D)
+void distance_wei(const matrix_type& W_,tipl::image<float,2>& D,bool multi_thread = true)
 {
     tipl::image<float,2> W(W_);
     for(unsigned int i = 0;i < W.size();++i)
         W[i] = (W[i] != 0) ? 1.0/W[i]:0;
     unsigned int n = W.width();
+    std::vector<std::vector<std::pair<unsigned int,float> > > edges(n);
+    for(unsigned int v = 0,pos = 0;v < n;++v)
+        for(unsigned int k = 0;k < n;++k,++pos)
+            if(W[pos] > 0)
+                edges[v].push_back(std::make_pair(k,W[pos]));
     D.clear();
     D.resize(W.geometry());
     std::fill(D.begin(),D.end(),std::numeric_limits<float>::max());
-    for(unsigned int i = 0,dg = 0;i < n;++i,dg += n + 1)
-        D[dg] = 0;
-    for(unsigned int i = 0,in = 0;i < n;++i,in += n)
+    for_each_source(n,multi_thread,[&](unsigned int i)
     {
+        float* Di = &D[0]+size_t(i)*n;
+        Di[i] = 0;
         std::vector<unsigned char> S(n);
-        tipl::image<float,2> W1(W);
-
         std::vector<unsigned int> V;
         V.push_back(i);
         while(1)
         {
             for(unsigned int j = 0;j < V.size();++j)
-            {
                 S[V[j]] = 1;
-                for(unsigned int k = V[j];k < W1.size();k += n)
-                    W1[k] = 0;
-            }
             for(unsigned int j = 0;j < V.size();++j)
             {
                 unsigned int v = V[j];
-                unsigned int vn = v*n;
-                for(unsigned int k = 0;k < n;++k)
-                if(W1[vn+k] > 0)
-                    D[in+k] = std::min<float>(D[in+k],D[in+v]+W1[vn+k]);
+                for(const auto& e : edges[v])
+                    if(!S[e.first])
+                        Di[e.first] = std::min<float>(Di[e.first],Di[v]+e.second);
             }
             float minD = std::numeric_limits<float>::max();
             for(unsigned int j = 0;j < n;++j)
-                if(S[j] == 0 && minD > D[in+j])
-                    minD = D[in+j];
+                if(S[j] == 0 && minD > Di[j])
+                    minD = Di[j];
             if(minD == std::numeric_limits<float>::max())
                 break;
             V.clear();
             for(unsigned int j = 0;j < n;++j)
-                if(D[in+j]  == minD)
+                if(Di[j]  == minD)
                     V.push_back(j);
         }
-    }
-    std::replace(D.begin(),D.end(),(float)0.0,std::numeric_limits<float>::max());
+        std::replace(Di,Di+n,(float)0.0,std::numeric_limits<float>::max());
+    });
 }
 template<class matrix_type>
 void inv_dis(const matrix_type& D,matrix_type& e)
@@ -2688,12 +2967,13 @@ void ConnectivityMatrix::network_property(std::string& report)
     std::vector<float> local_efficiency_bin(n);
     //claculate local efficiency
     {
-        for(unsigned int i = 0,ipos = 0;i < n;++i,ipos += n)
+        tipl::par_for(n,[&](unsigned int i)
         {
+            unsigned int ipos = i*n;
             unsigned int new_n = std::accumulate(binary_matrix.begin()+ipos,
                                                  binary_matrix.begin()+ipos+n,0);
             if(new_n < 2)
-                continue;
+                return;
             tipl::image<float,2> newA(tipl::geometry<2>(new_n,new_n));
             unsigned int pos = 0;
             for(unsigned int j = 0,index = 0;j < n;++j)
@@ -2705,21 +2985,22 @@ void ConnectivityMatrix::network_property(std::string& report)
                         ++pos;
                     }
             tipl::image<float,2> invD;
-            distance_bin(newA,invD);
+            distance_bin(newA,invD,false);
             inv_dis(invD,invD);
             local_efficiency_bin[i] = std::accumulate(invD.begin(),invD.end(),0.0)/(new_n*new_n-new_n);
-        }
+        });
     }
 
     std::vector<float> local_efficiency_wei(n);
     {
 
-        for(unsigned int i = 0,ipos = 0;i < n;++i,ipos += n)
+        tipl::par_for(n,[&](unsigned int i)
         {
+            unsigned int ipos = i*n;
             unsigned int new_n = std::accumulate(binary_matrix.begin()+ipos,
                                                  binary_matrix.begin()+ipos+n,0);
             if(new_n < 2)
-                continue;
+                return;
             tipl::image<float,2> newA(tipl::geometry<2>(new_n,new_n));
             unsigned int pos = 0;
             for(unsigned int j = 0,index = 0;j < n;++j)
@@ -2735,14 +3016,14 @@ void ConnectivityMatrix::network_property(std::string& report)
                 if(binary_matrix[ipos+j])
                     sw.push_back(std::pow(norm_matrix[ipos+j],(float)(1.0/3.0)));
             tipl::image<float,2> invD;
-            distance_wei(newA,invD);
+            distance_wei(newA,invD,false);
             inv_dis(invD,invD);
             float numer = 0.0;
             for(unsigned int j = 0,index = 0;j < new_n;++j)
                 for(unsigned int k = 0;k < new_n;++k,++index)
                     numer += std::pow(invD[index],(float)(1.0/3.0))*sw[j]*sw[k];
             local_efficiency_wei[i] = numer/(new_n*new_n-new_n);
-        }
+        });
     }
 
 
@@ -2839,97 +3120,95 @@ void ConnectivityMatrix::network_property(std::string& report)
         }
     }
 
-    // betweenness
+    // betweenness: Brandes' algorithm from each node on worker threads. The dependencies
+    // of each source are kept and summed in the source order.
+    std::vector<std::vector<unsigned int> > out_edges(n),in_edges(n);
+    for(unsigned int v = 0,pos = 0;v < n;++v)
+        for(unsigned int w = 0;w < n;++w,++pos)
+            if(binary_matrix[pos])
+            {
+                out_edges[v].push_back(w);
+                in_edges[w].push_back(v);
+            }
     std::vector<float> betweenness_bin(n);
     {
-
-        tipl::image<unsigned int,2> NPd(binary_matrix),NSPd(binary_matrix),NSP(binary_matrix);
-        for(unsigned int i = 0,dg = 0;i < n;++i,dg += n+1)
-            NSP[dg] = 1;
-        tipl::image<unsigned int,2> L(NSP);
-        unsigned int d = 2;
-        for(;std::find(NSPd.begin(),NSPd.end(),1) != NSPd.end();++d)
+        tipl::image<float,2> DP(binary_matrix.geometry());
+        tipl::par_for(n,[&](unsigned int i)
         {
-            tipl::image<unsigned int,2> t(binary_matrix.geometry());
-            tipl::mat::product(NPd.begin(),binary_matrix.begin(),t.begin(),tipl::dyndim(n,n),tipl::dyndim(n,n));
-            t.swap(NPd);
-            for(unsigned int i = 0;i < L.size();++i)
+            std::vector<unsigned int> L(n),order(1,i);
+            std::vector<double> NSP(n),delta(n);
+            NSP[i] = 1.0;
+            L[i] = 1;
+            for(size_t head = 0;head < order.size();++head)
             {
-                NSPd[i] = (L[i] == 0) ? NPd[i]:0;
-                NSP[i] += NSPd[i];
-                L[i] += (NSPd[i] == 0) ? 0:d;
+                unsigned int v = order[head];
+                for(unsigned int w : out_edges[v])
+                {
+                    if(!L[w])
+                    {
+                        L[w] = L[v]+1;
+                        order.push_back(w);
+                    }
+                    if(L[w] == L[v]+1)
+                        NSP[w] += NSP[v];
+                }
             }
-        }
-
-        for(unsigned int i = 0,dg = 0;i < n;++i,dg += n+1)
-            L[dg] = 0;
-        std::replace(NSP.begin(),NSP.end(),0,1);
-        tipl::image<float,2> DP(binary_matrix.geometry());
-        for(--d;d >= 2;--d)
-        {
-            tipl::image<float,2> t(DP),DPd1(binary_matrix.geometry());
-            t += 1.0;
-            for(unsigned int i = 0;i < t.size();++i)
-                if(L[i] != d)
-                    t[i] = 0;
-                else
-                    t[i] /= NSP[i];
-            tipl::mat::product(t.begin(),binary_matrix.begin(),DPd1.begin(),tipl::dyndim(n,n),tipl::dyndim(n,n));
-            for(unsigned int i = 0;i < DPd1.size();++i)
-                if(L[i] != d-1)
-                    DPd1[i] = 0;
-                else
-                    DPd1[i] *= NSP[i];
-            DP += DPd1;
-        }
-
+            for(size_t j = order.size()-1;j > 0;--j)
+            {
+                unsigned int w = order[j];
+                for(unsigned int v : in_edges[w])
+                    if(L[v]+1 == L[w])
+                        delta[v] += NSP[v]/NSP[w]*(1.0+delta[w]);
+            }
+            for(unsigned int j = 0;j < n;++j)
+                if(j != i)
+                    DP[i*n+j] = delta[j];
+        });
         for(unsigned int i = 0,index = 0;i < n;++i)
             for(unsigned int j = 0;j < n;++j,++index)
                 betweenness_bin[j] += DP[index];
     }
     std::vector<float> betweenness_wei(n);
     {
-
-        for(unsigned int i = 0;i < n;++i)
+        tipl::image<float,2> DP_sum(binary_matrix.geometry());
+        tipl::par_for(n,[&](unsigned int i)
         {
             std::vector<float> D(n),NP(n);
             std::fill(D.begin(),D.end(),std::numeric_limits<float>::max());
             D[i] = 0;
             NP[i] = 1;
-            std::vector<unsigned char> S(n),Q(n);
+            std::vector<unsigned char> S(n);
+            std::vector<unsigned int> Q(n);
             int q = n-1;
             std::fill(S.begin(),S.end(),1);
-            tipl::image<unsigned char,2> P(binary_matrix.geometry());
-            tipl::image<float,2> G1(norm_matrix);
+            std::vector<std::vector<unsigned int> > P(n);
             std::vector<unsigned int> V;
             V.push_back(i);
             while(1)
             {
-                for(unsigned int j = 0,jpos = 0;j < n;++j,jpos += n)
-                    for(unsigned int k = 0;k < V.size();++k)
-                        G1[jpos+V[k]] = 0;
-
                 for(unsigned int k = 0;k < V.size();++k)
                 {
                     S[V[k]] = 0;
                     Q[q--]=V[k];
+                }
+                for(unsigned int k = 0;k < V.size();++k)
+                {
                     unsigned int v_rowk = V[k]*n;
-                    for(unsigned int w = 0,w_row = 0;w < n;++w, w_row += n)
-                        if(G1[v_rowk+w] > 0)
+                    for(unsigned int w : out_edges[V[k]])
+                        if(S[w] && norm_matrix[v_rowk+w] > 0)
                         {
-                            float Duw=D[V[k]]+G1[v_rowk+w];
+                            float Duw=D[V[k]]+norm_matrix[v_rowk+w];
                             if(Duw < D[w])
                             {
                                 D[w]=Duw;
                                 NP[w]=NP[V[k]];
-                                std::fill(P.begin()+w_row,P.begin()+w_row+n,0);
-                                P[w_row + V[k]] = 1;
+                                P[w].assign(1,V[k]);
                             }
                             else
                             if(Duw==D[w])
                             {
                                 NP[w]+=NP[V[k]];
-                                P[w_row+V[k]]=1;
+                                P[w].push_back(V[k]);
                             }
                         }
                 }
@@ -2953,16 +3232,18 @@ void ConnectivityMatrix::network_property(std::string& report)
             }
 
             std::vector<float> DP(n);
+            float* DPi = &DP_sum[0]+size_t(i)*n;
             for(unsigned int j = 0;j < n-1;++j)
             {
                 unsigned int w=Q[j];
-                unsigned int w_row = w*n;
-                betweenness_wei[w] += DP[w];
-                for(unsigned int k = 0;k < n;++k)
-                    if(P[w_row+k])
-                        DP[k] += (1.0+DP[w])*NP[k]/NP[w];
+                DPi[w] += DP[w];
+                for(unsigned int k : P[w])
+                    DP[k] += (1.0+DP[w])*NP[k]/NP[w];
             }
-        }
+        });
+        for(unsigned int i = 0,index = 0;i < n;++i)
+            for(unsigned int j = 0;j < n;++j,++index)
+                betweenness_wei[j] += DP_sum[index];
     }
 
 
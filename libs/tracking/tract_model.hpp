@@ -60,7 +60,8 @@ public:
         const tracking_data& get_fib(void) const{return *fib.get();}
         tracking_data& get_fib(void){return *fib.get();}
         void add(const TractModel& rhs);
-        bool load_from_file(const char* file_name,bool append = false);
+        // max_count > 0 loads an evenly spaced subset of the tracts
+        bool load_from_file(const char* file_name,bool append = false,size_t max_count = 0);
 
         bool save_tracts_in_native_space(const char* file_name,tipl::image<tipl::vector<3,float>,3 > native_position);
         bool save_tracts_to_file(const char* file_name);
@@ -115,11 +116,11 @@ public:
         std::vector<std::vector<float> >& get_tracts(void) {return tract_data;}
         unsigned int get_tract_color(unsigned int index) const{return tract_color[index];}
         size_t get_tract_length(unsigned int index) const{return tract_data[index].size();}
-        void get_density_map(tipl::image<unsigned int,3>& mapping,
+        bool get_density_map(tipl::image<unsigned int,3>& mapping,
              const tipl::matrix<4,4,float>& transformation,bool endpoint);
         void get_density_map(tipl::image<tipl::rgb,3>& mapping,
              const tipl::matrix<4,4,float>& transformation,bool endpoint);
-        void save_tdi(const char* file_name,bool sub_voxel,bool endpoint,const std::vector<float>& tran);
+        bool save_tdi(const char* file_name,bool sub_voxel,bool endpoint,const std::vector<float>& tran);
 
         void get_quantitative_data(std::vector<float>& data);
         void get_quantitative_info(std::string& result);
@@ -5,15 +5,140 @@
 #include <ctime>
 #include <iostream>
 #include <QTime>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <string>
+#include <vector>
+#include "prog_interface_static_link.h"
 
 std::auto_ptr<QProgressDialog> progressDialog;
 QTime t_total,t_last;
 bool lock_dialog = false;
 bool prog_aborted_ = false;
 bool silence = false;
+// the dialog can only be touched from the thread that created it
+std::thread::id main_thread_id = std::this_thread::get_id();
+bool is_main_thread(void)
+{
+    return std::this_thread::get_id() == main_thread_id;
+}
+
+// stage telemetry: the stage tree is only changed on the main thread while
+// items and bytes are counted atomically from any thread
+struct prog_stage_record{
+    std::string name;
+    int parent;
+    unsigned char level; // 0: scoped stage, 1: begin_prog, 2: set_title
+    std::chrono::steady_clock::time_point start;
+    double seconds;
+    size_t items,bytes_read,bytes_written;
+};
+bool profile_enabled = false;
+std::vector<prog_stage_record> stage_records;
+std::vector<int> open_stages;
+std::atomic<size_t> items_count(0),bytes_read_count(0),bytes_written_count(0);
+
+void prog_add_items(size_t count)
+{
+    items_count += count;
+}
+void prog_add_bytes_read(size_t bytes)
+{
+    bytes_read_count += bytes;
+}
+void prog_add_bytes_written(size_t bytes)
+{
+    bytes_written_count += bytes;
+}
+// counters hold the start values until the stage is closed
+static void close_stage(void)
+{
+    prog_stage_record& record = stage_records[open_stages.back()];
+    record.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now()-record.start).count();
+    record.items = items_count-record.items;
+    record.bytes_read = bytes_read_count-record.bytes_read;
+    record.bytes_written = bytes_written_count-record.bytes_written;
+    open_stages.pop_back();
+}
+static void open_stage(const char* name,unsigned char level)
+{
+    if(!profile_enabled || !is_main_thread())
+        return;
+    // begin_prog and set_title replace the stage at their own or a deeper level
+    while(level && !open_stages.empty() && stage_records[open_stages.back()].level >= level)
+        close_stage();
+    prog_stage_record record;
+    record.name = name;
+    record.parent = open_stages.empty() ? -1 : open_stages.back();
+    record.level = level;
+    record.start = std::chrono::steady_clock::now();
+    record.seconds = 0.0;
+    record.items = items_count;
+    record.bytes_read = bytes_read_count;
+    record.bytes_written = bytes_written_count;
+    open_stages.push_back(stage_records.size());
+    stage_records.push_back(record);
+}
+prog_stage::prog_stage(const char* name):depth(open_stages.size())
+{
+    open_stage(name,0);
+}
+prog_stage::~prog_stage(void)
+{
+    if(!is_main_thread())
+        return;
+    while(open_stages.size() > depth)
+        close_stage();
+}
+void begin_profile(void)
+{
+    profile_enabled = true;
+}
+static void write_stage(std::ostream& out,int parent,const std::string& indent)
+{
+    bool first = true;
+    for(unsigned int index = 0;index < stage_records.size();++index)
+        if(stage_records[index].parent == parent)
+        {
+            const prog_stage_record& record = stage_records[index];
+            std::string name;
+            for(char c : record.name)
+                if(c == '"' || c == '\\')
+                    name += std::string("\\")+c;
+                else
+                    if((unsigned char)c >= 32)
+                        name += c;
+            out << (first ? "\n" : ",\n") << indent << "{\"name\":\"" << name
+                << "\",\"seconds\":" << record.seconds
+                << ",\"items\":" << record.items
+                << ",\"bytes_read\":" << record.bytes_read
+                << ",\"bytes_written\":" << record.bytes_written
+                << ",\"stages\":[";
+            write_stage(out,index,indent+"  ");
+            out << "]}";
+            first = false;
+        }
+    if(!first)
+        out << "\n" << indent.substr(2);
+}
+bool save_profile(const char* file_name)
+{
+    while(!open_stages.empty())
+        close_stage();
+    std::ofstream out(file_name);
+    if(!out)
+        return false;
+    out << "{\"stages\":[";
+    write_stage(out,-1,"  ");
+    out << "]}" << std::endl;
+    return out.good();
+}
 
 void begin_prog(const char* title,bool lock)
 {
+    open_stage(title,1);
     if(!progressDialog.get())
     {
         std::cout << title << std::endl;
@@ -42,6 +167,9 @@ bool is_running(void)
 
 void set_title(const char* title)
 {
+    if(!is_main_thread())
+        return;
+    open_stage(title,2);
     if(!progressDialog.get())
     {
         std::cout << title << std::endl;
@@ -52,7 +180,7 @@ void set_title(const char* title)
 }
 bool check_prog(unsigned int now,unsigned int total)
 {
-    if(silence)
+    if(silence || !is_main_thread())
         return now < total;
     if(now >= total && progressDialog.get() && !lock_dialog)
     {
@@ -61,6 +189,12 @@ bool check_prog(unsigned int now,unsigned int total)
         QApplication::processEvents();
         return false;
     }
+    // in-range calls look at the dialog at most every 50 ms, however slow each iteration is
+    static std::chrono::steady_clock::time_point last_check;
+    auto check_time = std::chrono::steady_clock::now();
+    if(now && now < total && check_time - last_check < std::chrono::milliseconds(50))
+        return true;
+    last_check = check_time;
     if(progressDialog.get() && !progressDialog->isVisible())
         return now < total;
     if(now == 0 || now == total)
@@ -91,7 +225,7 @@ bool prog_aborted(void)
 {
     if(prog_aborted_)
         return true;
-    if(progressDialog.get())
+    if(progressDialog.get() && is_main_thread())
         return progressDialog->wasCanceled();
     return false;
 }
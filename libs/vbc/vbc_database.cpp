@@ -92,70 +92,78 @@ void vbc_database::run_permutation_multithread(unsigned int id,unsigned int thre
     std::vector<std::vector<float> > tracks;
     const int max_visible_track = 1000000;
     {
-        bool null = true;
-        for(int i = id;i < permutation_count && !terminated;)
+        // permutations of this shard are shard_id, shard_id+shard_count,..., distributed to threads
+        for(unsigned int i = shard_id + id*shard_count;shard_files.empty() && i < permutation_count && !terminated;
+            i += thread_count*shard_count)
         {
-
-            stat_model info;
-            info.resample(*model.get(),null,true);
-            calculate_spm(data,info,normalize_qa);
-
-            fib.fa = data.lesser_ptr;
-            unsigned int s = run_track(fib,tracks,seed_count);
-            if(null)
-                seed_lesser_null[i] = s;
-            else
-                seed_lesser[i] = s;
-
-            cal_hist(tracks,(null) ? subject_lesser_null : subject_lesser);
-
-            if(output_resampling && !null)
+            // each permutation has its own random sequence so that the results do not
+            // depend on the thread or process that runs it
+            stat_model permutation_model;
+            permutation_model = *model.get();
+            permutation_model.rand_gen.reset(i);
+            for(int null = 1;null >= 0 && !terminated;--null)
             {
-                std::lock_guard<std::mutex> lock(lock_lesser_tracks);
-                if(tracks.size() > max_visible_track/permutation_count)
-                    tracks.resize(max_visible_track/permutation_count);
-                lesser_track->add_tracts(tracks,length_threshold);
-                if(id == 1)
+                stat_model info;
+                info.resample(permutation_model,null,true);
+                calculate_spm(data,info,normalize_qa);
+
+                fib.fa = data.lesser_ptr;
+                unsigned int s = run_track(fib,tracks,seed_count);
+                if(null)
+                    seed_lesser_null[i] = s;
+                else
+                    seed_lesser[i] = s;
                 {
-                    lesser_track->delete_repeated(1.0f);
-                    lesser_track->clear_deleted();
+                    std::lock_guard<std::mutex> lock(lock_lesser_tracks);
+                    cal_hist(tracks,(null) ? subject_lesser_null : subject_lesser);
                 }
-                tracks.clear();
-            }
 
-            info.resample(*model.get(),null,true);
-            calculate_spm(data,info,normalize_qa);
-            fib.fa = data.greater_ptr;
-            s = run_track(fib,tracks,seed_count);
-            if(null)
-                seed_greater_null[i] = s;
-            else
-                seed_greater[i] = s;
-            cal_hist(tracks,(null) ? subject_greater_null : subject_greater);
-
-            if(output_resampling && !null)
-            {
-                std::lock_guard<std::mutex> lock(lock_greater_tracks);
-                if(tracks.size() > max_visible_track/permutation_count)
-                    tracks.resize(max_visible_track/permutation_count);
-                greater_track->add_tracts(tracks,length_threshold);
-                if(id == 1)
+                if(output_resampling && !null)
                 {
-                    greater_track->delete_repeated(1.0f);
-                    greater_track->clear_deleted();
+                    std::lock_guard<std::mutex> lock(lock_lesser_tracks);
+                    if(tracks.size() > max_visible_track/permutation_count)
+                        tracks.resize(max_visible_track/permutation_count);
+                    lesser_track->add_tracts(tracks,length_threshold);
+                    if(id == 1)
+                    {
+                        lesser_track->delete_repeated(1.0f);
+                        lesser_track->clear_deleted();
+                    }
+                    tracks.clear();
                 }
-                tracks.clear();
-            }
 
-            if(!null)
-            {
-                i += thread_count;
-                if(id == 0)
-                    progress = i*100/permutation_count;
+                info.resample(permutation_model,null,true);
+                calculate_spm(data,info,normalize_qa);
+                fib.fa = data.greater_ptr;
+                s = run_track(fib,tracks,seed_count);
+                if(null)
+                    seed_greater_null[i] = s;
+                else
+                    seed_greater[i] = s;
+                {
+                    std::lock_guard<std::mutex> lock(lock_greater_tracks);
+                    cal_hist(tracks,(null) ? subject_greater_null : subject_greater);
+                }
+
+                if(output_resampling && !null)
+                {
+                    std::lock_guard<std::mutex> lock(lock_greater_tracks);
+                    if(tracks.size() > max_visible_track/permutation_count)
+                        tracks.resize(max_visible_track/permutation_count);
+                    greater_track->add_tracts(tracks,length_threshold);
+                    if(id == 1)
+                    {
+                        greater_track->delete_repeated(1.0f);
+                        greater_track->clear_deleted();
+                    }
+                    tracks.clear();
+                }
             }
-            null = !null;
+            if(id == 0)
+                progress = std::min<unsigned int>(99,(i+1)*100/permutation_count);
         }
-        if(id == 0)
+        // the shards do not map the final results, which is done after merging
+        if(id == 0 && shard_count == 1)
         {
             stat_model info;
             info.resample(*model.get(),false,false);
@@ -181,6 +189,101 @@ void vbc_database::run_permutation_multithread(unsigned int id,unsigned int thre
     if(id == 0 && !terminated)
         progress = 100;
 }
+
+bool vbc_database::save_shard(const char* file_name)
+{
+    wait();
+    gz_mat_write mat_write(file_name);
+    if(!mat_write)
+    {
+        error_msg = "Cannot output shard file ";
+        error_msg += file_name;
+        return false;
+    }
+    unsigned int info[3] = {shard_id,shard_count,(unsigned int)seed_greater.size()};
+    mat_write.write("shard_info",info,1,3);
+    mat_write.write("subject_greater_null",&subject_greater_null[0],1,subject_greater_null.size());
+    mat_write.write("subject_lesser_null",&subject_lesser_null[0],1,subject_lesser_null.size());
+    mat_write.write("subject_greater",&subject_greater[0],1,subject_greater.size());
+    mat_write.write("subject_lesser",&subject_lesser[0],1,subject_lesser.size());
+    mat_write.write("seed_greater_null",&seed_greater_null[0],1,seed_greater_null.size());
+    mat_write.write("seed_lesser_null",&seed_lesser_null[0],1,seed_lesser_null.size());
+    mat_write.write("seed_greater",&seed_greater[0],1,seed_greater.size());
+    mat_write.write("seed_lesser",&seed_lesser[0],1,seed_lesser.size());
+    if(output_resampling)
+    {
+        if(greater_track->get_visible_track_count() &&
+           !greater_track->save_tracts_to_file((std::string(file_name)+".greater.mat").c_str()))
+            return false;
+        if(lesser_track->get_visible_track_count() &&
+           !lesser_track->save_tracts_to_file((std::string(file_name)+".lesser.mat").c_str()))
+            return false;
+    }
+    return true;
+}
+
+bool vbc_database::load_shards(void)
+{
+    std::vector<char> loaded(shard_files.size());
+    std::vector<unsigned int> shard_file_index(shard_files.size());
+    for(unsigned int i = 0;i < shard_files.size();++i)
+    {
+        gz_mat_read mat_read;
+        if(!mat_read.load_from_file(shard_files[i].c_str()))
+        {
+            error_msg = "Cannot read shard file ";
+            error_msg += shard_files[i];
+            return false;
+        }
+        unsigned int row,col;
+        const unsigned int* info = 0;
+        if(!mat_read.read("shard_info",row,col,info) || row*col != 3 ||
+           info[1] != shard_files.size() || info[0] >= shard_files.size() ||
+           info[2] != seed_greater.size() || loaded[info[0]])
+        {
+            error_msg = "Inconsistent shard file ";
+            error_msg += shard_files[i];
+            error_msg += ". Please provide all shards of the same permutation setting.";
+            return false;
+        }
+        loaded[info[0]] = 1;
+        shard_file_index[info[0]] = i;
+        auto add = [&](const char* name,std::vector<unsigned int>& sum)
+        {
+            const unsigned int* buf = 0;
+            if(!mat_read.read(name,row,col,buf) || row*col != sum.size())
+                return false;
+            for(unsigned int j = 0;j < sum.size();++j)
+                sum[j] += buf[j];
+            return true;
+        };
+        if(!add("subject_greater_null",subject_greater_null) ||
+           !add("subject_lesser_null",subject_lesser_null) ||
+           !add("subject_greater",subject_greater) ||
+           !add("subject_lesser",subject_lesser) ||
+           !add("seed_greater_null",seed_greater_null) ||
+           !add("seed_lesser_null",seed_lesser_null) ||
+           !add("seed_greater",seed_greater) ||
+           !add("seed_lesser",seed_lesser))
+        {
+            error_msg = "Invalid shard file ";
+            error_msg += shard_files[i];
+            return false;
+        }
+    }
+    // resampled tracks are appended in shard order
+    if(output_resampling)
+        for(unsigned int shard = 0;shard < shard_files.size();++shard)
+        {
+            std::string greater_file = shard_files[shard_file_index[shard]]+".greater.mat";
+            std::string lesser_file = shard_files[shard_file_index[shard]]+".lesser.mat";
+            if(QFileInfo(greater_file.c_str()).exists())
+                greater_track->load_from_file(greater_file.c_str(),true);
+            if(QFileInfo(lesser_file.c_str()).exists())
+                lesser_track->load_from_file(lesser_file.c_str(),true);
+        }
+    return true;
+}
 void vbc_database::clear(void)
 {
     if(!threads.empty())
@@ -311,7 +414,7 @@ void vbc_database::save_tracks_files(void)
     }
 }
 
-void vbc_database::run_permutation(unsigned int thread_count,unsigned int permutation_count)
+bool vbc_database::run_permutation(unsigned int thread_count,unsigned int permutation_count)
 {
     clear();
     // output report
@@ -425,9 +528,17 @@ void vbc_database::run_permutation(unsigned int thread_count,unsigned int permut
     spm_map = std::make_shared<connectometry_result>();
 
     progress = 0;
+    if(!shard_files.empty())
+    {
+        shard_id = 0;
+        shard_count = 1;
+        if(!load_shards())
+            return false;
+    }
     for(unsigned int index = 0;index < thread_count;++index)
         threads.push_back(std::make_shared<std::future<void> >(std::async(std::launch::async,
             [this,index,thread_count,permutation_count](){run_permutation_multithread(index,thread_count,permutation_count);})));
+    return true;
 }
 void vbc_database::calculate_FDR(void)
 {
@@ -75,7 +75,12 @@ public:// Multiple regression
     unsigned int track_trimming;
     std::string foi_str;
     void run_permutation_multithread(unsigned int id,unsigned int thread_count,unsigned int permutation_count);
-    void run_permutation(unsigned int thread_count,unsigned int permutation_count);
+    bool run_permutation(unsigned int thread_count,unsigned int permutation_count);
+public:// for running permutations in multiple processes
+    unsigned int shard_id = 0,shard_count = 1;
+    std::vector<std::string> shard_files;// shards to be merged
+    bool save_shard(const char* file_name);
+    bool load_shards(void);
     void calculate_FDR(void);
     void generate_report(std::string& output);
 };
@@ -13,6 +13,7 @@
 #include <iostream>
 #include <iterator>
 #include "program_option.hpp"
+#include "prog_interface_static_link.h"
 #include "cmd/cnt.cpp" // Qt project cannot build cnt.cpp without adding this.
 
 track_recognition track_network;
@@ -36,6 +37,7 @@ int vis(void);
 int ren(void);
 int cnn(void);
 int qc(void);
+int batch(void);
 
 
 QStringList search_files(QString dir,QString filter)
@@ -127,6 +129,7 @@ void init_application(void)
 program_option po;
 int run_action(std::shared_ptr<QApplication> gui)
 {
+    prog_stage stage((po.get("action")+" "+QFileInfo(po.get("source").c_str()).fileName().toStdString()).c_str());
     if(po.get("action") == std::string("rec"))
         return rec();
     if(po.get("action") == std::string("trk"))
@@ -147,6 +150,8 @@ int run_action(std::shared_ptr<QApplication> gui)
         return cnn();
     if(po.get("action") == std::string("qc"))
         return qc();
+    if(po.get("action") == std::string("batch"))
+        return batch();
     if(po.get("action") == std::string("vis"))
     {
         vis();
@@ -158,6 +163,28 @@ int run_action(std::shared_ptr<QApplication> gui)
     return 1;
 }
 
+int run_source(std::shared_ptr<QApplication> gui)
+{
+    QDir::setCurrent(QFileInfo(po.get("source").c_str()).absolutePath());
+    if(po.get("source").find('*') != std::string::npos)
+    {
+        auto file_list = QDir::current().entryList(QStringList(QFileInfo(po.get("source").c_str()).fileName()),
+                                        QDir::Files|QDir::NoSymLinks);
+        int result = 0;
+        for (unsigned int index = 0;index < file_list.size();++index)
+        {
+            QString filename = QDir::current().absoluteFilePath(file_list[index]);
+            std::cout << "=======================================" << std::endl;
+            std::cout << "Process file:" << filename.toStdString() << std::endl;
+            po.set("source",filename.toStdString());
+            if(run_action(gui) != 0)
+                result = 1;
+        }
+        return result;
+    }
+    return run_action(gui);
+}
+
 int run_cmd(int ac, char *av[])
 {
     try
@@ -192,22 +219,19 @@ int run_cmd(int ac, char *av[])
             std::cout << "invalid command, use --help for more detail" << std::endl;
             return 1;
         }
-        QDir::setCurrent(QFileInfo(po.get("source").c_str()).absolutePath());
-        if(po.get("source").find('*') != std::string::npos)
+        // --profile=report.json records wall time, items, and bytes of each stage
+        std::string profile = po.get("profile");
+        if(!profile.empty())
+            begin_profile();
+        int result = run_source(gui);
+        if(!profile.empty())
         {
-            auto file_list = QDir::current().entryList(QStringList(QFileInfo(po.get("source").c_str()).fileName()),
-                                            QDir::Files|QDir::NoSymLinks);
-            for (unsigned int index = 0;index < file_list.size();++index)
-            {
-                QString filename = QDir::current().absoluteFilePath(file_list[index]);
-                std::cout << "=======================================" << std::endl;
-                std::cout << "Process file:" << filename.toStdString() << std::endl;
-                po.set("source",filename.toStdString());
-                run_action(gui);
-            }
+            if(save_profile(profile.c_str()))
+                std::cout << "profile saved to " << profile << std::endl;
+            else
+                std::cout << "cannot save profile to " << profile << std::endl;
         }
-        else
-            return run_action(gui);
+        return result;
     }
     catch(const std::exception& e ) {
         std::cout << e.what() << std::endl;
@@ -221,7 +245,7 @@ int run_cmd(int ac, char *av[])
 
 int main(int ac, char *av[])
 {
-    if(ac > 2)
+    if(ac > 2 || (ac == 2 && std::string(av[1]) == "--action=batch")) // batch jobs may come from stdin
         return run_cmd(ac,av);
     QApplication a(ac,av);
     init_application();
@@ -221,7 +221,8 @@ void MainWindow::loadFib(QString filename)
     std::string file_name = filename.toLocal8Bit().begin();
     begin_prog("load fib");
     std::shared_ptr<fib_data> new_handle(new fib_data);
-    if (!new_handle->load_from_file(&*file_name.begin()))
+    // ODFs and connectometry data continue loading after the window opens
+    if (!new_handle->load_from_file(&*file_name.begin(),true))
     {
         if(!prog_aborted())
             QMessageBox::information(this,"error",new_handle->error_msg.c_str(),0);
@@ -41,22 +41,27 @@ GLWidget::GLWidget(bool samplebuffer,
     rotation_matrix.identity();
     transformation_matrix2.identity();
     rotation_matrix2.identity();
-    if (cur_tracking_window.handle->has_odfs())
+}
+
+// ODFs may arrive after the widget is built (staged fib loading), so the tables are made on first use
+void GLWidget::makeOdfColors(void)
+{
+    odf_color1.clear();
+    odf_color2.clear();
+    odf_color3.clear();
+    for (unsigned int index = 0; index < cur_tracking_window.odf_size; ++index)
     {
-        for (unsigned int index = 0; index < cur_tracking_window.odf_size; ++index)
-        {
-            odf_color1.push_back(std::abs(cur_tracking_window.handle->dir.odf_table[index][0]));
-            odf_color1.push_back(std::abs(cur_tracking_window.handle->dir.odf_table[index][1]));
-            odf_color1.push_back(std::abs(cur_tracking_window.handle->dir.odf_table[index][2]));
+        odf_color1.push_back(std::abs(cur_tracking_window.handle->dir.odf_table[index][0]));
+        odf_color1.push_back(std::abs(cur_tracking_window.handle->dir.odf_table[index][1]));
+        odf_color1.push_back(std::abs(cur_tracking_window.handle->dir.odf_table[index][2]));
 
-            odf_color2.push_back(0.1f);
-            odf_color2.push_back(0.1f);
-            odf_color2.push_back(0.8f);
+        odf_color2.push_back(0.1f);
+        odf_color2.push_back(0.1f);
+        odf_color2.push_back(0.8f);
 
-            odf_color3.push_back(0.8f);
-            odf_color3.push_back(0.1f);
-            odf_color3.push_back(0.1f);
-        }
+        odf_color3.push_back(0.8f);
+        odf_color3.push_back(0.1f);
+        odf_color3.push_back(0.1f);
     }
 }
 
@@ -65,7 +70,7 @@ GLWidget::~GLWidget()
     makeCurrent();
     for(int i = 0;i < slice_texture.size();++i)
         deleteTexture(slice_texture[i]);
-    glDeleteLists(tracts, 1);
+    clearTractBuffers();
     //std::cout << __FUNCTION__ << " " << __FILE__ << std::endl;
 }
 
@@ -382,7 +387,7 @@ void GLWidget::initializeGL()
     glEnable(GL_NORMALIZE);
     glColorMaterial(GL_FRONT_AND_BACK, GL_DIFFUSE);
     glBlendFunc (GL_DST_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-    tracts = glGenLists(1);
+    tracts = true;
     tract_alpha = -1; // ensure that make_track is called
     odf_position = 255;//ensure ODFs is renderred
     check_error(__FUNCTION__);
@@ -508,6 +513,8 @@ void GLWidget::renderLR()
     if (cur_tracking_window.handle->has_odfs() &&
         get_param("show_odf"))
     {
+        if(odf_color1.empty())
+            makeOdfColors();
         float fa_threshold = cur_tracking_window["fa_threshold"].toFloat();
         if(odf_position != get_param("odf_position") ||
            odf_skip != get_param("odf_skip") ||
@@ -772,7 +779,7 @@ void GLWidget::renderLR()
             //    std::cout << "Shader failed to bind:" << shader->log().toStdString() << std::endl;
             */
         }
-        glCallList(tracts);
+        drawTracts();
         glPopMatrix();
         glDisable(GL_COLOR_MATERIAL);
         glDisable(GL_BLEND);
@@ -1193,12 +1200,12 @@ void GLWidget::add_odf(const std::vector<tipl::pixel_index<3> >& odf_pos_)
             iter2->normalize();
     });
 }
-void myglColor(const tipl::vector<3,float>& color,float alpha)
+void GLWidget::clearTractBuffers(void)
 {
-    if(alpha == 1.0)
-        glColor3fv(color.begin());
-    else
-        glColor4f(color[0],color[1],color[2],alpha);
+    QOpenGLFunctions *glFuncs = QOpenGLContext::currentContext()->functions();
+    for(auto& lod : tract_lods)
+        glFuncs->glDeleteBuffers(3,lod.buffers);
+    tract_lods.clear();
 }
 
 void GLWidget::makeTracts(void)
@@ -1206,333 +1213,107 @@ void GLWidget::makeTracts(void)
     if(!tracts)
         return;
     makeCurrent();
-    glDeleteLists(tracts, 1);
-    glNewList(tracts, GL_COMPILE);
-    float alpha = (tract_alpha_style == 0)? tract_alpha/2.0f:tract_alpha;
+    clearTractBuffers();
     const float detail_option[] = {1.0f,0.5f,0.25f,0.0f,0.0f};
-    bool show_end_points = tract_style == 2;
     const float variant_prob_option[] = {0.1f,0.2f,0.4f,0.95f,2.0f};
-    float variant_prob = variant_prob_option[tract_tube_detail];
-    float tube_detail = tube_diameter*detail_option[tract_tube_detail]*4.0f;
-    float skip_rate = 1.0;
-    std::vector<float> mean_fa;
-    unsigned int mean_fa_index = 0;
-    unsigned int track_num_index = cur_tracking_window.handle->get_name_index(cur_tracking_window.color_bar->get_tract_color_name().toStdString());
-    // show tract by index value
-    if (tract_color_style > 1)
+    tract_param.tract_style = tract_style;
+    tract_param.tract_color_style = tract_color_style;
+    tract_param.color_index = cur_tracking_window.handle->get_name_index(cur_tracking_window.color_bar->get_tract_color_name().toStdString());
+    tract_param.tube_diameter = tube_diameter;
+    tract_param.tube_detail = tube_diameter*detail_option[tract_tube_detail]*4.0f;
+    tract_param.variant_prob = variant_prob_option[tract_tube_detail];
+    tract_param.variant_size = tract_variant_size;
+    tract_param.variant_color = tract_variant_color;
+    tract_param.end_point_shift = end_point_shift;
+    tract_param.alpha = (tract_alpha_style == 0)? tract_alpha/2.0f:tract_alpha;
+    const color_bar_dialog* color_bar = cur_tracking_window.color_bar.get();
+    tract_param.get_color = [color_bar](float value){return color_bar->get_color(value);};
+
+    std::vector<tract_ref> all_tracts;
+    for (unsigned int active_tract_index = 0;
+            active_tract_index < cur_tracking_window.tractWidget->rowCount();
+            ++active_tract_index)
     {
-        if(tract_color_style == 3 || tract_color_style == 5)// mean value
-        {
-            for (unsigned int active_tract_index = 0;
-                    active_tract_index < cur_tracking_window.tractWidget->rowCount();
-                    ++active_tract_index)
-            {
-                if(cur_tracking_window.tractWidget->item(active_tract_index,0)->checkState() != Qt::Checked)
-                    continue;
-                TractModel* active_tract_model =
-                    cur_tracking_window.tractWidget->tract_models[active_tract_index];
-                if (active_tract_model->get_visible_track_count() == 0)
-                    continue;
-                unsigned int tracks_count = active_tract_model->get_visible_track_count();
-                for (unsigned int data_index = 0; data_index < tracks_count; ++data_index)
-                {
-                    unsigned int vertex_count =
-                            active_tract_model->get_tract_length(data_index)/3;
-                    if (vertex_count <= 1)
-                        continue;
-
-                    std::vector<float> fa_values;
-                    active_tract_model->get_tract_data(data_index,track_num_index,fa_values);
-                    if(tract_color_style == 3)
-                    {
-                        float sum = std::accumulate(fa_values.begin(),fa_values.end(),0.0f);
-                        sum /= (float)fa_values.size();
-                        mean_fa.push_back(sum);
-                    }
-                    if(tract_color_style == 5)
-                        mean_fa.push_back(*std::max_element(fa_values.begin(),fa_values.end()));
-                }
-            }
-        }
+        if(cur_tracking_window.tractWidget->item(active_tract_index,0)->checkState() != Qt::Checked)
+            continue;
+        const TractModel* active_tract_model =
+            cur_tracking_window.tractWidget->tract_models[active_tract_index];
+        unsigned int tracks_count = active_tract_model->get_visible_track_count();
+        for (unsigned int data_index = 0; data_index < tracks_count; ++data_index)
+            if(active_tract_model->get_tract_length(data_index) > 3)
+                all_tracts.push_back(tract_ref(active_tract_model,data_index));
     }
 
-    std::vector<tipl::vector<3,float> > points(8),previous_points(8),
-                                      normals(8),previous_normals(8);
-    tipl::rgb paint_color;
-    tipl::vector<3,float> paint_color_f;
-    std::vector<float> color;
-
+    // the full level shows at most tract_visible_tract tracts, evenly spaced
     unsigned int visible_tracts = get_param("tract_visible_tract");
+    if(all_tracts.size() > visible_tracts)
     {
-        unsigned int total_tracts = 0;
-        for (unsigned int active_tract_index = 0;
-                active_tract_index < cur_tracking_window.tractWidget->rowCount();
-                ++active_tract_index)
-        {
-            if(cur_tracking_window.tractWidget->item(active_tract_index,0)->checkState() != Qt::Checked)
-                continue;
-            TractModel* active_tract_model =
-                cur_tracking_window.tractWidget->tract_models[active_tract_index];
-            if (active_tract_model->get_visible_track_count() == 0)
-                continue;
-
-            total_tracts += active_tract_model->get_visible_track_count();
-        }
-        if(total_tracts != 0)
-            skip_rate = (float)visible_tracts/(float)total_tracts;
+        std::vector<tract_ref> shown_tracts(visible_tracts);
+        for(unsigned int i = 0;i < visible_tracts;++i)
+            shown_tracts[i] = all_tracts[size_t(i)*all_tracts.size()/visible_tracts];
+        all_tracts.swap(shown_tracts);
     }
-    tipl::uniform_dist<float> uniform_gen(0.0f,1.0f),random_size(-0.5f,0.5f),random_color(-0.05f,0.05f);
+
+    // level k keeps one tract per 2^k-voxel start/end cells and every 2^k-th point
+    QOpenGLFunctions *glFuncs = QOpenGLContext::currentContext()->functions();
+    std::vector<tract_ref> level_tracts(all_tracts);
+    for(unsigned int level = 0;level < 4;++level)
     {
-        for (unsigned int active_tract_index = 0;
-                active_tract_index < cur_tracking_window.tractWidget->rowCount();
-                ++active_tract_index)
+        if(level)
         {
-            if(cur_tracking_window.tractWidget->item(active_tract_index,0)->checkState() != Qt::Checked)
-                continue;
-            TractModel* active_tract_model =
-                cur_tracking_window.tractWidget->tract_models[active_tract_index];
-            if (active_tract_model->get_visible_track_count() == 0)
-                continue;
-
-            unsigned int tracks_count = active_tract_model->get_visible_track_count();
-            for (unsigned int data_index = 0; data_index < tracks_count; ++data_index)
-            {
-                unsigned int vertex_count =
-                        active_tract_model->get_tract_length(data_index)/3;
-                if (vertex_count <= 1)
-                    continue;
-
-                if(skip_rate < 1.0 && uniform_gen() > skip_rate)
-                {
-                    mean_fa_index++;
-                    continue;
-                }
-
-                const float* data_iter = &*(active_tract_model->get_tract(data_index).begin());
-
-                switch(tract_color_style)
-                {
-                case 1:
-                    paint_color = active_tract_model->get_tract_color(data_index);
-                    paint_color_f = tipl::vector<3,float>(paint_color.r,paint_color.g,paint_color.b);
-                    paint_color_f /= 255.0;
-                    break;
-                case 2:// local
-                    active_tract_model->get_tract_data(data_index,track_num_index,color);
-                    break;
-                case 3:// mean
-                case 5:// max
-                    paint_color_f = cur_tracking_window.color_bar->get_color(mean_fa[mean_fa_index++]);
-                    break;
-                }
-                tipl::vector<3,float> last_pos(data_iter),pos,
-                    vec_a(1,0,0),vec_b(0,1,0),
-                    vec_n,prev_vec_n,vec_ab,vec_ba,cur_color,previous_color;
-
-                glBegin((tract_style) ? GL_TRIANGLE_STRIP : GL_LINE_STRIP);
-                for (unsigned int j = 0, index = 0; index < vertex_count;j += 3, data_iter += 3, ++index)
-                {
-                    pos[0] = data_iter[0];
-                    pos[1] = data_iter[1];
-                    pos[2] = data_iter[2];
-                    if (index + 1 < vertex_count)
-                    {
-                        vec_n[0] = data_iter[3] - data_iter[0];
-                        vec_n[1] = data_iter[4] - data_iter[1];
-                        vec_n[2] = data_iter[5] - data_iter[2];
-                        vec_n.normalize();
-                    }
-
-                    switch(tract_color_style)
-                    {
-                    case 0://directional
-                        cur_color[0] = std::fabs(vec_n[0]);
-                        cur_color[1] = std::fabs(vec_n[1]);
-                        cur_color[2] = std::fabs(vec_n[2]);
-                        break;
-                    case 1://manual assigned
-                    case 3://mean anisotropy
-                    case 4://mean directional
-                    case 5://max anisotropy
-                        cur_color = paint_color_f;
-                        break;
-                    case 2://local anisotropy
-                        if(index < color.size())
-                            cur_color = cur_tracking_window.color_bar->get_color(color[index]);
-                        break;
-                    }
-
-                    if(tract_variant_color)
-                    {
-                        cur_color[0] += random_color();
-                        cur_color[1] += random_color();
-                        cur_color[2] += random_color();
-                    }
-
-                    // skip straight line!
-                    if(tract_style)
-                    {
-                    if (index != 0 && index+1 != vertex_count)
-                    {
-                        tipl::vector<3,float> displacement(data_iter+3);
-                        displacement -= last_pos;
-                        displacement -= prev_vec_n*(prev_vec_n*displacement);
-                        if (displacement.length() < tube_detail)
-                            continue;
-                    }
-\
-                    if (index == 0 && std::fabs(vec_a*vec_n) > 0.5)
-                        std::swap(vec_a,vec_b);
-
-                    vec_b = vec_a.cross_product(vec_n);
-                    vec_a = vec_n.cross_product(vec_b);
-                    vec_a.normalize();
-                    vec_b.normalize();
-                    vec_ba = vec_ab = vec_a;
-                    vec_ab += vec_b;
-                    vec_ba -= vec_b;
-                    vec_ab.normalize();
-                    vec_ba.normalize();
-                    // get normals
-                    {
-                        normals[0] = vec_a;
-                        normals[1] = vec_ab;
-                        normals[2] = vec_b;
-                        normals[3] = -vec_ba;
-                        normals[4] = -vec_a;
-                        normals[5] = -vec_ab;
-                        normals[6] = -vec_b;
-                        normals[7] = vec_ba;
-                    }
-                    if(tract_variant_size && uniform_gen() > variant_prob)
-                    {
-                        vec_ab += random_size();
-                        vec_ba += random_size();
-                        vec_a += random_size();
-                        vec_b += random_size();
-                    }
-                    vec_ab *= tube_diameter;
-                    vec_ba *= tube_diameter;
-                    vec_a *= tube_diameter;
-                    vec_b *= tube_diameter;
-
-                    // add point
-                    {
-                        std::fill(points.begin(),points.end(),pos);
-                        points[0] += vec_a;
-                        points[1] += vec_ab;
-                        points[2] += vec_b;
-                        points[3] -= vec_ba;
-                        points[4] -= vec_a;
-                        points[5] -= vec_ab;
-                        points[6] -= vec_b;
-                        points[7] += vec_ba;
-                    }
-                    // add end
-                    static const unsigned char end_sequence[8] = {4,3,5,2,6,1,7,0};
-                    if (index == 0)
-                    {
-                        /*
-                        glColor3fv(cur_color.begin());
-                        glNormal3f(-vec_n[0],-vec_n[1],-vec_n[2]);
-                        for (unsigned int k = 0;k < 8;++k)
-                            glVertex3fv(points[end_sequence[k]].begin());
-                        if(show_end_points)
-                            glEnd();*/
-                        if(show_end_points)
-                        {
-                            myglColor(cur_color,alpha);
-                            glNormal3f(-vec_n[0],-vec_n[1],-vec_n[2]);
-                            tipl::vector<3,float> shift(vec_n);
-                            shift *= -(int)end_point_shift;
-                            for (unsigned int k = 0;k < 8;++k)
-                            {
-                                tipl::vector<3,float> cur_point = points[end_sequence[k]];
-                                cur_point += shift;
-                                glVertex3fv(cur_point.begin());
-                            }
-                            glEnd();
-                        }
-                        else
-                        {
-                            myglColor(cur_color,alpha);
-                            glNormal3f(-vec_n[0],-vec_n[1],-vec_n[2]);
-                            for (unsigned int k = 0;k < 8;++k)
-                                glVertex3fv(points[end_sequence[k]].begin());
-                        }
-                    }
-                    else
-                    // add tube
-                    {
-
-                        if(!show_end_points)
-                        {
-                            myglColor(cur_color,alpha);
-                            glNormal3fv(normals[0].begin());
-                            glVertex3fv(points[0].begin());
-                            for (unsigned int k = 1;k < 8;++k)
-                            {
-                               myglColor(previous_color,alpha);
-                               glNormal3fv(previous_normals[k].begin());
-                               glVertex3fv(previous_points[k].begin());
-
-                               myglColor(cur_color,alpha);
-                               glNormal3fv(normals[k].begin());
-                               glVertex3fv(points[k].begin());
-                            }
-                            myglColor(cur_color,alpha);
-                            glNormal3fv(normals[0].begin());
-                            glVertex3fv(points[0].begin());
-                        }
-                        if(index +1 == vertex_count)
-                        {
-                            if(show_end_points)
-                            {
-                                glBegin((tract_style) ? GL_TRIANGLE_STRIP : GL_LINE_STRIP);
-                                myglColor(cur_color,alpha);
-                                glNormal3fv(vec_n.begin());
-                                tipl::vector<3,float> shift(vec_n);
-                                shift *= (int)end_point_shift;
-                                for (int k = 7;k >= 0;--k)
-                                {
-                                    tipl::vector<3,float> cur_point = points[end_sequence[k]];
-                                    cur_point += shift;
-                                    glVertex3fv(cur_point.begin());
-                                }
-                            }
-                            else
-                            {
-                                myglColor(cur_color,alpha);
-                                glNormal3fv(vec_n.begin());
-                                for (int k = 7;k >= 0;--k)
-                                    glVertex3fv(points[end_sequence[k]].begin());
-                            }
-                        }
-
-                    }
-
-                    previous_points.swap(points);
-                    previous_normals.swap(normals);
-                    previous_color = cur_color;
-                    prev_vec_n = vec_n;
-                    last_pos = pos;
-                    }
-                    else
-                    {
-                        myglColor(cur_color,alpha);
-                        glVertex3fv(pos.begin());
-                    }
-                }
-                glEnd();
-            }
+            std::vector<tract_ref> representatives;
+            get_tract_representatives(all_tracts,float(1 << level),representatives);
+            level_tracts.swap(representatives);
+        }
+        tract_geometry geo;
+        build_tract_geometry(level_tracts,1 << level,tract_param,geo);
+        tract_lod lod;
+        lod.size = geo.size();
+        lod.tube = geo.tube;
+        if(lod.size)
+        {
+            glFuncs->glGenBuffers(3,lod.buffers);
+            glFuncs->glBindBuffer(GL_ARRAY_BUFFER,lod.buffers[0]);
+            glFuncs->glBufferData(GL_ARRAY_BUFFER,geo.vertices.size()*sizeof(float),&geo.vertices[0],GL_STATIC_DRAW);
+            glFuncs->glBindBuffer(GL_ARRAY_BUFFER,lod.buffers[1]);
+            glFuncs->glBufferData(GL_ARRAY_BUFFER,geo.normals.size()*sizeof(float),&geo.normals[0],GL_STATIC_DRAW);
+            glFuncs->glBindBuffer(GL_ARRAY_BUFFER,lod.buffers[2]);
+            glFuncs->glBufferData(GL_ARRAY_BUFFER,geo.colors.size(),&geo.colors[0],GL_STATIC_DRAW);
+            glFuncs->glBindBuffer(GL_ARRAY_BUFFER,0);
         }
+        tract_lods.push_back(lod);
     }
-
-
-    glEndList();
-
     check_error(__FUNCTION__);
 }
+
+void GLWidget::drawTracts(void)
+{
+    if(tract_lods.empty())
+        return;
+    // one level coarser each time the view is zoomed out by half from the default zoom
+    float zoom = std::pow(transformation_matrix.det(),1.0/3.0);
+    unsigned int level = 0;
+    if(zoom > 0.0f && zoom < default_zoom)
+        level = std::min<unsigned int>(tract_lods.size()-1,(unsigned int)std::floor(std::log2(default_zoom/zoom)));
+    const tract_lod& lod = tract_lods[level];
+    if(!lod.size)
+        return;
+    QOpenGLFunctions *glFuncs = QOpenGLContext::currentContext()->functions();
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glEnableClientState(GL_NORMAL_ARRAY);
+    glEnableClientState(GL_COLOR_ARRAY);
+    glFuncs->glBindBuffer(GL_ARRAY_BUFFER,lod.buffers[0]);
+    glVertexPointer(3, GL_FLOAT, 0, 0);
+    glFuncs->glBindBuffer(GL_ARRAY_BUFFER,lod.buffers[1]);
+    glNormalPointer(GL_FLOAT, 0, 0);
+    glFuncs->glBindBuffer(GL_ARRAY_BUFFER,lod.buffers[2]);
+    glColorPointer(4, GL_UNSIGNED_BYTE, 0, 0);
+    glDrawArrays(lod.tube ? GL_TRIANGLE_STRIP : GL_LINES,0,GLsizei(lod.size));
+    glFuncs->glBindBuffer(GL_ARRAY_BUFFER,0);
+    glDisableClientState(GL_VERTEX_ARRAY);
+    glDisableClientState(GL_NORMAL_ARRAY);
+    glDisableClientState(GL_COLOR_ARRAY);
+}
 void GLWidget::resizeGL(int width_, int height_)
 {
     cur_width = width_;
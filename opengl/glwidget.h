@@ -13,6 +13,7 @@
 #endif
 #include "tracking/region/RegionModel.h"
 #include "tracking/tracking_window.h"
+#include "tract_geometry.hpp"
 class RenderingTableWidget;
 class GluQua{
 private:
@@ -28,6 +29,13 @@ public:
     GLUquadricObj* get(void) {return ptr;}
 };
 
+// tract geometry uploaded to vertex buffers, one per level of detail
+struct tract_lod{
+    GLuint buffers[3] = {0,0,0};// vertices, normals, colors
+    size_t size = 0;
+    bool tube = false;
+};
+
 class GLWidget : public QGLWidget
 {
 Q_OBJECT
@@ -46,6 +54,7 @@ public:
      tipl::vector<3,float> pos,dir1,dir2;
      std::vector<tipl::vector<3,float> > dirs;
      bool angular_selection;
+     float default_zoom = 1.0f;// zoom set when the window opens, used to pick tract LODs
      void get_pos(void);
      void set_view(unsigned char view_option);
      void scale_by(float scale);
@@ -83,6 +92,7 @@ public:
      int odf_dim = 0;
      int odf_slide_pos = 0;
      void add_odf(const std::vector<tipl::pixel_index<3> >& odf_pos);
+     void makeOdfColors(void);
 private: //glu
      std::shared_ptr<GluQua> RegionSpheres;
 public:
@@ -125,6 +135,11 @@ protected:
      float get_param_float(const char* name);
      bool check_change(const char* name,unsigned char& var);
      bool check_change(const char* name,float& var);
+ private:
+     tract_render_param tract_param;
+     std::vector<tract_lod> tract_lods;
+     void drawTracts(void);
+     void clearTractBuffers(void);
  private:
      float tract_alpha;
      unsigned char scale_voxel;
@@ -145,7 +160,7 @@ public:
      bool keep_slice = false;
      std::vector<tipl::vector<3,float> > keep_slice_points;
 public:
-     GLuint tracts = 0;
+     bool tracts = false;
      std::vector<GLuint> slice_texture;
 
      int slice_pos[3];
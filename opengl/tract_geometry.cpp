@@ -0,0 +1,385 @@
+#include <random>
+#include <numeric>
+#include <algorithm>
+#include <thread>
+#include <cstdint>
+#include "tract_geometry.hpp"
+#include "libs/tracking/tract_model.hpp"
+
+static void push_vertex(tract_geometry& to,const tract_geometry& from,size_t index)
+{
+    to.vertices.insert(to.vertices.end(),from.vertices.begin()+index*3,from.vertices.begin()+index*3+3);
+    to.normals.insert(to.normals.end(),from.normals.begin()+index*3,from.normals.begin()+index*3+3);
+    to.colors.insert(to.colors.end(),from.colors.begin()+index*4,from.colors.begin()+index*4+4);
+}
+
+void tract_geometry::append(const tract_geometry& rhs)
+{
+    if(rhs.vertices.empty())
+        return;
+    if(tube && !vertices.empty())
+    {
+        // degenerate triangles between the strips, keeping the winding of rhs
+        bool odd = size() & 1;
+        push_vertex(*this,*this,size()-1);
+        push_vertex(*this,rhs,0);
+        if(odd)
+            push_vertex(*this,rhs,0);
+    }
+    vertices.insert(vertices.end(),rhs.vertices.begin(),rhs.vertices.end());
+    normals.insert(normals.end(),rhs.normals.begin(),rhs.normals.end());
+    colors.insert(colors.end(),rhs.colors.begin(),rhs.colors.end());
+}
+
+// collects vertices in the way of glBegin/glColor/glNormal/glVertex/glEnd
+struct strip_writer{
+    tract_geometry& out;
+    tract_geometry strip;
+    float cur_normal[3] = {0.0f,0.0f,0.0f};
+    unsigned char cur_color[4] = {255,255,255,255};
+    strip_writer(tract_geometry& out_):out(out_){strip.tube = out.tube;}
+    void begin(void)
+    {
+        strip.vertices.clear();
+        strip.normals.clear();
+        strip.colors.clear();
+    }
+    void color(const tipl::vector<3,float>& c,float alpha)
+    {
+        for(unsigned int k = 0;k < 3;++k)
+            cur_color[k] = (unsigned char)std::max<float>(0.0f,std::min<float>(255.0f,c[k]*255.0f+0.5f));
+        cur_color[3] = (unsigned char)std::max<float>(0.0f,std::min<float>(255.0f,alpha*255.0f+0.5f));
+    }
+    void normal(const float* n)
+    {
+        std::copy(n,n+3,cur_normal);
+    }
+    void vertex(const float* v)
+    {
+        strip.vertices.insert(strip.vertices.end(),v,v+3);
+        strip.normals.insert(strip.normals.end(),cur_normal,cur_normal+3);
+        strip.colors.insert(strip.colors.end(),cur_color,cur_color+4);
+    }
+    void end(void)
+    {
+        if(out.tube)
+            out.append(strip);
+        else
+        for(size_t i = 1;i < strip.size();++i)
+        {
+            push_vertex(out,strip,i-1);
+            push_vertex(out,strip,i);
+        }
+        begin();
+    }
+};
+
+static void add_tract(const float* data_iter,unsigned int vertex_count,const std::vector<float>& color,
+                      const tipl::vector<3,float>& paint_color_f,const tract_render_param& param,
+                      std::mt19937& gen,strip_writer& out)
+{
+    std::uniform_real_distribution<float> uniform_gen(0.0f,1.0f),random_size(-0.5f,0.5f),random_color(-0.05f,0.05f);
+    bool show_end_points = param.tract_style == 2;
+    float alpha = param.alpha;
+    float tube_diameter = param.tube_diameter;
+    std::vector<tipl::vector<3,float> > points(8),previous_points(8),
+                                      normals(8),previous_normals(8);
+    tipl::vector<3,float> last_pos(data_iter),pos,
+        vec_a(1,0,0),vec_b(0,1,0),
+        vec_n,prev_vec_n,vec_ab,vec_ba,cur_color,previous_color;
+
+    out.begin();
+    for (unsigned int index = 0; index < vertex_count;data_iter += 3, ++index)
+    {
+        pos[0] = data_iter[0];
+        pos[1] = data_iter[1];
+        pos[2] = data_iter[2];
+        if (index + 1 < vertex_count)
+        {
+            vec_n[0] = data_iter[3] - data_iter[0];
+            vec_n[1] = data_iter[4] - data_iter[1];
+            vec_n[2] = data_iter[5] - data_iter[2];
+            vec_n.normalize();
+        }
+
+        switch(param.tract_color_style)
+        {
+        case 0://directional
+            cur_color[0] = std::fabs(vec_n[0]);
+            cur_color[1] = std::fabs(vec_n[1]);
+            cur_color[2] = std::fabs(vec_n[2]);
+            break;
+        case 1://manual assigned
+        case 3://mean anisotropy
+        case 4://mean directional
+        case 5://max anisotropy
+            cur_color = paint_color_f;
+            break;
+        case 2://local anisotropy
+            if(index < color.size())
+                cur_color = param.get_color(color[index]);
+            break;
+        }
+
+        if(param.variant_color)
+        {
+            cur_color[0] += random_color(gen);
+            cur_color[1] += random_color(gen);
+            cur_color[2] += random_color(gen);
+        }
+
+        if(!param.tract_style)
+        {
+            out.color(cur_color,alpha);
+            out.vertex(pos.begin());
+            continue;
+        }
+        // skip straight line!
+        if (index != 0 && index+1 != vertex_count)
+        {
+            tipl::vector<3,float> displacement(data_iter+3);
+            displacement -= last_pos;
+            displacement -= prev_vec_n*(prev_vec_n*displacement);
+            if (displacement.length() < param.tube_detail)
+                continue;
+        }
+
+        if (index == 0 && std::fabs(vec_a*vec_n) > 0.5)
+            std::swap(vec_a,vec_b);
+
+        vec_b = vec_a.cross_product(vec_n);
+        vec_a = vec_n.cross_product(vec_b);
+        vec_a.normalize();
+        vec_b.normalize();
+        vec_ba = vec_ab = vec_a;
+        vec_ab += vec_b;
+        vec_ba -= vec_b;
+        vec_ab.normalize();
+        vec_ba.normalize();
+        // get normals
+        {
+            normals[0] = vec_a;
+            normals[1] = vec_ab;
+            normals[2] = vec_b;
+            normals[3] = -vec_ba;
+            normals[4] = -vec_a;
+            normals[5] = -vec_ab;
+            normals[6] = -vec_b;
+            normals[7] = vec_ba;
+        }
+        if(param.variant_size && uniform_gen(gen) > param.variant_prob)
+        {
+            vec_ab += random_size(gen);
+            vec_ba += random_size(gen);
+            vec_a += random_size(gen);
+            vec_b += random_size(gen);
+        }
+        vec_ab *= tube_diameter;
+        vec_ba *= tube_diameter;
+        vec_a *= tube_diameter;
+        vec_b *= tube_diameter;
+
+        // add point
+        {
+            std::fill(points.begin(),points.end(),pos);
+            points[0] += vec_a;
+            points[1] += vec_ab;
+            points[2] += vec_b;
+            points[3] -= vec_ba;
+            points[4] -= vec_a;
+            points[5] -= vec_ab;
+            points[6] -= vec_b;
+            points[7] += vec_ba;
+        }
+        // add end
+        static const unsigned char end_sequence[8] = {4,3,5,2,6,1,7,0};
+        if (index == 0)
+        {
+            tipl::vector<3,float> end_normal(-vec_n);
+            out.color(cur_color,alpha);
+            out.normal(end_normal.begin());
+            tipl::vector<3,float> shift(vec_n);
+            shift *= show_end_points ? -param.end_point_shift : 0;
+            for (unsigned int k = 0;k < 8;++k)
+            {
+                tipl::vector<3,float> cur_point = points[end_sequence[k]];
+                cur_point += shift;
+                out.vertex(cur_point.begin());
+            }
+            if(show_end_points)
+                out.end();
+        }
+        else
+        // add tube
+        {
+            if(!show_end_points)
+            {
+                out.color(cur_color,alpha);
+                out.normal(normals[0].begin());
+                out.vertex(points[0].begin());
+                for (unsigned int k = 1;k < 8;++k)
+                {
+                   out.color(previous_color,alpha);
+                   out.normal(previous_normals[k].begin());
+                   out.vertex(previous_points[k].begin());
+
+                   out.color(cur_color,alpha);
+                   out.normal(normals[k].begin());
+                   out.vertex(points[k].begin());
+                }
+                out.color(cur_color,alpha);
+                out.normal(normals[0].begin());
+                out.vertex(points[0].begin());
+            }
+            if(index +1 == vertex_count)
+            {
+                if(show_end_points)
+                    out.begin();
+                out.color(cur_color,alpha);
+                out.normal(vec_n.begin());
+                tipl::vector<3,float> shift(vec_n);
+                shift *= show_end_points ? param.end_point_shift : 0;
+                for (int k = 7;k >= 0;--k)
+                {
+                    tipl::vector<3,float> cur_point = points[end_sequence[k]];
+                    cur_point += shift;
+                    out.vertex(cur_point.begin());
+                }
+            }
+        }
+
+        previous_points.swap(points);
+        previous_normals.swap(normals);
+        previous_color = cur_color;
+        prev_vec_n = vec_n;
+        last_pos = pos;
+    }
+    out.end();
+}
+
+void build_tract_geometry(const std::vector<tract_ref>& tracts,unsigned int point_step,
+                          const tract_render_param& param,tract_geometry& result)
+{
+    result = tract_geometry();
+    result.tube = param.tract_style;
+    if(tracts.empty())
+        return;
+    unsigned int block_count = std::min<size_t>(tracts.size(),
+                               std::max<unsigned int>(1,std::thread::hardware_concurrency())*4);
+    std::vector<tract_geometry> blocks(block_count);
+    tipl::par_for(block_count,[&](unsigned int block)
+    {
+        blocks[block].tube = result.tube;
+        strip_writer writer(blocks[block]);
+        std::mt19937 gen(block);
+        std::vector<float> data,color;
+        for(size_t i = tracts.size()*block/block_count;i < tracts.size()*(block+1)/block_count;++i)
+        {
+            const TractModel* model = tracts[i].first;
+            unsigned int index = tracts[i].second;
+            const std::vector<float>& tract = model->get_tract(index);
+            unsigned int vertex_count = tract.size()/3;
+            if (vertex_count <= 1)
+                continue;
+            tipl::vector<3,float> paint_color_f;
+            switch(param.tract_color_style)
+            {
+            case 1:
+                {
+                    tipl::rgb paint_color;
+                    paint_color = model->get_tract_color(index);
+                    paint_color_f = tipl::vector<3,float>(paint_color.r,paint_color.g,paint_color.b);
+                    paint_color_f /= 255.0;
+                }
+                break;
+            case 2:// local
+                model->get_tract_data(index,param.color_index,color);
+                break;
+            case 3:// mean
+            case 5:// max
+                model->get_tract_data(index,param.color_index,color);
+                if(color.empty())
+                    break;
+                paint_color_f = param.get_color(param.tract_color_style == 3 ?
+                        std::accumulate(color.begin(),color.end(),0.0f)/(float)color.size() :
+                        *std::max_element(color.begin(),color.end()));
+                break;
+            case 4:// mean directional
+                for(unsigned int j = 3;j < tract.size();j += 3)
+                {
+                    tipl::vector<3,float> dir(&tract[j]);
+                    dir -= tipl::vector<3,float>(&tract[j-3]);
+                    dir.normalize();
+                    paint_color_f[0] += std::fabs(dir[0]);
+                    paint_color_f[1] += std::fabs(dir[1]);
+                    paint_color_f[2] += std::fabs(dir[2]);
+                }
+                paint_color_f.normalize();
+                break;
+            }
+            const float* points = &tract[0];
+            if(point_step > 1)
+            {
+                // keep every point_step-th point and the last one
+                data.clear();
+                std::vector<float> step_color;
+                for(unsigned int j = 0;j < vertex_count;j += point_step)
+                {
+                    unsigned int k = (j + point_step >= vertex_count) ? vertex_count-1 : j;
+                    data.insert(data.end(),points+k*3,points+k*3+3);
+                    if(k < color.size())
+                        step_color.push_back(color[k]);
+                    if(k != j)
+                        break;
+                }
+                if(param.tract_color_style == 2)
+                    color.swap(step_color);
+                vertex_count = data.size()/3;
+                points = &data[0];
+                if (vertex_count <= 1)
+                    continue;
+            }
+            add_tract(points,vertex_count,color,paint_color_f,param,gen,writer);
+        }
+    });
+    size_t total_size = 0;
+    for(unsigned int block = 0;block < block_count;++block)
+        total_size += blocks[block].size()+3;
+    result.vertices.reserve(total_size*3);
+    result.normals.reserve(total_size*3);
+    result.colors.reserve(total_size*4);
+    for(unsigned int block = 0;block < block_count;++block)
+    {
+        result.append(blocks[block]);
+        blocks[block] = tract_geometry();
+    }
+}
+
+void get_tract_representatives(const std::vector<tract_ref>& tracts,float cell_size,
+                               std::vector<tract_ref>& representatives)
+{
+    auto cell_key = [cell_size](const float* p)
+    {
+        return (uint64_t(int64_t(std::floor(p[0]/cell_size))+(1 << 20)) << 42) |
+               (uint64_t(int64_t(std::floor(p[1]/cell_size))+(1 << 20)) << 21) |
+                uint64_t(int64_t(std::floor(p[2]/cell_size))+(1 << 20));
+    };
+    // a tract and its reversed copy share the same key
+    std::vector<std::pair<std::pair<uint64_t,uint64_t>,size_t> > keys(tracts.size());
+    tipl::par_for(tracts.size(),[&](size_t i)
+    {
+        const std::vector<float>& tract = tracts[i].first->get_tract(tracts[i].second);
+        uint64_t k1 = tract.empty() ? 0 : cell_key(&tract[0]);
+        uint64_t k2 = tract.empty() ? 0 : cell_key(&tract[tract.size()-3]);
+        keys[i] = std::make_pair(std::make_pair(std::min(k1,k2),std::max(k1,k2)),i);
+    });
+    std::sort(keys.begin(),keys.end());
+    std::vector<size_t> selected;
+    for(size_t i = 0;i < keys.size();++i)
+        if(i == 0 || keys[i].first != keys[i-1].first)
+            selected.push_back(keys[i].second);
+    std::sort(selected.begin(),selected.end());
+    representatives.resize(selected.size());
+    for(size_t i = 0;i < selected.size();++i)
+        representatives[i] = tracts[selected[i]];
+}
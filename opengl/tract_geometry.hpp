@@ -0,0 +1,41 @@
+#ifndef TRACT_GEOMETRY_HPP
+#define TRACT_GEOMETRY_HPP
+#include <vector>
+#include <functional>
+#include "tipl/tipl.hpp"
+class TractModel;
+
+typedef std::pair<const TractModel*,unsigned int> tract_ref;
+
+struct tract_render_param{
+    unsigned char tract_style = 0;       // 0:line 1:tube 2:end points
+    unsigned char tract_color_style = 0; // 0:directional 1:assigned 2:local 3:mean 4:mean directional 5:max
+    unsigned int color_index = 0;        // index for local, mean, and max values
+    float tube_diameter = 0.2f;
+    float tube_detail = 0.0f;
+    float variant_prob = 0.0f;
+    bool variant_size = false;
+    bool variant_color = false;
+    int end_point_shift = 0;
+    float alpha = 1.0f;
+    std::function<tipl::vector<3,float>(float)> get_color;
+};
+
+// vertex, normal, and color arrays of the tracts. Tubes and end points are one triangle strip
+// joined by degenerate triangles, and lines are drawn as GL_LINES.
+struct tract_geometry{
+    bool tube = false;
+    std::vector<float> vertices,normals;
+    std::vector<unsigned char> colors;// rgba
+    size_t size(void) const{return vertices.size()/3;}
+    void append(const tract_geometry& rhs);
+};
+
+// builds the geometry on worker threads. point_step > 1 keeps every point_step-th point of a tract.
+void build_tract_geometry(const std::vector<tract_ref>& tracts,unsigned int point_step,
+                          const tract_render_param& param,tract_geometry& result);
+// keeps the first tract of each pair of start and end cells on a grid of cell_size
+void get_tract_representatives(const std::vector<tract_ref>& tracts,float cell_size,
+                               std::vector<tract_ref>& representatives);
+
+#endif//TRACT_GEOMETRY_HPP
@@ -36,10 +36,9 @@ public:
     {
         options.clear();
         std::istringstream in(av);
-        while(in)
+        std::string str;
+        while(in >> str)
         {
-            std::string str;
-            in >> str;
             if(!add_option(str))
             {
                 error_msg = "cannot parse: ";
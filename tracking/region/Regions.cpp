@@ -1,5 +1,6 @@
 // ---------------------------------------------------------------------------
 #include <QInputDialog>
+#include <algorithm>
 #include <fstream>
 #include <iterator>
 #include "Regions.h"
@@ -25,11 +26,94 @@ void ROIRegion::add_points(std::vector<tipl::vector<3,float> >& points,bool del,
     add_points(new_points,del,resolution_ratio);
 }
 // ---------------------------------------------------------------------------
+void region_runs::encode(const std::vector<tipl::vector<3,short> >& points)
+{
+    start.clear();
+    length.clear();
+    axis.clear();
+    for(unsigned int index = 0;index < points.size();)
+    {
+        unsigned char run_axis = 0;
+        unsigned int run_length = 1;
+        if(index+1 < points.size())
+        {
+            tipl::vector<3,short> dis(points[index+1]);
+            dis -= points[index];
+            for(unsigned char d = 0;d < 3;++d)
+                if(dis[d] == 1 && !dis[(d+1)%3] && !dis[(d+2)%3])
+                {
+                    run_axis = d;
+                    for(run_length = 2;index+run_length < points.size() && run_length < 65535;++run_length)
+                    {
+                        tipl::vector<3,short> p(points[index+run_length-1]);
+                        ++p[d];
+                        if(p != points[index+run_length])
+                            break;
+                    }
+                }
+        }
+        start.push_back(points[index]);
+        length.push_back(run_length);
+        axis.push_back(run_axis);
+        index += run_length;
+    }
+}
+void region_runs::decode(std::vector<tipl::vector<3,short> >& points) const
+{
+    points.clear();
+    for(unsigned int index = 0;index < start.size();++index)
+    {
+        tipl::vector<3,short> p(start[index]);
+        for(unsigned int j = 0;j < length[index];++j,++p[axis[index]])
+            points.push_back(p);
+    }
+}
+// ---------------------------------------------------------------------------
+void ROIRegion::record_change(const std::vector<tipl::vector<3,short> >& added,
+                              const std::vector<tipl::vector<3,short> >& removed)
+{
+    if(added.empty() && removed.empty())
+        return;
+    undo_backup.push_back(region_change());
+    undo_backup.back().added.encode(added);
+    undo_backup.back().removed.encode(removed);
+    redo_backup.clear();
+}
+// ---------------------------------------------------------------------------
+void ROIRegion::apply_change(const region_change& change,bool reverse)
+{
+    std::vector<tipl::vector<3,short> > to_add,to_remove,result;
+    (reverse ? change.removed : change.added).decode(to_add);
+    (reverse ? change.added : change.removed).decode(to_remove);
+    result.resize(region.size());
+    result.resize(std::set_difference(region.begin(),region.end(),
+                                      to_remove.begin(),to_remove.end(),result.begin())-result.begin());
+    region.resize(result.size()+to_add.size());
+    region.resize(std::set_union(result.begin(),result.end(),
+                                 to_add.begin(),to_add.end(),region.begin())-region.begin());
+}
+// ---------------------------------------------------------------------------
+void ROIRegion::set_region(std::vector<tipl::vector<3,short> >& new_region,bool record)
+{
+    if(!std::is_sorted(new_region.begin(),new_region.end()))
+        std::sort(new_region.begin(),new_region.end());
+    new_region.erase(std::unique(new_region.begin(),new_region.end()),new_region.end());
+    if(record)
+    {
+        std::vector<tipl::vector<3,short> > added(new_region.size()),removed(region.size());
+        added.resize(std::set_difference(new_region.begin(),new_region.end(),
+                                         region.begin(),region.end(),added.begin())-added.begin());
+        removed.resize(std::set_difference(region.begin(),region.end(),
+                                           new_region.begin(),new_region.end(),removed.begin())-removed.begin());
+        record_change(added,removed);
+    }
+    region.swap(new_region);
+    modified = true;
+}
+// ---------------------------------------------------------------------------
 void ROIRegion::add_points(std::vector<tipl::vector<3,short> >& points, bool del,float point_resolution)
 {
     change_resolution(points,point_resolution);
-    if(!region.empty())
-        undo_backup.push_back(region);
     if(resolution_ratio == 1.0)
     {
         for(unsigned int index = 0; index < points.size();)
@@ -55,98 +139,93 @@ void ROIRegion::add_points(std::vector<tipl::vector<3,short> >& points, bool del
     }
     if(points.empty())
         return;
-    if(points.size()+ region.size() > 5000000)
+    if(points.size()+ region.size() > 5000000 && !region.empty())
     {
-        // for roll back
-        unsigned int region_size = region.size();
+        tipl::vector<3,short> min_value,max_value,geo_size;
+        tipl::bounding_box_mt(region,max_value,min_value);
         if(!del)
         {
-            region.insert(region.end(),points.begin(),points.end());
-            points.clear();
+            tipl::vector<3,short> min_value2,max_value2;
+            tipl::bounding_box_mt(points,max_value2,min_value2);
+            for(unsigned char d = 0;d < 3;++d)
+            {
+                min_value[d] = std::min(min_value[d],min_value2[d]);
+                max_value[d] = std::max(max_value[d],max_value2[d]);
+            }
         }
-        tipl::vector<3,short> min_value,max_value,geo_size;
-        tipl::bounding_box_mt(region,max_value,min_value);
-
         geo_size = max_value-min_value;
         tipl::geometry<3> mask_geo(geo_size[0]+1,geo_size[1]+1,geo_size[2]+1);
         tipl::image<unsigned char,3> mask;
-
+        bool has_mask = true;
         try
         {
             mask.resize(mask_geo);
         }
         catch(...)
         {
-            // roll back
-            region.resize(region_size);
-            goto alternative;
+            has_mask = false;
         }
-
-        tipl::par_for (region.size(),[&](unsigned int index)
-        {
-            auto p = region[index];
-            p -= min_value;
-            if (mask.geometry().is_valid(p))
-                mask.at(p[0],p[1],p[2]) = 1;
-        });
-
-        if(points.size())
-        tipl::par_for (points.size(),[&](unsigned int index)
+        if(has_mask)
         {
-            auto p = points[index];
-            p -= min_value;
-            if (mask.geometry().is_valid(p))
-                mask.at(p[0],p[1],p[2]) = 0;
-        });
-
-        points.clear();
-        region.clear();
-        for(tipl::pixel_index<3> index(mask.geometry());index.is_valid(mask.geometry());++index)
-            if(mask[index.index()])
-                region.push_back(tipl::vector<3,short>(index[0]+min_value[0],
-                                                    index[1]+min_value[1],
-                                                    index[2]+min_value[2]));
+            tipl::par_for (region.size(),[&](unsigned int index)
+            {
+                auto p = region[index];
+                p -= min_value;
+                if (mask.geometry().is_valid(p))
+                    mask.at(p[0],p[1],p[2]) = 1;
+            });
+            tipl::par_for (points.size(),[&](unsigned int index)
+            {
+                auto p = points[index];
+                p -= min_value;
+                if (mask.geometry().is_valid(p))
+                    mask.at(p[0],p[1],p[2]) = del ? 0:1;
+            });
+            points.clear();
+            std::vector<tipl::vector<3,short> > new_region;
+            for(tipl::pixel_index<3> index(mask.geometry());index.is_valid(mask.geometry());++index)
+                if(mask[index.index()])
+                    new_region.push_back(tipl::vector<3,short>(index[0]+min_value[0],
+                                                        index[1]+min_value[1],
+                                                        index[2]+min_value[2]));
+            set_region(new_region);
+            return;
+        }
+    }
+    std::sort(points.begin(),points.end());
+    points.erase(std::unique(points.begin(),points.end()),points.end());
+    std::vector<tipl::vector<3,short> > changed(points.size());
+    if(!del)
+    {
+        // voxels not yet in the region
+        changed.resize(std::set_difference(points.begin(),points.end(),
+                                           region.begin(),region.end(),
+                                           changed.begin())-changed.begin());
+        if(changed.empty())
+            return;
+        std::vector<tipl::vector<3,short> > union_points(region.size()+changed.size());
+        union_points.resize(std::set_union(region.begin(),region.end(),
+                                           changed.begin(),changed.end(),
+                                           union_points.begin())-union_points.begin());
+        region.swap(union_points);
+        record_change(changed,std::vector<tipl::vector<3,short> >());
     }
     else
     {
-        alternative:
-        std::sort(points.begin(),points.end());
-        if(!del)
-        {
-            if(region.empty())
-                region.swap(points);
-            else
-            {
-                std::vector<tipl::vector<3,short> > union_points(region.size()+points.size());
-                std::vector<tipl::vector<3,short> >::iterator it =
-                    std::set_union(region.begin(),region.end(),
-                                   points.begin(),points.end(),
-                                   union_points.begin());
-                union_points.resize(it-union_points.begin());
-                region.swap(union_points);
-            }
-        }
-        else
-        {
-            // find interset first
-            std::vector<tipl::vector<3,short> > intersect_points(std::max(region.size(),points.size()));
-            std::vector<tipl::vector<3,short> >::iterator it =
-                std::set_intersection(region.begin(),region.end(),
-                                      points.begin(),points.end(),
-                                      intersect_points.begin());
-            intersect_points.resize(it-intersect_points.begin());
-
-            std::vector<tipl::vector<3,short> > remain_points(region.size());
-            it = std::set_difference(region.begin(),region.end(),
-                                     intersect_points.begin(),intersect_points.end(),
-                                     remain_points.begin());
-            remain_points.resize(it-remain_points.begin());
-            region.swap(remain_points);
-        }
-        region.erase(std::unique(region.begin(), region.end()), region.end());
+        // voxels to be removed from the region
+        changed.resize(std::set_intersection(points.begin(),points.end(),
+                                             region.begin(),region.end(),
+                                             changed.begin())-changed.begin());
+        if(changed.empty())
+            return;
+        std::vector<tipl::vector<3,short> > remain_points(region.size());
+        remain_points.resize(std::set_difference(region.begin(),region.end(),
+                                                 changed.begin(),changed.end(),
+                                                 remain_points.begin())-remain_points.begin());
+        region.swap(remain_points);
+        record_change(std::vector<tipl::vector<3,short> >(),changed);
     }
     modified = true;
-
 }
 
 // ---------------------------------------------------------------------------
@@ -237,6 +316,9 @@ bool ROIRegion::LoadFromFile(const char* FileName) {
 
     modified = true;
     region.clear();
+    // a loaded region starts a new edit history
+    undo_backup.clear();
+    redo_backup.clear();
 
     if (ext == std::string(".txt"))
     {
@@ -250,6 +332,7 @@ bool ROIRegion::LoadFromFile(const char* FileName) {
             resolution_ratio = points.back()[0];
             points.pop_back();
         }
+        std::sort(points.begin(),points.end());
         region.swap(points);
         return true;
     }
@@ -273,7 +356,8 @@ bool ROIRegion::LoadFromFile(const char* FileName) {
         for (tipl::pixel_index<3> index(from.geometry());index < from.size();++index)
             if (from[index.index()])
                 points.push_back(tipl::vector<3,short>((const unsigned int*)index.begin()));
-        add_points(points,false,resolution_ratio);
+        std::sort(points.begin(),points.end());
+        region.swap(points);
         return true;
     }
 
@@ -374,48 +458,101 @@ void ROIRegion::perform(const std::string& action)
 
     if(resolution_ratio > 8)
         return;
-    tipl::image<unsigned char, 3>mask;
-    if(action == "smoothing")
+    if(action == "negate")
     {
+        tipl::image<unsigned char, 3>mask;
         SaveToBuffer(mask, 1);
-        tipl::morphology::smoothing(mask);
+        tipl::morphology::negate(mask);
         LoadFromBuffer(mask);
+        return;
     }
+    if(region.empty())
+        return;
+    tipl::geometry<3> geo = get_buffer_dim();
+    std::vector<tipl::vector<3,short> > new_region;
+    // erosion and dilation work on the sorted point list with the six face neighbors.
+    // Neighbors outside the volume neither erode nor get added, as in the full-volume mask.
     if(action == "erosion")
     {
-        SaveToBuffer(mask, 1);
-        tipl::morphology::erosion(mask);
-        LoadFromBuffer(mask);
+        std::vector<unsigned char> keep(region.size());
+        tipl::par_for (region.size(),[&](unsigned int index)
+        {
+            keep[index] = 1;
+            for(unsigned char d = 0;d < 3 && keep[index];++d)
+                for(short s = -1;s <= 1;s += 2)
+                {
+                    tipl::vector<3,short> p(region[index]);
+                    p[d] += s;
+                    if(geo.is_valid(p) && !std::binary_search(region.begin(),region.end(),p))
+                    {
+                        keep[index] = 0;
+                        break;
+                    }
+                }
+        });
+        for(unsigned int index = 0;index < region.size();++index)
+            if(keep[index])
+                new_region.push_back(region[index]);
+        set_region(new_region);
+        return;
     }
     if(action == "dilation")
     {
-        SaveToBuffer(mask, 1);
-        tipl::morphology::dilation(mask);
-        LoadFromBuffer(mask);
+        new_region.reserve(region.size()*7);
+        new_region = region;
+        for(unsigned int index = 0;index < region.size();++index)
+            for(unsigned char d = 0;d < 3;++d)
+                for(short s = -1;s <= 1;s += 2)
+                {
+                    tipl::vector<3,short> p(region[index]);
+                    p[d] += s;
+                    if(geo.is_valid(p))
+                        new_region.push_back(p);
+                }
+        set_region(new_region);
+        return;
     }
-    if(action == "defragment")
+    if(action != "smoothing" && action != "defragment")
+        return;
+    // operate on the bounding box of the region with a margin instead of the whole volume.
+    // The box is clipped to the volume so that the borders behave as in the full mask.
+    const short margin = 2;
+    tipl::vector<3,short> min_value,max_value;
+    tipl::bounding_box_mt(region,max_value,min_value);
+    for(unsigned char d = 0;d < 3;++d)
     {
-        SaveToBuffer(mask, 1);
-        tipl::morphology::defragment(mask);
-        LoadFromBuffer(mask);
+        min_value[d] = std::max<short>(0,min_value[d]-margin);
+        max_value[d] = std::min<short>(short(geo[d])-1,max_value[d]+margin);
     }
-    if(action == "negate")
+    tipl::image<unsigned char, 3>mask(tipl::geometry<3>(max_value[0]-min_value[0]+1,
+                                                        max_value[1]-min_value[1]+1,
+                                                        max_value[2]-min_value[2]+1));
+    tipl::par_for (region.size(),[&](unsigned int index)
     {
-        SaveToBuffer(mask, 1);
-        tipl::morphology::negate(mask);
-        LoadFromBuffer(mask);
-    }
-
+        auto p = region[index];
+        p -= min_value;
+        if (mask.geometry().is_valid(p))
+            mask.at(p[0],p[1],p[2]) = 1;
+    });
+    if(action == "smoothing")
+        tipl::morphology::smoothing(mask);
+    if(action == "defragment")
+        tipl::morphology::defragment(mask);
+    for(tipl::pixel_index<3> index(mask.geometry());index.is_valid(mask.geometry());++index)
+        if(mask[index.index()])
+            new_region.push_back(tipl::vector<3,short>(index[0]+min_value[0],
+                                                       index[1]+min_value[1],
+                                                       index[2]+min_value[2]));
+    set_region(new_region);
 }
 
 // ---------------------------------------------------------------------------
 void ROIRegion::Flip(unsigned int dimension) {
-    modified = true;
-    if(!region.empty())
-        undo_backup.push_back(region);
-    for (unsigned int index = 0; index < region.size(); ++index)
-        region[index][dimension] = (float)handle->dim[dimension]*resolution_ratio -
-                                   region[index][dimension] - 1;
+    std::vector<tipl::vector<3,short> > new_region(region);
+    for (unsigned int index = 0; index < new_region.size(); ++index)
+        new_region[index][dimension] = (float)handle->dim[dimension]*resolution_ratio -
+                                   new_region[index][dimension] - 1;
+    set_region(new_region);
 }
 
 // ---------------------------------------------------------------------------
@@ -424,10 +561,15 @@ void ROIRegion::shift(tipl::vector<3,float> dx) {
     if(resolution_ratio != 1.0)
         dx *= resolution_ratio;
     dx.round();
-    tipl::par_for(region.size(),[&](unsigned int index)
+    std::vector<tipl::vector<3,short> > new_region(region);
+    tipl::par_for(new_region.size(),[&](unsigned int index)
     {
-        region[index] += dx;
+        new_region[index] += dx;
     });
+    // the mesh was already moved by move_object
+    bool mesh_modified = modified;
+    set_region(new_region);
+    modified = mesh_modified;
 }
 // ---------------------------------------------------------------------------
 template<class Image,class Points>
@@ -3,6 +3,7 @@
 #define RegionsH
 #include <vector>
 #include <map>
+#include <algorithm>
 
 #include "tipl/tipl.hpp"
 #include "RegionModel.h"
@@ -16,13 +17,33 @@ const unsigned int end_id = 2;
 const unsigned int seed_id = 3;
 const unsigned int terminate_id = 4;
 
+// run-length encoded sorted point list, each run steps along one axis
+class region_runs {
+        std::vector<tipl::vector<3,short> > start;
+        std::vector<unsigned short> length;
+        std::vector<unsigned char> axis;
+public:
+        void encode(const std::vector<tipl::vector<3,short> >& points);
+        void decode(std::vector<tipl::vector<3,short> >& points) const;
+        bool empty(void) const {return start.empty();}
+};
+// the voxels added to and removed from a region by one edit
+struct region_change {
+        region_runs added,removed;
+};
+
 class ROIRegion {
 public:
         std::shared_ptr<fib_data> handle;
         std::vector<tipl::vector<3,short> > region;
         bool modified;
-        std::vector<std::vector<tipl::vector<3,short> > > undo_backup;
-        std::vector<std::vector<tipl::vector<3,short> > > redo_backup;
+        std::vector<region_change> undo_backup;
+        std::vector<region_change> redo_backup;
+private:
+        void record_change(const std::vector<tipl::vector<3,short> >& added,
+                           const std::vector<tipl::vector<3,short> >& removed);
+        void apply_change(const region_change& change,bool reverse);
+        void set_region(std::vector<tipl::vector<3,short> >& new_region,bool record = true);
 public:
         bool super_resolution = false;
         float resolution_ratio = 1.0;
@@ -104,6 +125,8 @@ public: // rendering options
         {
             region = region_;
             resolution_ratio = r;
+            undo_backup.clear();
+            redo_backup.clear();
             modified = true;
         }
 
@@ -111,14 +134,16 @@ public: // rendering options
 
         void clear(void)
         {
-            modified = true;
-            region.clear();
+            std::vector<tipl::vector<3,short> > new_region;
+            set_region(new_region);
         }
 
         void erase(unsigned int index)
         {
-            modified = true;
+            record_change(std::vector<tipl::vector<3,short> >(),
+                          std::vector<tipl::vector<3,short> >(1,region[index]));
             region.erase(region.begin()+index);
+            modified = true;
         }
 
         unsigned int size(void) const {return (unsigned int)region.size();}
@@ -169,28 +194,21 @@ public:
         void add_points(std::vector<tipl::vector<3,short> >& points,bool del,float point_resolution = 1.0);
         void undo(void)
         {
-            if(region.empty() && undo_backup.empty())
+            if(undo_backup.empty())
                 return;
-            redo_backup.push_back(std::vector<tipl::vector<3,short> >());
-            redo_backup.back().swap(region);
-            if(!undo_backup.empty())
-            {
-                region.swap(undo_backup.back());
-                undo_backup.pop_back();
-            }
+            apply_change(undo_backup.back(),true);
+            redo_backup.push_back(undo_backup.back());
+            undo_backup.pop_back();
             modified = true;
-
         }
         void redo(void)
         {
             if(redo_backup.empty())
                 return;
-            undo_backup.push_back(std::vector<tipl::vector<3,short> >());
-            undo_backup.back().swap(region);
-            region.swap(redo_backup.back());
+            apply_change(redo_backup.back(),false);
+            undo_backup.push_back(redo_backup.back());
             redo_backup.pop_back();
             modified = true;
-
         }
         void SaveToFile(const char* FileName);
         bool LoadFromFile(const char* FileName);
@@ -200,33 +218,33 @@ public:
         template<class image_type>
         void LoadFromBuffer(const image_type& from,const tipl::matrix<4,4,float>& trans)
         {
-            std::vector<tipl::vector<3,float> > points;
+            std::vector<tipl::vector<3,short> > points;
             for (tipl::pixel_index<3> index(handle->dim);index < handle->dim.size();++index)
             {
                 tipl::vector<3> p(index.begin());
                 p.to(trans);
                 p += 0.5;
                 if (from.geometry().is_valid(p) && from.at(p[0],p[1],p[2]) != 0)
-                    points.push_back(tipl::vector<3>(index.begin()));
+                    points.push_back(tipl::vector<3,short>(index.x(), index.y(),index.z()));
             }
-            region.clear();
-            add_points(points,false,1.0f);
+            change_resolution(points,1.0f);
+            tipl::geometry<3> geo = get_buffer_dim();
+            points.erase(std::remove_if(points.begin(),points.end(),
+                            [&](const tipl::vector<3,short>& p){return !geo.is_valid(p);}),points.end());
+            // only a replaced region needs an undo step
+            set_region(points,!region.empty());
         }
 
         template<class image_type>
         void LoadFromBuffer(const image_type& mask)
         {
-            modified = true;
-            if(!region.empty())
-                undo_backup.push_back(region);
-            region.clear();
             std::vector<tipl::vector<3,short> > points;
             for (tipl::pixel_index<3>index(mask.geometry());index < mask.size();++index)
                 if (mask[index.index()] != 0)
                     points.push_back(tipl::vector<3,short>(index.x(), index.y(),index.z()));
             if(mask.width() != handle->dim[0])
                 resolution_ratio = (float)mask.width()/(float)handle->dim[0];
-            region.swap(points);
+            set_region(points,!region.empty());
         }
         void SaveToBuffer(tipl::image<unsigned char, 3>& mask,unsigned char value=255);
         void perform(const std::string& action);
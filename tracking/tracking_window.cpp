@@ -352,7 +352,10 @@ tracking_window::tracking_window(QWidget *parent,std::shared_ptr<fib_data> new_h
 
 
     if(handle->dim[0] > 80)
-        ui->zoom_3d->setValue(80.0/(float)std::max<int>(std::max<int>(handle->dim[0],handle->dim[1]),handle->dim[2]));
+    {
+        glWidget->default_zoom = 80.0/(float)std::max<int>(std::max<int>(handle->dim[0],handle->dim[1]),handle->dim[2]);
+        ui->zoom_3d->setValue(glWidget->default_zoom);
+    }
 
     qApp->installEventFilter(this);
     #ifdef __APPLE__ // fix Mac shortcut problem. This can be removed after upgrading QT
@@ -374,6 +377,15 @@ tracking_window::tracking_window(QWidget *parent,std::shared_ptr<fib_data> new_h
     if((*this)["orientation_convention"].toInt() == 1)
         glWidget->set_view(2);
     glWidget->updateGL();
+
+    if(handle->is_loading())
+    {
+        ui->statusbar->showMessage("loading ODFs and connectometry data...");
+        load_timer.reset(new QTimer());
+        load_timer->setInterval(500);
+        connect(load_timer.get(), SIGNAL(timeout()), this, SLOT(check_loading()));
+        load_timer->start();
+    }
 }
 
 tracking_window::~tracking_window()
@@ -1765,6 +1777,26 @@ void tracking_window::check_reg(void)
     else
         glWidget->updateGL();
 }
+void tracking_window::check_loading(void)
+{
+    if(!handle->bulk_ready())
+        return;
+    load_timer.reset(0);
+    unsigned int view_item_count = handle->view_item.size();
+    if(!handle->finish_loading())
+    {
+        ui->statusbar->showMessage(handle->error_msg.c_str());
+        return;
+    }
+    for(unsigned int index = view_item_count;index < handle->view_item.size();++index)
+    {
+        slices.push_back(std::make_shared<SliceModel>(handle,index));
+        ui->SliceModality->addItem(handle->view_item[index].name.c_str());
+    }
+    updateSlicesMenu();
+    ui->statusbar->showMessage("ODFs and connectometry data loaded");
+    glWidget->updateGL();
+}
 void tracking_window::on_actionLoad_Color_Map_triggered()
 {
     QMessageBox::information(this,"Load color map","Please assign a text file of RGB numbers as the colormap.");
@@ -67,7 +67,7 @@ public:
 public:
     connectometry_result cnt_result;
 public:
-    std::auto_ptr<QTimer> timer,timer2;
+    std::auto_ptr<QTimer> timer,timer2,load_timer;
     unsigned int odf_size;
     unsigned int odf_face_size;
     void set_tracking_param(ThreadData& tracking_thread);
@@ -100,6 +100,7 @@ public slots:
     void on_show_r_toggled(bool checked);
     void on_show_position_toggled(bool checked);
     void check_reg(void);
+    void check_loading(void);
     void change_contrast();
 private slots:
     void on_actionRestore_window_layout_triggered();
@@ -1297,7 +1297,9 @@ void TractTableWidget::export_tract_density(tipl::geometry<3>& dim,
         {
             if(item(index,0)->checkState() != Qt::Checked)
                 continue;
-            tract_models[index]->get_density_map(tdi,transformation,end_point);
+            // a cancelled map is incomplete and not saved
+            if(!tract_models[index]->get_density_map(tdi,transformation,end_point))
+                return;
         }
         if(QFileInfo(filename).completeSuffix().toLower() == "mat")
         {